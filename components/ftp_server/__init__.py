@@ -6,20 +6,149 @@ DEPENDENCIES = ['network']
 CODEOWNERS = ['@youkorr']
 
 # Définir les constantes pour la configuration
+CONF_FTP_SERVER_ID = 'ftp_server_id'
 CONF_ROOT_PATH = 'root_path'
+CONF_PASSIVE_PORT_RANGE = 'passive_port_range'
+CONF_DOWNLOAD_BUFFER_SIZE = 'download_buffer_size'
+CONF_DOWNLOAD_BUFFERS = 'download_buffers'
+CONF_UPLOAD_BUFFER_SIZE = 'upload_buffer_size'
+CONF_TRANSFER_WORKERS = 'transfer_workers'
+CONF_TRANSFER_WORKER_CORE = 'transfer_worker_core'
+CONF_LISTING_CACHE_SIZE = 'listing_cache_size'
+CONF_MODE_Z = 'mode_z'
+CONF_COMPRESSION_LEVEL = 'compression_level'
+CONF_COMPRESSION_WINDOW_BITS = 'compression_window_bits'
+CONF_MAX_BANDWIDTH = 'max_bandwidth'
+CONF_SESSION_BANDWIDTH = 'session_bandwidth'
+CONF_CONTROL_RESERVE = 'control_reserve'
+CONF_MAX_SESSIONS = 'max_sessions'
+CONF_MAX_TRANSFERS = 'max_transfers'
+CONF_LOGIN_TIMEOUT = 'login_timeout'
+CONF_IDLE_TIMEOUT = 'idle_timeout'
+CONF_STORAGE = 'storage'
+CONF_RAM_VOLUME_SIZE = 'ram_volume_size'
+CONF_LITTLEFS_PARTITION = 'littlefs_partition'
+CONF_STAGING_SIZE = 'staging_size'
+CONF_ATOMIC_UPLOADS = 'atomic_uploads'
+CONF_SD_MMC_CARD_ID = 'sd_mmc_card_id'
+
+# Chaque port du pool garde un socket lwIP ouvert en permanence
+MAX_PASSIVE_PORTS = 16
+# Chaque session peut tenir trois sockets (contrôle, écoute passive, données)
+MAX_SESSIONS = 16
 
 # Créer l'espace de noms et la classe FTP
 ftp_ns = cg.esphome_ns.namespace('ftp_server')
 FTPServer = ftp_ns.class_('FTPServer', cg.Component)
+FTPStorageType = ftp_ns.enum('FTPStorageType')
+STORAGE_TYPES = {
+    'sd_card': FTPStorageType.FTP_STORAGE_SD_CARD,
+    'littlefs': FTPStorageType.FTP_STORAGE_LITTLEFS,
+    'ram': FTPStorageType.FTP_STORAGE_RAM,
+}
+
+# Carte montée par le composant sd_mmc_card, optionnelle
+sd_mmc_card_ns = cg.esphome_ns.namespace('sd_mmc_card')
+SdMmc = sd_mmc_card_ns.class_('SdMmc', cg.Component)
+
+def validate_port_range(value):
+    value = cv.string_strict(value)
+    parts = value.split('-')
+    if len(parts) != 2:
+        raise cv.Invalid("passive_port_range must look like '50000-50007'")
+    try:
+        start = cv.port(int(parts[0].strip()))
+        end = cv.port(int(parts[1].strip()))
+    except ValueError as err:
+        raise cv.Invalid(f"Invalid port in passive_port_range: {err}")
+    if end < start:
+        raise cv.Invalid("passive_port_range end must not be lower than its start")
+    if end - start + 1 > MAX_PASSIVE_PORTS:
+        raise cv.Invalid(f"passive_port_range may cover at most {MAX_PASSIVE_PORTS} ports")
+    return [start, end]
+
+def validate_buffer_size(value):
+    value = cv.int_range(min=4096, max=65536)(cv.positive_int(value))
+    if value % 512 != 0:
+        raise cv.Invalid("Transfer buffer sizes must be a multiple of 512 (SD sector size)")
+    return value
+
+BANDWIDTH_UNITS = {'b/s': 1, 'kb/s': 1000, 'kib/s': 1024, 'mb/s': 1000000, 'mib/s': 1048576}
+
+def validate_bandwidth(value):
+    # Octets par seconde, en entier ou avec unité ('200kB/s', '1.5MB/s'); 0 = illimité
+    if isinstance(value, int):
+        return cv.int_range(min=0)(value)
+    value = cv.string_strict(value).strip().replace(' ', '')
+    lowered = value.lower()
+    for unit in sorted(BANDWIDTH_UNITS, key=len, reverse=True):
+        if lowered.endswith(unit):
+            try:
+                number = float(lowered[:-len(unit)])
+            except ValueError as err:
+                raise cv.Invalid(f"Invalid bandwidth '{value}': {err}")
+            return cv.int_range(min=0, max=0xFFFFFFFF)(int(number * BANDWIDTH_UNITS[unit]))
+    raise cv.Invalid(f"Bandwidth '{value}' must be bytes per second or use one of {list(BANDWIDTH_UNITS)}")
+
+def validate_storage(config):
+    if config[CONF_STORAGE] == 'ram' and config[CONF_STAGING_SIZE] > 0:
+        raise cv.Invalid("staging_size makes no sense with storage: ram")
+    if CONF_LITTLEFS_PARTITION in config and config[CONF_STORAGE] != 'littlefs':
+        raise cv.Invalid("littlefs_partition requires storage: littlefs")
+    if CONF_SD_MMC_CARD_ID in config and config[CONF_STORAGE] != 'sd_card':
+        raise cv.Invalid("sd_mmc_card_id requires storage: sd_card")
+    # Le renommage final viderait d'un coup les écritures différées
+    if config.get(CONF_ATOMIC_UPLOADS) and config[CONF_STAGING_SIZE] > 0:
+        raise cv.Invalid("atomic_uploads cannot be combined with staging_size")
+    return config
 
 # Schéma de configuration
-CONFIG_SCHEMA = cv.Schema({
+CONFIG_SCHEMA = cv.All(cv.Schema({
     cv.GenerateID(): cv.declare_id(FTPServer),
     cv.Required(CONF_USERNAME): cv.string,
     cv.Required(CONF_PASSWORD): cv.string,
     cv.Optional(CONF_ROOT_PATH, default='/sdcard'): cv.string,
     cv.Optional(CONF_PORT, default=21): cv.port,
-}).extend(cv.COMPONENT_SCHEMA)
+    cv.Optional(CONF_PASSIVE_PORT_RANGE): validate_port_range,
+    # Tampons de lecture anticipée pour RETR (nombre x taille, en RAM DMA si possible)
+    cv.Optional(CONF_DOWNLOAD_BUFFER_SIZE, default=16384): validate_buffer_size,
+    cv.Optional(CONF_DOWNLOAD_BUFFERS, default=2): cv.int_range(min=2, max=4),
+    # Tampon d'écriture STOR, idéalement égal à allocation_unit_size de la carte
+    cv.Optional(CONF_UPLOAD_BUFFER_SIZE, default=16384): validate_buffer_size,
+    # 0 garde les transferts dans loop(); sinon tâches FreeRTOS dédiées
+    cv.Optional(CONF_TRANSFER_WORKERS, default=0): cv.int_range(min=0, max=4),
+    cv.Optional(CONF_TRANSFER_WORKER_CORE): cv.int_range(min=0, max=1),
+    # Octets de listings LIST/NLST/MLSD gardés en RAM, 0 pour désactiver
+    cv.Optional(CONF_LISTING_CACHE_SIZE, default=32768): cv.int_range(min=0, max=262144),
+    # Compression MODE Z (zlib); la fenêtre fixe la mémoire de deflate par transfert
+    cv.Optional(CONF_MODE_Z, default=False): cv.boolean,
+    cv.Optional(CONF_COMPRESSION_LEVEL, default=6): cv.int_range(min=1, max=9),
+    cv.Optional(CONF_COMPRESSION_WINDOW_BITS, default=12): cv.int_range(min=9, max=15),
+    # Limites de débit des transferts (seau à jetons), global et par session
+    cv.Optional(CONF_MAX_BANDWIDTH, default=0): validate_bandwidth,
+    cv.Optional(CONF_SESSION_BANDWIDTH, default=0): validate_bandwidth,
+    # Octets du seau global réservés aux réponses de contrôle
+    cv.Optional(CONF_CONTROL_RESERVE, default=2048): cv.int_range(min=0, max=65536),
+    # Admission : au-delà, le plus ancien client inactif est évincé, sinon refus (421)
+    cv.Optional(CONF_MAX_SESSIONS, default=8): cv.int_range(min=1, max=MAX_SESSIONS),
+    cv.Optional(CONF_MAX_TRANSFERS): cv.int_range(min=1, max=MAX_SESSIONS),
+    # 0 désactive le délai
+    cv.Optional(CONF_LOGIN_TIMEOUT, default='30s'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_IDLE_TIMEOUT, default='300s'): cv.positive_time_period_milliseconds,
+    # Stockage : carte SD (VFS FAT), LittleFS, ou volume en PSRAM perdu au redémarrage
+    cv.Optional(CONF_STORAGE, default='sd_card'): cv.enum(STORAGE_TYPES, lower=True),
+    cv.Optional(CONF_SD_MMC_CARD_ID): cv.use_id(SdMmc),
+    # Partition montée sur root_path; sans elle, LittleFS doit déjà y être monté
+    cv.Optional(CONF_LITTLEFS_PARTITION): cv.string,
+    cv.Optional(CONF_RAM_VOLUME_SIZE, default=262144): cv.int_range(min=4096, max=16777216),
+    # Écriture différée : les STOR arrivent en PSRAM et sont recopiés sur la carte
+    # en tâche de fond (0 = écriture directe)
+    cv.Optional(CONF_STAGING_SIZE, default=0): cv.int_range(min=0, max=8388608),
+    # STOR écrit dans un fichier temporaire sous root_path/.ftp_tmp, fermé
+    # puis renommé sur le fichier une fois reçu en entier
+    # (activé par défaut sans staging_size)
+    cv.Optional(CONF_ATOMIC_UPLOADS): cv.boolean,
+}).extend(cv.COMPONENT_SCHEMA), validate_storage)
 
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
@@ -30,6 +159,43 @@ async def to_code(config):
     cg.add(var.set_password(config[CONF_PASSWORD]))
     cg.add(var.set_root_path(config[CONF_ROOT_PATH]))
     cg.add(var.set_port(config[CONF_PORT]))
+    if CONF_PASSIVE_PORT_RANGE in config:
+        start, end = config[CONF_PASSIVE_PORT_RANGE]
+        cg.add(var.set_passive_port_range(start, end))
+    cg.add(var.set_download_buffer_size(config[CONF_DOWNLOAD_BUFFER_SIZE]))
+    cg.add(var.set_download_buffers(config[CONF_DOWNLOAD_BUFFERS]))
+    cg.add(var.set_upload_buffer_size(config[CONF_UPLOAD_BUFFER_SIZE]))
+    cg.add(var.set_transfer_workers(config[CONF_TRANSFER_WORKERS]))
+    if CONF_TRANSFER_WORKER_CORE in config:
+        cg.add(var.set_transfer_worker_core(config[CONF_TRANSFER_WORKER_CORE]))
+    cg.add(var.set_listing_cache_size(config[CONF_LISTING_CACHE_SIZE]))
+    cg.add(var.set_max_bandwidth(config[CONF_MAX_BANDWIDTH]))
+    cg.add(var.set_session_bandwidth(config[CONF_SESSION_BANDWIDTH]))
+    cg.add(var.set_control_reserve(config[CONF_CONTROL_RESERVE]))
+    cg.add(var.set_max_sessions(config[CONF_MAX_SESSIONS]))
+    if CONF_MAX_TRANSFERS in config:
+        cg.add(var.set_max_transfers(config[CONF_MAX_TRANSFERS]))
+    cg.add(var.set_login_timeout(config[CONF_LOGIN_TIMEOUT]))
+    cg.add(var.set_idle_timeout(config[CONF_IDLE_TIMEOUT]))
+    cg.add(var.set_storage_type(config[CONF_STORAGE]))
+    cg.add(var.set_ram_volume_size(config[CONF_RAM_VOLUME_SIZE]))
+    cg.add(var.set_staging_size(config[CONF_STAGING_SIZE]))
+    cg.add(var.set_atomic_uploads(config.get(CONF_ATOMIC_UPLOADS, config[CONF_STAGING_SIZE] == 0)))
+    if CONF_SD_MMC_CARD_ID in config:
+        card = await cg.get_variable(config[CONF_SD_MMC_CARD_ID])
+        cg.add_define("USE_FTP_SD_MMC_CARD")
+        cg.add(var.set_sd_card(card))
+    if CONF_LITTLEFS_PARTITION in config:
+        from esphome.components.esp32 import add_idf_component
+        add_idf_component(name="esp_littlefs", repo="https://github.com/joltwallet/esp_littlefs.git", ref="v1.14.8")
+        cg.add_define("USE_FTP_LITTLEFS")
+        cg.add(var.set_littlefs_partition(config[CONF_LITTLEFS_PARTITION]))
+    if config[CONF_MODE_Z]:
+        cg.add_define("USE_FTP_MODE_Z")
+        cg.add_library("madler/zlib", None, "https://github.com/madler/zlib.git#v1.3.1")
+        cg.add(var.set_mode_z(True))
+        cg.add(var.set_compression_level(config[CONF_COMPRESSION_LEVEL]))
+        cg.add(var.set_compression_window_bits(config[CONF_COMPRESSION_WINDOW_BITS]))
 
 
 
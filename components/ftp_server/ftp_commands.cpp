@@ -0,0 +1,864 @@
+#include "ftp_server.h"
+#include "esp_log.h"
+#include "esphome/core/hal.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <sys/stat.h>
+#include <ctime>
+#include <errno.h>
+#include <cstdlib>
+#include <cstring>
+
+namespace esphome {
+namespace ftp_server {
+
+static const char *TAG = "ftp_server";
+
+// Commands that may be sent before logging in.
+static const uint8_t CMD_NO_LOGIN = 1 << 0;
+// Commands that are handled while a data transfer is in flight. Anything else
+// stays in the session's line buffer until the transfer is over.
+static const uint8_t CMD_DURING_TRANSFER = 1 << 1;
+// Commands that also cut in on a hash job, which otherwise holds every line.
+static const uint8_t CMD_DURING_HASH = 1 << 2;
+
+// Telnet commands that may reach the control connection (RFC 854)
+static const uint8_t TELNET_IAC = 255;
+static const uint8_t TELNET_DONT = 254;
+static const uint8_t TELNET_WILL = 251;
+static const uint8_t TELNET_IP = 244;
+static const uint8_t TELNET_DM = 242;
+// telnet_state values
+static const uint8_t TELNET_DATA = 0;
+static const uint8_t TELNET_COMMAND = 1;
+static const uint8_t TELNET_OPTION = 2;
+
+// Verbs are packed big-endian, padded with zero bytes, so most are 3 or 4
+// letters but extensions such as XSHA256 still fit.
+static const size_t MAX_VERB_LENGTH = 8;
+
+static constexpr uint64_t pack_verb(const char *verb) {
+  uint64_t packed = 0;
+  bool ended = false;
+  for (size_t i = 0; i < MAX_VERB_LENGTH; i++) {
+    ended = ended || verb[i] == '\0';
+    packed = (packed << 8) | (ended ? 0 : uint8_t(verb[i]));
+  }
+  return packed;
+}
+
+// Upper-cases a verb into the same packing as pack_verb(const char *).
+// Returns 0 for anything that cannot be a verb.
+static uint64_t pack_verb(std::string_view verb) {
+  if (verb.size() < 3 || verb.size() > MAX_VERB_LENGTH) {
+    return 0;
+  }
+  uint64_t packed = 0;
+  for (size_t i = 0; i < MAX_VERB_LENGTH; i++) {
+    char c = i < verb.size() ? verb[i] : '\0';
+    if (c >= 'a' && c <= 'z') {
+      c -= 'a' - 'A';
+    }
+    packed = (packed << 8) | uint8_t(c);
+  }
+  return packed;
+}
+
+const FTPCommand *FTPServer::lookup_command(uint64_t verb) {
+  static const FTPCommand COMMANDS[] = {
+      {pack_verb("USER"), &FTPServer::cmd_user, CMD_NO_LOGIN},
+      {pack_verb("PASS"), &FTPServer::cmd_pass, CMD_NO_LOGIN},
+      // Queued behind a transfer: RFC 959 closes once it has completed.
+      {pack_verb("QUIT"), &FTPServer::cmd_quit, CMD_NO_LOGIN},
+      {pack_verb("NOOP"), &FTPServer::cmd_noop, CMD_NO_LOGIN | CMD_DURING_TRANSFER},
+      {pack_verb("ABOR"), &FTPServer::cmd_abor, CMD_DURING_TRANSFER | CMD_DURING_HASH},
+      {pack_verb("SYST"), &FTPServer::cmd_syst, CMD_NO_LOGIN},
+      {pack_verb("FEAT"), &FTPServer::cmd_feat, CMD_NO_LOGIN},
+      {pack_verb("TYPE"), &FTPServer::cmd_type, 0},
+      {pack_verb("PWD"), &FTPServer::cmd_pwd, 0},
+      {pack_verb("XPWD"), &FTPServer::cmd_pwd, 0},
+      {pack_verb("CWD"), &FTPServer::cmd_cwd, 0},
+      {pack_verb("XCWD"), &FTPServer::cmd_cwd, 0},
+      {pack_verb("CDUP"), &FTPServer::cmd_cdup, 0},
+      {pack_verb("XCUP"), &FTPServer::cmd_cdup, 0},
+      {pack_verb("PASV"), &FTPServer::cmd_pasv, 0},
+      {pack_verb("LIST"), &FTPServer::cmd_list, 0},
+      {pack_verb("NLST"), &FTPServer::cmd_nlst, 0},
+      {pack_verb("STOR"), &FTPServer::cmd_stor, 0},
+      {pack_verb("RETR"), &FTPServer::cmd_retr, 0},
+      {pack_verb("DELE"), &FTPServer::cmd_dele, 0},
+      {pack_verb("MKD"), &FTPServer::cmd_mkd, 0},
+      {pack_verb("XMKD"), &FTPServer::cmd_mkd, 0},
+      {pack_verb("RMD"), &FTPServer::cmd_rmd, 0},
+      {pack_verb("XRMD"), &FTPServer::cmd_rmd, 0},
+      {pack_verb("RNFR"), &FTPServer::cmd_rnfr, 0},
+      {pack_verb("RNTO"), &FTPServer::cmd_rnto, 0},
+      {pack_verb("SIZE"), &FTPServer::cmd_size, 0},
+      {pack_verb("MDTM"), &FTPServer::cmd_mdtm, 0},
+      {pack_verb("ALLO"), &FTPServer::cmd_allo, 0},
+      {pack_verb("REST"), &FTPServer::cmd_rest, 0},
+      {pack_verb("APPE"), &FTPServer::cmd_appe, 0},
+      {pack_verb("MLSD"), &FTPServer::cmd_mlsd, 0},
+      {pack_verb("MLST"), &FTPServer::cmd_mlst, 0},
+      {pack_verb("MODE"), &FTPServer::cmd_mode, 0},
+      {pack_verb("STAT"), &FTPServer::cmd_stat, CMD_DURING_TRANSFER},
+      {pack_verb("OPTS"), &FTPServer::cmd_opts, CMD_NO_LOGIN},
+      {pack_verb("HASH"), &FTPServer::cmd_hash, 0},
+      {pack_verb("RANG"), &FTPServer::cmd_rang, 0},
+      {pack_verb("XCRC"), &FTPServer::cmd_xcrc, 0},
+      {pack_verb("XMD5"), &FTPServer::cmd_xmd5, 0},
+      {pack_verb("XSHA1"), &FTPServer::cmd_xsha1, 0},
+      {pack_verb("XSHA256"), &FTPServer::cmd_xsha256, 0},
+      {pack_verb("XSHA512"), &FTPServer::cmd_xsha512, 0},
+      {pack_verb("SITE"), &FTPServer::cmd_site, 0},
+  };
+  static const size_t COMMAND_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+  // Open-addressed index over COMMANDS, built once. 128 slots keeps the load
+  // factor low enough that a lookup is one or two probes.
+  static const size_t INDEX_BITS = 7;
+  static const size_t INDEX_SIZE = 1 << INDEX_BITS;
+  static_assert(COMMAND_COUNT < INDEX_SIZE / 2, "grow the command index");
+  auto slot_of = [](uint64_t v) -> size_t { return (v * 0x9E3779B97F4A7C15ull) >> (64 - INDEX_BITS); };
+  static const std::array<int8_t, INDEX_SIZE> INDEX = [&slot_of]() {
+    std::array<int8_t, INDEX_SIZE> index;
+    index.fill(-1);
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+      size_t slot = slot_of(COMMANDS[i].verb);
+      while (index[slot] != -1) {
+        slot = (slot + 1) & (INDEX_SIZE - 1);
+      }
+      index[slot] = i;
+    }
+    return index;
+  }();
+
+  if (verb == 0) {
+    return nullptr;
+  }
+  for (size_t slot = slot_of(verb);; slot = (slot + 1) & (INDEX_SIZE - 1)) {
+    int8_t i = INDEX[slot];
+    if (i == -1) {
+      return nullptr;
+    }
+    if (COMMANDS[i].verb == verb) {
+      return &COMMANDS[i];
+    }
+  }
+}
+
+static std::string_view command_verb(std::string_view line) {
+  size_t space = line.find(' ');
+  return space == std::string_view::npos ? line : line.substr(0, space);
+}
+
+bool FTPServer::can_run_now(const FTPSession &session, std::string_view line) {
+  if (!session.hash_job && session.transfer.state == FTP_TRANSFER_DONE) {
+    return true;
+  }
+  const FTPCommand *command = lookup_command(pack_verb(command_verb(line)));
+  if (command == nullptr) {
+    return false;
+  }
+  if (session.hash_job) {
+    // Its only reply comes at the end, anything answered before would be
+    // taken for it.
+    return command->flags & CMD_DURING_HASH;
+  }
+  return command->flags & CMD_DURING_TRANSFER;
+}
+
+// Appends control bytes to the line buffer, stripping Telnet commands. An
+// interrupt (IP) or Synch mark (DM) throws away whatever the client typed
+// before it, so the ABOR that follows is the next line rather than queued
+// behind commands waiting for the transfer.
+void FTPServer::receive_control_bytes(FTPSession &session, const char *data, size_t len) {
+  if (session.telnet_state == TELNET_DATA && memchr(data, TELNET_IAC, len) == nullptr) {
+    session.command_buffer.append(data, len);
+    return;
+  }
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = data[i];
+    switch (session.telnet_state) {
+      case TELNET_DATA:
+        if (c == TELNET_IAC) {
+          session.telnet_state = TELNET_COMMAND;
+        } else {
+          session.command_buffer.push_back(c);
+        }
+        break;
+      case TELNET_COMMAND:
+        session.telnet_state = TELNET_DATA;
+        if (c == TELNET_IAC) {
+          session.command_buffer.push_back(c);
+        } else if (c == TELNET_IP || c == TELNET_DM) {
+          session.command_buffer.clear();
+        } else if (c >= TELNET_WILL && c <= TELNET_DONT) {
+          session.telnet_state = TELNET_OPTION;
+        }
+        break;
+      default:
+        // Option negotiation is ignored, as RFC 959 allows.
+        session.telnet_state = TELNET_DATA;
+        break;
+    }
+  }
+}
+
+// Start of the first complete ABOR line at or after pos, npos if none.
+static size_t find_abor_line(const std::string &buffer, size_t pos) {
+  static constexpr uint64_t ABOR = pack_verb("ABOR");
+  while (pos < buffer.size()) {
+    size_t eol = buffer.find('\n', pos);
+    if (eol == std::string::npos) {
+      break;
+    }
+    std::string_view line(buffer.data() + pos, eol - pos);
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    if (pack_verb(command_verb(line)) == ABOR) {
+      return pos;
+    }
+    pos = eol + 1;
+  }
+  return std::string::npos;
+}
+
+void FTPServer::process_buffered_commands(FTPSession &session) {
+  size_t start = 0;
+  while (session.in_use && !session.closing) {
+    size_t eol = session.command_buffer.find('\n', start);
+    if (eol == std::string::npos) {
+      break;
+    }
+    std::string_view line(session.command_buffer.data() + start, eol - start);
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    if (!can_run_now(session, line)) {
+      // Picked up again by loop() once the transfer has finished. An ABOR
+      // queued behind it cannot wait for that, and runs ahead of it.
+      size_t abor = find_abor_line(session.command_buffer, eol + 1);
+      if (abor == std::string::npos) {
+        break;
+      }
+      size_t abor_eol = session.command_buffer.find('\n', abor);
+      std::string abor_line = session.command_buffer.substr(abor, abor_eol - abor);
+      session.command_buffer.erase(abor, abor_eol + 1 - abor);
+      if (!abor_line.empty() && abor_line.back() == '\r') {
+        abor_line.pop_back();
+      }
+      process_command(session, abor_line);
+      continue;
+    }
+    start = eol + 1;
+    process_command(session, line);
+  }
+  if (session.in_use && !session.closing) {
+    session.command_buffer.erase(0, start);
+  }
+}
+
+void FTPServer::process_command(FTPSession &session, std::string_view line) {
+  std::string_view verb = command_verb(line);
+  std::string_view arg;
+  if (verb.size() < line.size()) {
+    arg = line.substr(verb.size() + 1);
+    size_t first_non_space = arg.find_first_not_of(" \t");
+    arg = first_non_space == std::string_view::npos ? std::string_view() : arg.substr(first_non_space);
+  }
+
+  uint64_t packed = pack_verb(verb);
+  if (packed == pack_verb("PASS")) {
+    ESP_LOGI(TAG, "FTP command: PASS ****");
+  } else {
+    ESP_LOGI(TAG, "FTP command: %.*s", (int) line.size(), line.data());
+  }
+
+  session.commands++;
+
+  const FTPCommand *command = lookup_command(packed);
+  if (command == nullptr) {
+    send_response(session.control_socket, 502, "Command not implemented");
+    return;
+  }
+  if (session.state != FTP_LOGGED_IN && !(command->flags & CMD_NO_LOGIN)) {
+    send_response(session.control_socket, 530, "Not logged in");
+    return;
+  }
+  uint32_t started_us = micros();
+  (this->*(command->handler))(session, arg);
+  telemetry_.command_latency.add(micros() - started_us);
+}
+
+void FTPServer::cmd_user(FTPSession &session, std::string_view arg) {
+  session.username = std::string(arg);
+  session.state = FTP_WAIT_LOGIN;
+  send_response(session.control_socket, 331, "Password required for " + session.username);
+}
+
+void FTPServer::cmd_pass(FTPSession &session, std::string_view arg) {
+  if (authenticate(session.username, std::string(arg))) {
+    session.state = FTP_LOGGED_IN;
+    send_response(session.control_socket, 230, "Login successful");
+  } else {
+    send_response(session.control_socket, 530, "Login incorrect");
+  }
+}
+
+void FTPServer::cmd_quit(FTPSession &session, std::string_view arg) {
+  send_response(session.control_socket, 221, "Goodbye");
+  release_session(session);
+}
+
+// RFC 959 4.1.3: a transfer in progress is answered 426 before ABOR's own 226.
+void FTPServer::cmd_abor(FTPSession &session, std::string_view arg) {
+  int client_socket = session.control_socket;
+  close_data_connection(session);
+  if (session.hash_job) {
+    ESP_LOGI(TAG, "Aborting hash of %s", session.hash_job->name.c_str());
+    finish_hash_job(session, 426, "Hash aborted");
+    send_response(client_socket, 226, "ABOR successful");
+    return;
+  }
+  switch (session.transfer.state) {
+    case FTP_TRANSFER_DONE:
+      if (session.site_job) {
+        // Nothing on the data connection: ABOR stops the SITE CPY/RMTREE.
+        ESP_LOGI(TAG, "Aborting SITE %s", describe_site_job(session).c_str());
+        abort_site_job(session);
+        send_response(client_socket, 226, "ABOR successful, " + session.site_job_result);
+        break;
+      }
+      send_response(client_socket, 225, "No transfer to abort");
+      break;
+    case FTP_TRANSFER_OFFLOADED:
+      // The worker stops at its next buffer; drain_worker_completions()
+      // sends both replies.
+      session.abort_requested = true;
+      abort_transfer(session);
+      break;
+    default:
+      ESP_LOGI(TAG, "Aborting transfer of %s after %u bytes", session.transfer.path.c_str(),
+               (unsigned) session.transfer.offset);
+      finish_transfer(session, 426, "Connection closed; transfer aborted");
+      send_response(client_socket, 226, "ABOR successful");
+      break;
+  }
+}
+
+void FTPServer::cmd_noop(FTPSession &session, std::string_view arg) {
+  send_response(session.control_socket, 200, "NOOP command successful");
+}
+
+void FTPServer::cmd_syst(FTPSession &session, std::string_view arg) {
+  send_response(session.control_socket, 215, "UNIX Type: L8");
+}
+
+void FTPServer::cmd_feat(FTPSession &session, std::string_view arg) {
+  std::vector<std::string> lines = {
+      "Features:",
+      "SIZE",
+      "MDTM",
+      "REST STREAM",
+      "MLST type*;size*;modify*;perm*;",
+      hash_feature(session),
+      "RANG STREAM",
+      "XCRC",
+      "XMD5",
+      "XSHA1",
+      "XSHA256",
+      "XSHA512",
+  };
+  if (mode_z_enabled_) {
+    lines.push_back("MODE Z");
+  }
+  lines.push_back("End");
+  send_multiline_response(session.control_socket, 211, lines);
+}
+
+void FTPServer::cmd_opts(FTPSession &session, std::string_view arg) {
+  std::string_view option = command_verb(arg);
+  std::string_view value = option.size() < arg.size() ? arg.substr(option.size() + 1) : std::string_view();
+  if (pack_verb(option) != pack_verb("HASH")) {
+    send_response(session.control_socket, 501, "Option not understood");
+    return;
+  }
+  // "OPTS HASH" reports the current algorithm, "OPTS HASH <name>" selects one.
+  if (!value.empty()) {
+    FTPHashAlgorithm algorithm;
+    if (!parse_hash_algorithm(value, &algorithm) || !make_hash_context(algorithm)) {
+      send_response(session.control_socket, 501, "Unknown or unsupported hash algorithm");
+      return;
+    }
+    session.hash_algorithm = algorithm;
+  }
+  send_response(session.control_socket, 200, hash_algorithm_name(session.hash_algorithm));
+}
+
+// Entry of the SITE table; usage is what SITE HELP lists. Names are
+// compared as strings, some being longer than a packed verb.
+struct FTPSiteCommand {
+  const char *name;
+  FTPCommandHandler handler;
+  const char *usage;
+};
+
+void FTPServer::cmd_site(FTPSession &session, std::string_view arg) {
+  static const FTPSiteCommand SITE_COMMANDS[] = {
+      {"FIND", &FTPServer::site_find, "FIND [<dir>] [<glob>] [<filter>=<value>...]"},
+      {"CPY", &FTPServer::site_cpy, "CPY <from> <to>"},
+      {"RMTREE", &FTPServer::site_rmtree, "RMTREE <dir>"},
+      {"BLOCKSUMS", &FTPServer::site_blocksums, "BLOCKSUMS <file> [<block size>]"},
+      {"DELTA", &FTPServer::site_delta, "DELTA <file> [<block size>]"},
+      {"UNTAR", &FTPServer::site_untar, "UNTAR <dir>"},
+  };
+
+  std::string_view name = command_verb(arg);
+  std::string_view rest = name.size() < arg.size() ? arg.substr(name.size() + 1) : std::string_view();
+  size_t first_non_space = rest.find_first_not_of(' ');
+  rest = first_non_space == std::string_view::npos ? std::string_view() : rest.substr(first_non_space);
+  auto is = [name](std::string_view known) {
+    return name.size() == known.size() && std::equal(name.begin(), name.end(), known.begin(), [](char a, char b) {
+             return std::toupper(static_cast<unsigned char>(a)) == b;
+           });
+  };
+  if (is("HELP")) {
+    std::vector<std::string> lines = {"SITE commands:", "HELP"};
+    for (const auto &command : SITE_COMMANDS) {
+      lines.push_back(command.usage);
+    }
+    lines.push_back("End");
+    send_multiline_response(session.control_socket, 214, lines);
+    return;
+  }
+  for (const auto &command : SITE_COMMANDS) {
+    if (is(command.name)) {
+      (this->*(command.handler))(session, rest);
+      return;
+    }
+  }
+  send_response(session.control_socket, 504, "SITE command not implemented");
+}
+
+std::vector<std::string> split_arguments(std::string_view arg) {
+  std::vector<std::string> arguments;
+  size_t pos = 0;
+  while (pos < arg.size()) {
+    if (arg[pos] == ' ') {
+      pos++;
+      continue;
+    }
+    size_t end;
+    if (arg[pos] == '"') {
+      end = arg.find('"', pos + 1);
+      arguments.emplace_back(arg.substr(pos + 1, end == std::string_view::npos ? end : end - pos - 1));
+      pos = end == std::string_view::npos ? arg.size() : end + 1;
+      continue;
+    }
+    end = arg.find(' ', pos);
+    arguments.emplace_back(arg.substr(pos, end == std::string_view::npos ? end : end - pos));
+    pos = end == std::string_view::npos ? arg.size() : end;
+  }
+  return arguments;
+}
+
+void FTPServer::cmd_type(FTPSession &session, std::string_view arg) {
+  send_response(session.control_socket, 200, "Type set to " + std::string(arg));
+}
+
+void FTPServer::cmd_mode(FTPSession &session, std::string_view arg) {
+  if (arg == "S" || arg == "s") {
+    session.mode_z = false;
+    send_response(session.control_socket, 200, "Mode set to S");
+  } else if ((arg == "Z" || arg == "z") && mode_z_enabled_) {
+    session.mode_z = true;
+    send_response(session.control_socket, 200, "Mode set to Z");
+  } else {
+    send_response(session.control_socket, 504, "Unsupported transfer mode");
+  }
+}
+
+void FTPServer::cmd_pwd(FTPSession &session, std::string_view arg) {
+  send_response(session.control_socket, 257, "\"" + client_path(session.current_path) + "\" is current directory");
+}
+
+void FTPServer::cmd_cwd(FTPSession &session, std::string_view arg) {
+  int client_socket = session.control_socket;
+  if (arg.empty()) {
+    send_response(client_socket, 550, "Failed to change directory - path is empty");
+    return;
+  }
+
+  std::string full_path;
+  if (!resolve_client_path(session, arg, &full_path)) {
+    return;
+  }
+
+  ESP_LOGI(TAG, "Attempting to change directory to: %s", full_path.c_str());
+
+  if (is_directory(session, full_path)) {
+    session.current_path = full_path;
+    send_response(client_socket, 250, "Directory successfully changed");
+  } else {
+    ESP_LOGE(TAG, "Failed to open directory: %s (errno: %d)", full_path.c_str(), errno);
+    send_response(client_socket, 550, "Failed to change directory");
+  }
+}
+
+void FTPServer::cmd_cdup(FTPSession &session, std::string_view arg) {
+  // The parent of a directory we are in needs no probing.
+  FTPPathBuffer parent;
+  if (!resolve_path(root_path_, session.current_path, "..", parent)) {
+    send_response(session.control_socket, 250, "Already at root directory");
+    return;
+  }
+  session.current_path.assign(parent.view());
+  send_response(session.control_socket, 250, "Directory successfully changed");
+}
+
+void FTPServer::cmd_pasv(FTPSession &session, std::string_view arg) {
+  if (!start_passive_mode(session)) {
+    send_response(session.control_socket, 425, "Can't open passive connection");
+  }
+}
+
+// LIST/NLST/MLSD accept a glob in their last segment ("NLST *.jpg",
+// "LIST logs/2024-*"): the directory above it is listed, keeping matching
+// names. A name that really contains '*', '?' or '[' is listed as itself.
+// prefix is the directory as the client wrote it, for NLST names.
+bool FTPServer::resolve_listing_path(FTPSession &session, std::string_view arg, std::string *path,
+                                     std::string *pattern, std::string *prefix) {
+  pattern->clear();
+  prefix->clear();
+  size_t slash = arg.rfind('/');
+  std::string_view last = slash == std::string_view::npos ? arg : arg.substr(slash + 1);
+  if (!resolve_client_path(session, arg, path)) {
+    return false;
+  }
+  struct stat entry_stat;
+  if (!has_glob(last) || storage_->stat(*path, &entry_stat) == 0) {
+    return true;
+  }
+  std::string_view dir = slash == std::string_view::npos ? std::string_view() : arg.substr(0, slash + 1);
+  if (!resolve_client_path(session, dir, path)) {
+    return false;
+  }
+  pattern->assign(last);
+  prefix->assign(dir);
+  return true;
+}
+
+void FTPServer::cmd_list(FTPSession &session, std::string_view arg) {
+  if (!admit_transfer(session)) {
+    return;
+  }
+  std::string list_path, pattern, prefix;
+  if (!resolve_listing_path(session, arg, &list_path, &pattern, &prefix)) {
+    close_data_connection(session);
+    return;
+  }
+
+  ESP_LOGI(TAG, "Listing directory: %s", list_path.c_str());
+  send_response(session.control_socket, 150, "Opening ASCII mode data connection for file list");
+  list_directory(session, list_path, FTP_LIST_LONG, pattern, std::string());
+}
+
+void FTPServer::cmd_nlst(FTPSession &session, std::string_view arg) {
+  if (!admit_transfer(session)) {
+    return;
+  }
+  std::string list_path, pattern, prefix;
+  if (!resolve_listing_path(session, arg, &list_path, &pattern, &prefix)) {
+    close_data_connection(session);
+    return;
+  }
+
+  ESP_LOGI(TAG, "Listing directory: %s", list_path.c_str());
+  send_response(session.control_socket, 150, "Opening ASCII mode data connection for file list");
+  // "NLST dir/*.jpg" answers "dir/a.jpg" so that mget can RETR each line.
+  list_directory(session, list_path, FTP_LIST_NAMES, pattern, prefix);
+}
+
+void FTPServer::cmd_mlsd(FTPSession &session, std::string_view arg) {
+  if (!admit_transfer(session)) {
+    return;
+  }
+  std::string list_path, pattern, prefix;
+  if (!resolve_listing_path(session, arg, &list_path, &pattern, &prefix)) {
+    close_data_connection(session);
+    return;
+  }
+
+  if (!is_directory(session, list_path)) {
+    // RFC 3659: MLSD on anything but a directory is an error.
+    close_data_connection(session);
+    send_response(session.control_socket, 501, "Not a directory");
+    return;
+  }
+
+  ESP_LOGI(TAG, "Machine listing directory: %s", list_path.c_str());
+  send_response(session.control_socket, 150, "Opening ASCII mode data connection for MLSD");
+  list_directory(session, list_path, FTP_LIST_MACHINE, pattern, std::string());
+}
+
+void FTPServer::cmd_mlst(FTPSession &session, std::string_view arg) {
+  std::string full_path;
+  if (!resolve_client_path(session, arg, &full_path)) {
+    return;
+  }
+  struct stat entry_stat;
+  if (storage_->stat(full_path, &entry_stat) != 0) {
+    send_response(session.control_socket, 550, "File not found");
+    return;
+  }
+
+  char facts[128];
+  int facts_len = format_mlsx_facts(entry_stat, facts, sizeof(facts));
+  if (facts_len <= 0) {
+    send_response(session.control_socket, 550, "Could not read file facts");
+    return;
+  }
+  std::string name = arg.empty() ? client_path(full_path) : std::string(arg);
+  send_multiline_response(session.control_socket, 250, {
+      "Listing " + name,
+      std::string(facts, std::min<size_t>(facts_len, sizeof(facts) - 1)) + " " + name,
+      "End",
+  });
+}
+
+void FTPServer::cmd_stor(FTPSession &session, std::string_view arg) {
+  if (!admit_transfer(session)) {
+    return;
+  }
+  std::string full_path;
+  if (!resolve_client_path(session, arg, &full_path)) {
+    close_data_connection(session);
+    return;
+  }
+  // Refused before the 150 rather than once the data connection is up.
+  if (!parent_is_directory(session, full_path)) {
+    close_data_connection(session);
+    send_response(session.control_socket, 550, "Directory not found");
+    return;
+  }
+  if (atomic_uploads_ && session.restart_offset == 0 && !prepare_temp_dir()) {
+    close_data_connection(session);
+    send_response(session.control_socket, 451, "Requested action aborted: cannot create temporary file");
+    return;
+  }
+  ESP_LOGI(TAG, "Starting file upload to: %s", full_path.c_str());
+  send_response(session.control_socket, 150, "Opening connection for file upload");
+  start_file_upload(session, full_path, session.allocation_hint, session.restart_offset, false);
+  session.allocation_hint = 0;
+  session.restart_offset = 0;
+}
+
+void FTPServer::cmd_appe(FTPSession &session, std::string_view arg) {
+  if (!admit_transfer(session)) {
+    return;
+  }
+  std::string full_path;
+  if (!resolve_client_path(session, arg, &full_path)) {
+    close_data_connection(session);
+    return;
+  }
+  ESP_LOGI(TAG, "Appending to file: %s", full_path.c_str());
+  send_response(session.control_socket, 150, "Opening connection for file append");
+  start_file_upload(session, full_path, session.allocation_hint, 0, true);
+  session.allocation_hint = 0;
+  session.restart_offset = 0;
+}
+
+void FTPServer::cmd_retr(FTPSession &session, std::string_view arg) {
+  if (!admit_transfer(session)) {
+    return;
+  }
+  int client_socket = session.control_socket;
+  std::string full_path;
+  if (!resolve_client_path(session, arg, &full_path)) {
+    close_data_connection(session);
+    return;
+  }
+  ESP_LOGI(TAG, "Starting file download from: %s", full_path.c_str());
+
+  struct stat file_stat;
+  if (storage_->stat(full_path, &file_stat) != 0) {
+    if (start_archive_download(session, full_path)) {
+      return;
+    }
+    ESP_LOGE(TAG, "File not found: %s (errno: %d)", full_path.c_str(), errno);
+    close_data_connection(session);
+    send_response(client_socket, 550, "File not found");
+    return;
+  }
+  if (!S_ISREG(file_stat.st_mode)) {
+    close_data_connection(session);
+    send_response(client_socket, 550, "Not a regular file");
+    return;
+  }
+
+  size_t offset = session.restart_offset;
+  session.restart_offset = 0;
+  if (offset > static_cast<size_t>(file_stat.st_size)) {
+    close_data_connection(session);
+    send_response(client_socket, 554, "Invalid REST parameter");
+    return;
+  }
+
+  std::string size_msg = "Opening connection for file download (" +
+                         std::to_string(file_stat.st_size - offset) + " bytes)";
+  send_response(client_socket, 150, size_msg);
+  start_file_download(session, full_path, offset);
+}
+
+void FTPServer::cmd_dele(FTPSession &session, std::string_view arg) {
+  std::string full_path;
+  if (!resolve_client_path(session, arg, &full_path)) {
+    return;
+  }
+  ESP_LOGI(TAG, "Deleting file: %s", full_path.c_str());
+
+  if (storage_->unlink(full_path) == 0) {
+    invalidate_listings(full_path);
+    send_response(session.control_socket, 250, "File deleted successfully");
+  } else {
+    ESP_LOGE(TAG, "Failed to delete file: %s (errno: %d)", full_path.c_str(), errno);
+    send_response(session.control_socket, 550, "Failed to delete file");
+  }
+}
+
+void FTPServer::cmd_mkd(FTPSession &session, std::string_view arg) {
+  std::string full_path;
+  if (!resolve_client_path(session, arg, &full_path)) {
+    return;
+  }
+  ESP_LOGI(TAG, "Creating directory: %s", full_path.c_str());
+
+  if (storage_->mkdir(full_path) == 0) {
+    invalidate_listings(full_path);
+    send_response(session.control_socket, 257, "Directory created");
+  } else {
+    ESP_LOGE(TAG, "Failed to create directory: %s (errno: %d)", full_path.c_str(), errno);
+    send_response(session.control_socket, 550, "Failed to create directory");
+  }
+}
+
+void FTPServer::cmd_rmd(FTPSession &session, std::string_view arg) {
+  std::string full_path;
+  if (!resolve_client_path(session, arg, &full_path)) {
+    return;
+  }
+  ESP_LOGI(TAG, "Removing directory: %s", full_path.c_str());
+
+  if (storage_->rmdir(full_path) == 0) {
+    invalidate_listings(full_path);
+    directory_generation_++;
+    send_response(session.control_socket, 250, "Directory removed");
+  } else {
+    ESP_LOGE(TAG, "Failed to remove directory: %s (errno: %d)", full_path.c_str(), errno);
+    send_response(session.control_socket, 550, "Failed to remove directory");
+  }
+}
+
+void FTPServer::cmd_rnfr(FTPSession &session, std::string_view arg) {
+  session.rename_from.clear();
+  if (!resolve_client_path(session, arg, &session.rename_from)) {
+    return;
+  }
+  struct stat file_stat;
+  if (storage_->stat(session.rename_from, &file_stat) == 0) {
+    send_response(session.control_socket, 350, "Ready for RNTO");
+  } else {
+    ESP_LOGE(TAG, "File not found for rename: %s (errno: %d)", session.rename_from.c_str(), errno);
+    send_response(session.control_socket, 550, "File not found");
+    session.rename_from.clear();
+  }
+}
+
+void FTPServer::cmd_rnto(FTPSession &session, std::string_view arg) {
+  if (session.rename_from.empty()) {
+    send_response(session.control_socket, 503, "RNFR required first");
+    return;
+  }
+
+  std::string rename_to;
+  if (!resolve_client_path(session, arg, &rename_to)) {
+    session.rename_from.clear();
+    return;
+  }
+  ESP_LOGI(TAG, "Renaming from %s to %s", session.rename_from.c_str(), rename_to.c_str());
+
+  if (storage_->rename(session.rename_from, rename_to) == 0) {
+    invalidate_listings(session.rename_from);
+    invalidate_listings(rename_to);
+    directory_generation_++;
+    send_response(session.control_socket, 250, "Rename successful");
+  } else {
+    ESP_LOGE(TAG, "Failed to rename: %s -> %s (errno: %d)",
+             session.rename_from.c_str(), rename_to.c_str(), errno);
+    send_response(session.control_socket, 550, "Rename failed");
+  }
+  session.rename_from.clear();
+}
+
+void FTPServer::cmd_size(FTPSession &session, std::string_view arg) {
+  std::string full_path;
+  if (!resolve_client_path(session, arg, &full_path)) {
+    return;
+  }
+  struct stat file_stat;
+  if (storage_->stat(full_path, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+    send_response(session.control_socket, 213, std::to_string(file_stat.st_size));
+  } else {
+    send_response(session.control_socket, 550, "File not found or not a regular file");
+  }
+}
+
+void FTPServer::cmd_mdtm(FTPSession &session, std::string_view arg) {
+  std::string full_path;
+  if (!resolve_client_path(session, arg, &full_path)) {
+    return;
+  }
+  struct stat file_stat;
+  if (storage_->stat(full_path, &file_stat) == 0) {
+    char mdtm_str[15];
+    struct tm *tm_info = gmtime(&file_stat.st_mtime);
+    strftime(mdtm_str, sizeof(mdtm_str), "%Y%m%d%H%M%S", tm_info);
+    send_response(session.control_socket, 213, mdtm_str);
+  } else {
+    send_response(session.control_socket, 550, "File not found");
+  }
+}
+
+void FTPServer::cmd_allo(FTPSession &session, std::string_view arg) {
+  // "ALLO <size> [R <record size>]": only the byte count matters here.
+  std::string size_str(arg.substr(0, arg.find(' ')));
+  char *end = nullptr;
+  unsigned long long size = strtoull(size_str.c_str(), &end, 10);
+  if (size_str.empty() || end == nullptr || *end != '\0') {
+    send_response(session.control_socket, 501, "Syntax error in ALLO size");
+    return;
+  }
+  session.allocation_hint = size;
+  send_response(session.control_socket, 200, "ALLO command successful");
+}
+
+void FTPServer::cmd_rest(FTPSession &session, std::string_view arg) {
+  // Only STREAM mode exists here, so the marker is a plain byte offset.
+  std::string offset_str(arg);
+  char *end = nullptr;
+  unsigned long long offset = strtoull(offset_str.c_str(), &end, 10);
+  if (offset_str.empty() || end == nullptr || *end != '\0') {
+    send_response(session.control_socket, 501, "Syntax error in REST offset");
+    return;
+  }
+  session.restart_offset = offset;
+  send_response(session.control_socket, 350,
+                "Restarting at " + std::to_string(offset) + ". Send STOR or RETR to initiate transfer");
+}
+
+}  // namespace ftp_server
+}  // namespace esphome
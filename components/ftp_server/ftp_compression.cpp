@@ -0,0 +1,168 @@
+#include "ftp_server.h"
+#include "esp_log.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+#ifdef USE_FTP_MODE_Z
+#include <zlib.h>
+#endif
+
+#ifdef USE_ESP_IDF
+#include "esp_heap_caps.h"
+#endif
+
+namespace esphome {
+namespace ftp_server {
+
+// Extensions whose content is already compressed. MODE Z still has to send
+// a deflate stream for them, but stored blocks cost no CPU and no window.
+static const char *const PRECOMPRESSED_EXTENSIONS[] = {
+    "jpg", "jpeg", "png", "gif", "webp", "mp4", "mkv", "avi", "mov", "mp3",
+    "aac", "ogg", "flac", "zip", "gz", "tgz", "bz2", "xz", "7z", "rar",
+};
+
+bool is_precompressed(const std::string& path) {
+  size_t dot = path.rfind('.');
+  if (dot == std::string::npos || path.find('/', dot) != std::string::npos) {
+    return false;
+  }
+  std::string ext = path.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+  for (const char *known : PRECOMPRESSED_EXTENSIONS) {
+    if (ext == known) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#ifdef USE_FTP_MODE_Z
+
+static const char *TAG = "ftp_server";
+
+struct FTPZStream {
+  z_stream z{};
+  bool deflating{false};
+};
+
+// zlib state and windows go to PSRAM when there is some, keeping internal
+// RAM for lwIP and the DMA transfer buffers.
+static voidpf zstream_alloc(voidpf opaque, uInt items, uInt size) {
+#ifdef USE_ESP_IDF
+  void *ptr = heap_caps_malloc(size_t(items) * size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (ptr == nullptr) {
+    ptr = heap_caps_malloc(size_t(items) * size, MALLOC_CAP_8BIT);
+  }
+  return ptr;
+#else
+  return malloc(size_t(items) * size);
+#endif
+}
+
+static void zstream_free(voidpf opaque, voidpf ptr) {
+#ifdef USE_ESP_IDF
+  heap_caps_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+void FTPZStreamDeleter::operator()(FTPZStream *stream) const {
+  if (stream->deflating) {
+    deflateEnd(&stream->z);
+  } else {
+    inflateEnd(&stream->z);
+  }
+  delete stream;
+}
+
+// Memory is about 2^(window_bits + 2) bytes plus 2^(mem_level + 9), so the
+// default 12/5 pair stays around 32 KB instead of zlib's 256 KB.
+FTPZStreamPtr make_deflate_stream(int level, int window_bits, int mem_level) {
+  FTPZStreamPtr stream(new FTPZStream());
+  stream->z.zalloc = zstream_alloc;
+  stream->z.zfree = zstream_free;
+  if (deflateInit2(&stream->z, level, Z_DEFLATED, window_bits, mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+    ESP_LOGE(TAG, "deflateInit2 failed (level %d, window %d)", level, window_bits);
+    delete stream.release();
+    return nullptr;
+  }
+  stream->deflating = true;
+  return stream;
+}
+
+// The client picks the window of what it uploads, so inflate has to accept
+// the full 32 KB; zlib only allocates it once data arrives.
+FTPZStreamPtr make_inflate_stream() {
+  FTPZStreamPtr stream(new FTPZStream());
+  stream->z.zalloc = zstream_alloc;
+  stream->z.zfree = zstream_free;
+  if (inflateInit2(&stream->z, MAX_WBITS) != Z_OK) {
+    ESP_LOGE(TAG, "inflateInit2 failed");
+    delete stream.release();
+    return nullptr;
+  }
+  return stream;
+}
+
+int zstream_run(FTPZStream &stream, FTPChunk &input, uint8_t *out, size_t out_len, bool finish, bool *done) {
+  stream.z.next_in = input.data.get() + input.pos;
+  stream.z.avail_in = input.len - input.pos;
+  stream.z.next_out = out;
+  stream.z.avail_out = out_len;
+
+  int ret;
+  if (stream.deflating) {
+    ret = deflate(&stream.z, finish ? Z_FINISH : Z_NO_FLUSH);
+  } else {
+    ret = inflate(&stream.z, Z_NO_FLUSH);
+  }
+  input.pos = input.len - stream.z.avail_in;
+  if (ret == Z_STREAM_END) {
+    *done = true;
+  } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+    ESP_LOGE(TAG, "%s error %d: %s", stream.deflating ? "deflate" : "inflate", ret,
+             stream.z.msg != nullptr ? stream.z.msg : "");
+    return -1;
+  }
+  return out_len - stream.z.avail_out;
+}
+
+FTPListing deflate_listing(const FTPListing &listing, int level, int window_bits, int mem_level) {
+  FTPZStreamPtr stream = make_deflate_stream(level, window_bits, mem_level);
+  if (!stream) {
+    return nullptr;
+  }
+  std::string out;
+  out.resize(deflateBound(&stream->z, listing->size()));
+  stream->z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(listing->data()));
+  stream->z.avail_in = listing->size();
+  stream->z.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  stream->z.avail_out = out.size();
+  if (deflate(&stream->z, Z_FINISH) != Z_STREAM_END) {
+    return nullptr;
+  }
+  out.resize(out.size() - stream->z.avail_out);
+  return std::make_shared<const std::string>(std::move(out));
+}
+
+#else
+
+// Built without MODE Z: no stream is ever created.
+void FTPZStreamDeleter::operator()(FTPZStream *stream) const {}
+
+FTPZStreamPtr make_deflate_stream(int level, int window_bits, int mem_level) { return nullptr; }
+
+FTPZStreamPtr make_inflate_stream() { return nullptr; }
+
+int zstream_run(FTPZStream &stream, FTPChunk &input, uint8_t *out, size_t out_len, bool finish, bool *done) {
+  return -1;
+}
+
+FTPListing deflate_listing(const FTPListing &listing, int level, int window_bits, int mem_level) { return nullptr; }
+
+#endif  // USE_FTP_MODE_Z
+
+}  // namespace ftp_server
+}  // namespace esphome
@@ -0,0 +1,525 @@
+#include "ftp_server.h"
+#include "esp_log.h"
+#include "esphome/core/hal.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+
+namespace esphome {
+namespace ftp_server {
+
+static const char *TAG = "ftp_server";
+
+// Block sizes SITE BLOCKSUMS and SITE DELTA accept, default one SD
+// allocation-friendly 4 KiB. Larger blocks mean fewer sums to send for big
+// files, smaller ones a tighter delta.
+static const size_t DELTA_DEFAULT_BLOCK_SIZE = 4096;
+static const size_t DELTA_MIN_BLOCK_SIZE = 512;
+static const size_t DELTA_MAX_BLOCK_SIZE = 65536;
+// Bytes summed per read() of a BLOCKSUMS listing, as for HASH.
+static const size_t BLOCKSUMS_READ_BUDGET = 32768;
+// Bytes of the old file copied per write() of a delta, which step_receive()
+// makes once per loop() tick. Copies never cross the network, so they can
+// take larger steps than a transfer.
+static const size_t DELTA_COPY_BUDGET = 65536;
+static const size_t DELTA_COPY_BUFFER_SIZE = 16384;
+
+// Delta instructions, all numbers big-endian:
+//   'C' <u32 first block> <u32 block count>  copy blocks of the old file
+//   'L' <u32 length> <length bytes>          literal data
+//   'E'                                      end of the delta
+static const uint8_t DELTA_COPY = 'C';
+static const uint8_t DELTA_LITERAL = 'L';
+static const uint8_t DELTA_END = 'E';
+
+uint32_t rolling_checksum(const uint8_t *data, size_t len) {
+  uint32_t a = 0;
+  uint32_t b = 0;
+  for (size_t i = 0; i < len; i++) {
+    a += data[i];
+    b += (len - i) * data[i];
+  }
+  return (a & 0xFFFF) | (b << 16);
+}
+
+static uint32_t read_be32(const uint8_t *data) {
+  return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+}
+
+// ---------------------------------------------------------------------------
+// SITE BLOCKSUMS listing: "<block size> <file size> <algorithm>", then one
+// "<index> <rolling> <strong>" line per block, the last one maybe short.
+
+class FTPBlockSumsStream : public FTPFile {
+ public:
+  FTPBlockSumsStream(FTPFilePtr file, size_t file_size, size_t block_size, FTPHashAlgorithm algorithm,
+                     FTPBuffer block)
+      : file_(std::move(file)),
+        block_size_(block_size),
+        context_(make_hash_context(algorithm)),
+        block_(std::move(block)) {
+    pending_ = std::to_string(block_size) + " " + std::to_string(file_size) + " " +
+               hash_algorithm_name(algorithm) + "\r\n";
+  }
+  ~FTPBlockSumsStream() override { close(); }
+
+  ssize_t read(uint8_t *buffer, size_t len) override {
+    size_t done = 0;
+    size_t summed = 0;
+    while (done < len) {
+      if (pending_pos_ < pending_.size()) {
+        size_t n = std::min(len - done, pending_.size() - pending_pos_);
+        memcpy(buffer + done, pending_.data() + pending_pos_, n);
+        pending_pos_ += n;
+        done += n;
+        continue;
+      }
+      pending_.clear();
+      pending_pos_ = 0;
+      if (!file_ || summed >= BLOCKSUMS_READ_BUDGET) {
+        break;
+      }
+      ssize_t n = read_block();
+      if (n < 0) {
+        return -1;
+      }
+      if (n == 0) {
+        file_->close();
+        file_.reset();
+        continue;
+      }
+      hash_update(*context_, block_.get(), n);
+      char rolling[9];
+      snprintf(rolling, sizeof(rolling), "%08x", (unsigned) rolling_checksum(block_.get(), n));
+      pending_ = std::to_string(index_++) + " " + rolling + " " + hash_finish(*context_) + "\r\n";
+      hash_restart(*context_);
+      summed += n;
+    }
+    if (done == 0 && file_) {
+      errno = EAGAIN;
+      return -1;
+    }
+    return done;
+  }
+
+  ssize_t write(const uint8_t *buffer, size_t len) override {
+    errno = EBADF;
+    return -1;
+  }
+  bool seek(size_t pos) override {
+    errno = ESPIPE;
+    return pos == 0 && index_ == 0;
+  }
+  ssize_t size() override {
+    errno = ESPIPE;
+    return -1;
+  }
+  bool truncate(size_t size) override {
+    errno = EBADF;
+    return false;
+  }
+  int close() override {
+    if (file_) {
+      file_->close();
+      file_.reset();
+    }
+    return 0;
+  }
+
+ protected:
+  // A whole block unless the file ends first.
+  ssize_t read_block() {
+    size_t filled = 0;
+    while (filled < block_size_) {
+      ssize_t n = file_->read(block_.get() + filled, block_size_ - filled);
+      if (n < 0) {
+        ESP_LOGE(TAG, "Error reading file for block sums (errno: %d)", errno);
+        return -1;
+      }
+      if (n == 0) {
+        break;
+      }
+      filled += n;
+    }
+    return filled;
+  }
+
+  FTPFilePtr file_;
+  size_t block_size_;
+  // One context for the whole stream: on the ESP32 each new one is an
+  // mbedtls setup and a heap allocation.
+  FTPHashContextPtr context_;
+  FTPBuffer block_;
+  size_t index_{0};
+  std::string pending_;
+  size_t pending_pos_{0};
+};
+
+FTPFilePtr make_block_sums_stream(FTPFilePtr file, size_t file_size, size_t block_size, FTPHashAlgorithm algorithm,
+                                  FTPBuffer block) {
+  return FTPFilePtr(new FTPBlockSumsStream(std::move(file), file_size, block_size, algorithm, std::move(block)));
+}
+
+// ---------------------------------------------------------------------------
+// Applies a delta written to it: the new file is built in a temporary file
+// that only replaces the old one once the whole delta made it, so a cut
+// connection leaves the old file as it was.
+
+class FTPDeltaApplier : public FTPFile {
+ public:
+  FTPDeltaApplier(FTPStorage &storage, FTPFilePtr basis, size_t basis_size, FTPFilePtr temp,
+                  const std::string &temp_path, const std::string &path, size_t block_size, FTPBuffer buffer)
+      : storage_(storage),
+        basis_(std::move(basis)),
+        basis_size_(basis_size),
+        temp_(std::move(temp)),
+        temp_path_(temp_path),
+        path_(path),
+        block_size_(block_size),
+        buffer_(std::move(buffer)) {}
+  ~FTPDeltaApplier() override { close(); }
+
+  ssize_t read(uint8_t *buffer, size_t len) override {
+    errno = EBADF;
+    return -1;
+  }
+
+  // May take less than len: an unfinished copy leaves the last byte of its
+  // instruction unconsumed, so the upload calls again with it next tick.
+  // After an error the delta is dead and the file is never replaced.
+  ssize_t write(const uint8_t *buffer, size_t len) override {
+    if (failed_) {
+      errno = EINVAL;
+      return -1;
+    }
+    ssize_t used = apply(buffer, len);
+    failed_ = used < 0;
+    return used;
+  }
+
+  bool seek(size_t pos) override {
+    errno = ESPIPE;
+    return pos == 0 && written_ == 0;
+  }
+  ssize_t size() override {
+    errno = ESPIPE;
+    return -1;
+  }
+  bool truncate(size_t size) override {
+    errno = EBADF;
+    return false;
+  }
+
+  // Replaces the file once the delta ended properly, drops the new one
+  // otherwise. Fails when the file was not replaced.
+  int close() override {
+    if (closed_) {
+      return result_;
+    }
+    closed_ = true;
+    if (basis_) {
+      basis_->close();
+      basis_.reset();
+    }
+    int closed = temp_->close();
+    temp_.reset();
+    if (failed_) {
+      ESP_LOGW(TAG, "Delta for %s failed, keeping the old file", path_.c_str());
+    } else if (state_ != ENDED) {
+      ESP_LOGW(TAG, "Delta for %s ended early, keeping the old file", path_.c_str());
+    } else if (closed != 0) {
+      ESP_LOGE(TAG, "Failed to close %s (errno: %d)", temp_path_.c_str(), errno);
+    } else if (storage_.replace(temp_path_, path_) != 0) {
+      ESP_LOGE(TAG, "Failed to replace %s with %s (errno: %d)", path_.c_str(), temp_path_.c_str(), errno);
+    } else {
+      ESP_LOGI(TAG, "Applied delta to %s: %u bytes, %u copied from the old file", path_.c_str(), (unsigned) written_,
+               (unsigned) copied_);
+      result_ = 0;
+      return result_;
+    }
+    storage_.unlink(temp_path_);
+    return result_;
+  }
+
+ protected:
+  enum State { INSTRUCTION, LITERAL, COPY, ENDED };
+
+  ssize_t apply(const uint8_t *buffer, size_t len) {
+    size_t used = 0;
+    size_t budget = DELTA_COPY_BUDGET;
+    while (used < len) {
+      if (state_ == LITERAL) {
+        size_t n = std::min<size_t>(len - used, remaining_);
+        if (!put(buffer + used, n)) {
+          return -1;
+        }
+        used += n;
+        remaining_ -= n;
+        state_ = remaining_ > 0 ? LITERAL : INSTRUCTION;
+        continue;
+      }
+      if (state_ == COPY) {
+        if (!copy(&budget)) {
+          return -1;
+        }
+        if (remaining_ > 0) {
+          return used;
+        }
+        used++;
+        state_ = INSTRUCTION;
+        continue;
+      }
+      if (state_ == ENDED) {
+        ESP_LOGE(TAG, "Data after the end of the delta for %s", path_.c_str());
+        errno = EINVAL;
+        return -1;
+      }
+
+      instruction_[instruction_len_++] = buffer[used];
+      size_t need = instruction_[0] == DELTA_COPY ? 9 : instruction_[0] == DELTA_LITERAL ? 5 : 1;
+      if (instruction_len_ < need) {
+        used++;
+        continue;
+      }
+      instruction_len_ = 0;
+      if (instruction_[0] == DELTA_END) {
+        used++;
+        state_ = ENDED;
+      } else if (instruction_[0] == DELTA_LITERAL) {
+        used++;
+        remaining_ = read_be32(instruction_ + 1);
+        state_ = remaining_ > 0 ? LITERAL : INSTRUCTION;
+      } else if (instruction_[0] == DELTA_COPY) {
+        // used stays on the last byte until the copy is done.
+        if (!start_copy(read_be32(instruction_ + 1), read_be32(instruction_ + 5))) {
+          return -1;
+        }
+        state_ = COPY;
+      } else {
+        ESP_LOGE(TAG, "Unknown delta instruction 0x%02x for %s", instruction_[0], path_.c_str());
+        errno = EINVAL;
+        return -1;
+      }
+    }
+    return used;
+  }
+
+  bool put(const uint8_t *data, size_t len) {
+    if (len > 0 && temp_->write(data, len) != static_cast<ssize_t>(len)) {
+      ESP_LOGE(TAG, "Error writing %s (errno: %d)", temp_path_.c_str(), errno);
+      return false;
+    }
+    written_ += len;
+    return true;
+  }
+
+  bool start_copy(uint32_t first_block, uint32_t count) {
+    uint64_t start = uint64_t(first_block) * block_size_;
+    if (count > 0 && start >= basis_size_) {
+      ESP_LOGE(TAG, "Delta copies block %u, past the end of %s", (unsigned) first_block, path_.c_str());
+      errno = EINVAL;
+      return false;
+    }
+    remaining_ = std::min<uint64_t>(uint64_t(count) * block_size_, basis_size_ - std::min<uint64_t>(start, basis_size_));
+    if (remaining_ > 0 && start != basis_pos_) {
+      if (!basis_->seek(start)) {
+        ESP_LOGE(TAG, "Could not seek %s (errno: %d)", path_.c_str(), errno);
+        return false;
+      }
+      basis_pos_ = start;
+    }
+    return true;
+  }
+
+  bool copy(size_t *budget) {
+    while (remaining_ > 0 && *budget > 0) {
+      size_t want = std::min<uint64_t>({DELTA_COPY_BUFFER_SIZE, remaining_, *budget});
+      ssize_t n = basis_->read(buffer_.get(), want);
+      if (n <= 0) {
+        ESP_LOGE(TAG, "Error reading %s for delta (errno: %d)", path_.c_str(), errno);
+        if (n == 0) {
+          errno = EINVAL;
+        }
+        return false;
+      }
+      if (!put(buffer_.get(), n)) {
+        return false;
+      }
+      basis_pos_ += n;
+      copied_ += n;
+      remaining_ -= n;
+      *budget -= std::min<size_t>(*budget, n);
+    }
+    return true;
+  }
+
+  FTPStorage &storage_;
+  FTPFilePtr basis_;
+  uint64_t basis_size_;
+  uint64_t basis_pos_{0};
+  FTPFilePtr temp_;
+  std::string temp_path_;
+  std::string path_;
+  size_t block_size_;
+  FTPBuffer buffer_;
+  State state_{INSTRUCTION};
+  uint8_t instruction_[9];
+  size_t instruction_len_{0};
+  // Bytes left in the current literal or copy
+  uint64_t remaining_{0};
+  uint64_t written_{0};
+  uint64_t copied_{0};
+  bool failed_{false};
+  bool closed_{false};
+  int result_{-1};
+};
+
+FTPFilePtr make_delta_applier(FTPStorage &storage, FTPFilePtr basis, size_t basis_size, FTPFilePtr temp,
+                              const std::string &temp_path, const std::string &path, size_t block_size,
+                              FTPBuffer buffer) {
+  return FTPFilePtr(new FTPDeltaApplier(storage, std::move(basis), basis_size, std::move(temp), temp_path, path,
+                                        block_size, std::move(buffer)));
+}
+
+// ---------------------------------------------------------------------------
+
+static bool parse_block_size(const std::vector<std::string> &arguments, size_t *block_size) {
+  *block_size = DELTA_DEFAULT_BLOCK_SIZE;
+  if (arguments.size() < 2) {
+    return true;
+  }
+  const std::string &text = arguments[1];
+  if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  *block_size = strtoul(text.c_str(), nullptr, 10);
+  return *block_size >= DELTA_MIN_BLOCK_SIZE && *block_size <= DELTA_MAX_BLOCK_SIZE;
+}
+
+// "SITE BLOCKSUMS <file> [<block size>]" sends the sums over the data
+// connection, strong ones with the algorithm chosen by OPTS HASH.
+void FTPServer::site_blocksums(FTPSession &session, std::string_view arg) {
+  int client_socket = session.control_socket;
+  std::vector<std::string> arguments = split_arguments(arg);
+  size_t block_size;
+  if (arguments.empty() || arguments.size() > 2 || !parse_block_size(arguments, &block_size)) {
+    send_response(client_socket, 501,
+                  "Syntax: SITE BLOCKSUMS <file> [<block size>], block size " +
+                      std::to_string(DELTA_MIN_BLOCK_SIZE) + " to " + std::to_string(DELTA_MAX_BLOCK_SIZE));
+    return;
+  }
+  if (!admit_transfer(session)) {
+    return;
+  }
+  std::string path;
+  if (!resolve_client_path(session, arguments[0], &path)) {
+    close_data_connection(session);
+    return;
+  }
+  struct stat file_stat;
+  if (storage_->stat(path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+    close_data_connection(session);
+    send_response(client_socket, 550, "Not a regular file");
+    return;
+  }
+  if (!make_hash_context(session.hash_algorithm)) {
+    close_data_connection(session);
+    send_response(client_socket, 504, std::string(hash_algorithm_name(session.hash_algorithm)) + " is not available");
+    return;
+  }
+  FTPBuffer block = allocate_transfer_buffer(block_size, true);
+  if (!block) {
+    close_data_connection(session);
+    send_response(client_socket, 451, "Not enough memory for block sums");
+    return;
+  }
+  FTPFilePtr file = storage_->open(path, O_RDONLY);
+  if (!file) {
+    ESP_LOGE(TAG, "Failed to open %s for block sums (errno: %d)", path.c_str(), errno);
+    close_data_connection(session);
+    send_response(client_socket, 550, "File not found");
+    return;
+  }
+  ESP_LOGI(TAG, "Block sums of %s, %u byte blocks", path.c_str(), (unsigned) block_size);
+  send_response(client_socket, 150, "Opening connection for block sums of " + client_path(path));
+  start_generated_transfer(session, FTP_TRANSFER_SEND, path,
+                           make_block_sums_stream(std::move(file), file_stat.st_size, block_size,
+                                                  session.hash_algorithm, std::move(block)));
+}
+
+// "SITE DELTA <file> [<block size>]" receives a delta against the current
+// <file> (which may not exist yet) like a STOR, and replaces <file> with
+// the result once the delta ends.
+void FTPServer::site_delta(FTPSession &session, std::string_view arg) {
+  int client_socket = session.control_socket;
+  std::vector<std::string> arguments = split_arguments(arg);
+  size_t block_size;
+  if (arguments.empty() || arguments.size() > 2 || !parse_block_size(arguments, &block_size)) {
+    send_response(client_socket, 501,
+                  "Syntax: SITE DELTA <file> [<block size>], block size " + std::to_string(DELTA_MIN_BLOCK_SIZE) +
+                      " to " + std::to_string(DELTA_MAX_BLOCK_SIZE));
+    return;
+  }
+  session.allocation_hint = 0;
+  session.restart_offset = 0;
+  if (session.mode_z) {
+    // Inflating needs every chunk written at once; a delta is small anyway.
+    send_response(client_socket, 504, "SITE DELTA is not available in MODE Z");
+    return;
+  }
+  if (!admit_transfer(session)) {
+    return;
+  }
+  std::string path;
+  if (!resolve_client_path(session, arguments[0], &path)) {
+    close_data_connection(session);
+    return;
+  }
+  struct stat file_stat;
+  size_t basis_size = 0;
+  FTPFilePtr basis;
+  if (storage_->stat(path, &file_stat) == 0) {
+    if (!S_ISREG(file_stat.st_mode)) {
+      close_data_connection(session);
+      send_response(client_socket, 550, "Not a regular file");
+      return;
+    }
+    basis = storage_->open(path, O_RDONLY);
+    if (!basis) {
+      ESP_LOGE(TAG, "Failed to open %s for delta (errno: %d)", path.c_str(), errno);
+      close_data_connection(session);
+      send_response(client_socket, 550, "File not found");
+      return;
+    }
+    basis_size = file_stat.st_size;
+  }
+  FTPBuffer buffer = allocate_transfer_buffer(DELTA_COPY_BUFFER_SIZE, true);
+  if (!buffer) {
+    close_data_connection(session);
+    send_response(client_socket, 451, "Not enough memory to apply delta");
+    return;
+  }
+  // Built in FTP_TEMP_DIR like an atomic STOR, under a name of its own.
+  std::string temp_path;
+  if (parent_is_directory(session, path) && prepare_temp_dir()) {
+    temp_path = temp_path_for(session);
+  }
+  FTPFilePtr temp = temp_path.empty() ? nullptr : storage_->open(temp_path, O_WRONLY | O_CREAT | O_TRUNC);
+  if (!temp) {
+    ESP_LOGE(TAG, "Failed to create temporary file for %s (errno: %d)", path.c_str(), errno);
+    close_data_connection(session);
+    send_response(client_socket, 550, "Failed to create file");
+    return;
+  }
+  ESP_LOGI(TAG, "Applying delta to %s, %u byte blocks", path.c_str(), (unsigned) block_size);
+  send_response(client_socket, 150, "Opening connection for delta of " + client_path(path));
+  start_generated_transfer(session, FTP_TRANSFER_RECEIVE, path,
+                           make_delta_applier(*storage_, std::move(basis), basis_size, std::move(temp), temp_path,
+                                              path, block_size, std::move(buffer)));
+}
+
+}  // namespace ftp_server
+}  // namespace esphome
@@ -0,0 +1,366 @@
+#include "ftp_server.h"
+#include "esp_log.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace esphome {
+namespace ftp_server {
+
+static const char *TAG = "ftp_server";
+
+// Directories walked per read() of a SITE FIND stream: about what one LIST
+// costs, so a search of a whole card never holds loop() for long.
+static const size_t FIND_DIRS_PER_READ = 4;
+
+static const std::string_view FIND_FILTERS[] = {"maxdepth", "mindepth", "minsize", "maxsize",
+                                                "newer",    "older",    "type",    "format"};
+
+static bool same_letter(char a, char b) {
+  return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+}
+
+// Matches c against the set starting after '[' and returns the position
+// after its ']', or npos when the set is not closed.
+static size_t match_set(std::string_view pattern, size_t pos, char c, bool *matched) {
+  bool negate = pos < pattern.size() && (pattern[pos] == '!' || pattern[pos] == '^');
+  if (negate) {
+    pos++;
+  }
+  bool found = false;
+  // A ']' right after the opening bracket is a member of the set.
+  for (bool first = true; pos < pattern.size() && (first || pattern[pos] != ']'); first = false) {
+    char low = pattern[pos];
+    char high = low;
+    if (pos + 2 < pattern.size() && pattern[pos + 1] == '-' && pattern[pos + 2] != ']') {
+      high = pattern[pos + 2];
+      pos += 3;
+    } else {
+      pos++;
+    }
+    char lower = std::tolower(static_cast<unsigned char>(c));
+    char upper = std::toupper(static_cast<unsigned char>(c));
+    found = found || (lower >= low && lower <= high) || (upper >= low && upper <= high);
+  }
+  if (pos >= pattern.size()) {
+    return std::string_view::npos;
+  }
+  *matched = found != negate;
+  return pos + 1;
+}
+
+// Iterative, backtracking only to the last '*', so it stays linear enough
+// for the short names found on a card.
+bool glob_match(std::string_view pattern, std::string_view name) {
+  size_t p = 0;
+  size_t n = 0;
+  size_t star = std::string_view::npos;
+  size_t star_name = 0;
+  while (n < name.size()) {
+    if (p < pattern.size() && pattern[p] == '*') {
+      star = ++p;
+      star_name = n;
+      continue;
+    }
+    if (p < pattern.size()) {
+      bool matched = false;
+      size_t next = p + 1;
+      if (pattern[p] == '?') {
+        matched = true;
+      } else if (pattern[p] == '[') {
+        next = match_set(pattern, p + 1, name[n], &matched);
+        if (next == std::string_view::npos) {
+          // An unclosed '[' is an ordinary character.
+          matched = name[n] == '[';
+          next = p + 1;
+        }
+      } else {
+        matched = same_letter(pattern[p], name[n]);
+      }
+      if (matched) {
+        p = next;
+        n++;
+        continue;
+      }
+    }
+    if (star == std::string_view::npos) {
+      return false;
+    }
+    p = star;
+    n = ++star_name;
+  }
+  while (p < pattern.size() && pattern[p] == '*') {
+    p++;
+  }
+  return p == pattern.size();
+}
+
+bool has_glob(std::string_view text) { return text.find_first_of("*?[") != std::string_view::npos; }
+
+static bool parse_number(std::string_view text, uint64_t *value) {
+  if (text.empty() || text.size() > 19 || text.find_first_not_of("0123456789") != std::string_view::npos) {
+    return false;
+  }
+  *value = strtoull(std::string(text).c_str(), nullptr, 10);
+  return true;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date, without relying on
+// timegm(), which newlib does not have.
+static int64_t days_from_civil(int64_t year, unsigned month, unsigned day) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  unsigned year_of_era = static_cast<unsigned>(year - era * 400);
+  unsigned day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + static_cast<int64_t>(day_of_era) - 719468;
+}
+
+bool parse_mdtm_time(std::string_view text, time_t *time) {
+  uint64_t packed;
+  if (text.size() != 14 || !parse_number(text, &packed)) {
+    return false;
+  }
+  unsigned second = packed % 100;
+  unsigned minute = packed / 100 % 100;
+  unsigned hour = packed / 10000 % 100;
+  unsigned day = packed / 1000000 % 100;
+  unsigned month = packed / 100000000 % 100;
+  int64_t year = packed / 10000000000ull;
+  if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) {
+    return false;
+  }
+  *time = static_cast<time_t>(days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second);
+  return true;
+}
+
+class FTPFindStream : public FTPFile {
+ public:
+  FTPFindStream(FTPStorage &storage, const std::string &root, const std::string &dir, const FTPFindQuery &query)
+      : storage_(storage), root_(root == "/" ? std::string() : root), query_(query) {
+    pending_.push_back({dir, 0});
+  }
+  ~FTPFindStream() override { close(); }
+
+  ssize_t read(uint8_t *buffer, size_t len) override {
+    for (size_t walked = 0; out_pos_ == out_.size() && !pending_.empty(); walked++) {
+      if (walked == FIND_DIRS_PER_READ) {
+        errno = EAGAIN;
+        return -1;
+      }
+      out_.clear();
+      out_pos_ = 0;
+      walk_next();
+    }
+    size_t n = std::min(len, out_.size() - out_pos_);
+    memcpy(buffer, out_.data() + out_pos_, n);
+    out_pos_ += n;
+    return n;
+  }
+
+  ssize_t write(const uint8_t *buffer, size_t len) override {
+    errno = EBADF;
+    return -1;
+  }
+  // Results are produced once, in order; only the start can be sought to.
+  bool seek(size_t pos) override {
+    errno = ESPIPE;
+    return pos == 0 && directories_ == 0;
+  }
+  ssize_t size() override {
+    errno = ESPIPE;
+    return -1;
+  }
+  bool truncate(size_t size) override {
+    errno = EBADF;
+    return false;
+  }
+  int close() override {
+    if (!closed_) {
+      closed_ = true;
+      ESP_LOGI(TAG, "SITE FIND walked %u directories, %u matches", (unsigned) directories_, (unsigned) matches_);
+    }
+    return 0;
+  }
+
+ protected:
+  struct Directory {
+    std::string path;
+    uint8_t depth;
+  };
+
+  // Lists the next directory depth first, queueing its subdirectories so
+  // they are walked in the order the storage returned them.
+  void walk_next() {
+    Directory dir = std::move(pending_.back());
+    pending_.pop_back();
+    directories_++;
+    std::string prefix = dir.path == "/" ? std::string() : dir.path;
+    uint8_t depth = dir.depth + 1;
+    size_t first_child = pending_.size();
+    int result = storage_.list(dir.path, true, [&](const std::string &entry_name, const struct stat &entry_stat) {
+      std::string path = prefix + "/" + entry_name;
+      if (path.size() >= FTP_PATH_MAX || entry_name == FTP_TEMP_DIR) {
+        return;
+      }
+      bool is_dir = S_ISDIR(entry_stat.st_mode);
+      if (depth >= query_.min_depth && matches(entry_name, entry_stat, is_dir)) {
+        append_match(path, entry_stat);
+      }
+      if (is_dir && depth < query_.max_depth) {
+        pending_.push_back({path, depth});
+      }
+    });
+    if (result != 0) {
+      ESP_LOGW(TAG, "SITE FIND could not list %s (errno: %d)", dir.path.c_str(), errno);
+    }
+    std::reverse(pending_.begin() + first_child, pending_.end());
+  }
+
+  bool matches(const std::string &entry_name, const struct stat &entry_stat, bool is_dir) const {
+    if (is_dir ? !query_.directories : !query_.files) {
+      return false;
+    }
+    if (query_.min_size > 0 || query_.max_size != SIZE_MAX) {
+      size_t size = entry_stat.st_size;
+      if (is_dir || size < query_.min_size || size > query_.max_size) {
+        return false;
+      }
+    }
+    if ((query_.newer != 0 && entry_stat.st_mtime <= query_.newer) ||
+        (query_.older != 0 && entry_stat.st_mtime >= query_.older)) {
+      return false;
+    }
+    return query_.pattern.empty() || glob_match(query_.pattern, entry_name);
+  }
+
+  void append_match(const std::string &path, const struct stat &entry_stat) {
+    matches_++;
+    if (query_.facts) {
+      char facts[128];
+      int facts_len = format_mlsx_facts(entry_stat, facts, sizeof(facts));
+      if (facts_len > 0) {
+        out_.append(facts, std::min<size_t>(facts_len, sizeof(facts) - 1)).append(" ");
+      }
+    }
+    if (path.size() > root_.size()) {
+      out_.append(path, root_.size(), std::string::npos);
+    } else {
+      out_.append("/");
+    }
+    out_.append("\r\n");
+  }
+
+  FTPStorage &storage_;
+  // Stripped from every path sent, empty when root_path is "/"
+  std::string root_;
+  FTPFindQuery query_;
+  std::vector<Directory> pending_;
+  std::string out_;
+  size_t out_pos_{0};
+  size_t directories_{0};
+  size_t matches_{0};
+  bool closed_{false};
+};
+
+FTPFilePtr make_find_stream(FTPStorage &storage, const std::string &root, const std::string &dir,
+                            const FTPFindQuery &query) {
+  return FTPFilePtr(new FTPFindStream(storage, root, dir, query));
+}
+
+// "SITE FIND [<dir>] [<glob>] [<filter>=<value>...]". A single path with a
+// glob in its last segment ("SITE FIND rec/*.mp4") is split like LIST
+// arguments. Filters: maxdepth, mindepth, type=f|d, minsize, maxsize,
+// newer and older (MDTM times) and format=names|facts.
+void FTPServer::site_find(FTPSession &session, std::string_view arg) {
+  int client_socket = session.control_socket;
+  FTPFindQuery query;
+  std::vector<std::string> paths;
+  for (const std::string &token : split_arguments(arg)) {
+    size_t equals = token.find('=');
+    std::string_view key = std::string_view(token).substr(0, equals);
+    std::string_view value = std::string_view(token).substr(std::min(equals + 1, token.size()));
+    if (equals == std::string::npos || std::find(std::begin(FIND_FILTERS), std::end(FIND_FILTERS), key) ==
+                                           std::end(FIND_FILTERS)) {
+      // Anything else is a path, even with an '=' in it.
+      paths.push_back(token);
+      continue;
+    }
+    uint64_t number = 0;
+    bool ok = true;
+    if (key == "maxdepth" || key == "mindepth") {
+      ok = parse_number(value, &number) && number <= 255;
+      (key == "maxdepth" ? query.max_depth : query.min_depth) = number;
+    } else if (key == "minsize") {
+      ok = parse_number(value, &number);
+      query.min_size = number;
+    } else if (key == "maxsize") {
+      ok = parse_number(value, &number);
+      query.max_size = number;
+    } else if (key == "newer") {
+      ok = parse_mdtm_time(value, &query.newer);
+    } else if (key == "older") {
+      ok = parse_mdtm_time(value, &query.older);
+    } else if (key == "type") {
+      ok = value == "f" || value == "d";
+      query.files = value == "f";
+      query.directories = value == "d";
+    } else {
+      ok = value == "names" || value == "facts";
+      query.facts = value == "facts";
+    }
+    if (!ok) {
+      send_response(client_socket, 501, "Invalid SITE FIND filter: " + token);
+      return;
+    }
+  }
+
+  std::string dir_arg;
+  if (paths.size() == 1) {
+    std::string_view path = paths[0];
+    size_t slash = path.rfind('/');
+    std::string_view last = slash == std::string_view::npos ? path : path.substr(slash + 1);
+    if (has_glob(last)) {
+      dir_arg = std::string(slash == std::string_view::npos ? std::string_view() : path.substr(0, slash + 1));
+      query.pattern = std::string(last);
+    } else {
+      dir_arg = paths[0];
+    }
+  } else if (paths.size() == 2) {
+    dir_arg = paths[0];
+    query.pattern = paths[1];
+  } else if (paths.size() > 2) {
+    send_response(client_socket, 501, "Syntax: SITE FIND [<dir>] [<glob>] [<filter>=<value>...]");
+    return;
+  }
+  if (query.min_depth > query.max_depth) {
+    send_response(client_socket, 501, "mindepth is above maxdepth");
+    return;
+  }
+
+  if (!admit_transfer(session)) {
+    return;
+  }
+  std::string dir;
+  if (!resolve_client_path(session, dir_arg, &dir)) {
+    close_data_connection(session);
+    return;
+  }
+  if (!is_directory(session, dir)) {
+    close_data_connection(session);
+    send_response(client_socket, 550, "Not a directory");
+    return;
+  }
+  session.restart_offset = 0;
+
+  ESP_LOGI(TAG, "Searching %s for \"%s\", depth %u-%u", dir.c_str(), query.pattern.c_str(), query.min_depth,
+           query.max_depth);
+  send_response(client_socket, 150, "Opening ASCII mode data connection for SITE FIND");
+  start_generated_transfer(session, FTP_TRANSFER_SEND, dir, make_find_stream(*storage_, root_path_, dir, query));
+}
+
+}  // namespace ftp_server
+}  // namespace esphome
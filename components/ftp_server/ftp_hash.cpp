@@ -0,0 +1,481 @@
+#include "ftp_server.h"
+#include "esp_log.h"
+#include "esphome/core/hal.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+
+#ifdef USE_ESP_IDF
+#include "mbedtls/md.h"
+#include "esp_rom_crc.h"
+#else
+#include <openssl/evp.h>
+#endif
+
+namespace esphome {
+namespace ftp_server {
+
+static const char *TAG = "ftp_server";
+
+// Bytes hashed per job and per loop() tick. Reading them costs about as
+// much as one transfer tick, so a HASH does not stall other sessions.
+static const size_t HASH_TICK_BUDGET = 32768;
+
+struct FTPHashContext {
+  FTPHashAlgorithm algorithm;
+  uint32_t crc{0};
+#ifdef USE_ESP_IDF
+  mbedtls_md_context_t md;
+#else
+  EVP_MD_CTX *md{nullptr};
+#endif
+};
+
+#ifdef USE_ESP_IDF
+
+// SHA goes through mbedtls, which drives the SHA accelerator when
+// CONFIG_MBEDTLS_HARDWARE_SHA is set (the ESP-IDF default). MD5 has no
+// hardware and is computed in software.
+static mbedtls_md_type_t md_type(FTPHashAlgorithm algorithm) {
+  switch (algorithm) {
+    case FTP_HASH_MD5:
+      return MBEDTLS_MD_MD5;
+    case FTP_HASH_SHA1:
+      return MBEDTLS_MD_SHA1;
+    case FTP_HASH_SHA256:
+      return MBEDTLS_MD_SHA256;
+    case FTP_HASH_SHA512:
+      return MBEDTLS_MD_SHA512;
+    default:
+      return MBEDTLS_MD_NONE;
+  }
+}
+
+void FTPHashContextDeleter::operator()(FTPHashContext *context) const {
+  if (context->algorithm != FTP_HASH_CRC32) {
+    mbedtls_md_free(&context->md);
+  }
+  delete context;
+}
+
+FTPHashContextPtr make_hash_context(FTPHashAlgorithm algorithm) {
+  FTPHashContextPtr context(new FTPHashContext());
+  context->algorithm = algorithm;
+  if (algorithm == FTP_HASH_CRC32) {
+    return context;
+  }
+  mbedtls_md_init(&context->md);
+  // NULL when the algorithm is disabled in the mbedtls configuration.
+  const mbedtls_md_info_t *info = mbedtls_md_info_from_type(md_type(algorithm));
+  if (info == nullptr || mbedtls_md_setup(&context->md, info, 0) != 0 || mbedtls_md_starts(&context->md) != 0) {
+    return nullptr;
+  }
+  return context;
+}
+
+void hash_update(FTPHashContext &context, const uint8_t *data, size_t len) {
+  if (context.algorithm == FTP_HASH_CRC32) {
+    // ROM routine, same result as zlib's crc32()
+    context.crc = esp_rom_crc32_le(context.crc, data, len);
+  } else {
+    mbedtls_md_update(&context.md, data, len);
+  }
+}
+
+static size_t finish_digest(FTPHashContext &context, uint8_t *digest) {
+  mbedtls_md_finish(&context.md, digest);
+  return mbedtls_md_get_size(mbedtls_md_info_from_type(md_type(context.algorithm)));
+}
+
+#else
+
+static const EVP_MD *evp_type(FTPHashAlgorithm algorithm) {
+  switch (algorithm) {
+    case FTP_HASH_MD5:
+      return EVP_md5();
+    case FTP_HASH_SHA1:
+      return EVP_sha1();
+    case FTP_HASH_SHA256:
+      return EVP_sha256();
+    case FTP_HASH_SHA512:
+      return EVP_sha512();
+    default:
+      return nullptr;
+  }
+}
+
+void FTPHashContextDeleter::operator()(FTPHashContext *context) const {
+  EVP_MD_CTX_free(context->md);
+  delete context;
+}
+
+FTPHashContextPtr make_hash_context(FTPHashAlgorithm algorithm) {
+  FTPHashContextPtr context(new FTPHashContext());
+  context->algorithm = algorithm;
+  if (algorithm == FTP_HASH_CRC32) {
+    return context;
+  }
+  context->md = EVP_MD_CTX_new();
+  if (context->md == nullptr || EVP_DigestInit_ex(context->md, evp_type(algorithm), nullptr) != 1) {
+    return nullptr;
+  }
+  return context;
+}
+
+// Reflected CRC-32 (polynomial 0xEDB88320), as zlib and the ESP32 ROM.
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+  static const auto TABLE = []() {
+    std::array<uint32_t, 256> table;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int bit = 0; bit < 8; bit++) {
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+    return table;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = TABLE[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+void hash_update(FTPHashContext &context, const uint8_t *data, size_t len) {
+  if (context.algorithm == FTP_HASH_CRC32) {
+    context.crc = crc32_update(context.crc, data, len);
+  } else {
+    EVP_DigestUpdate(context.md, data, len);
+  }
+}
+
+static size_t finish_digest(FTPHashContext &context, uint8_t *digest) {
+  unsigned int len = 0;
+  EVP_DigestFinal_ex(context.md, digest, &len);
+  return len;
+}
+
+#endif  // USE_ESP_IDF
+
+std::string hash_finish(FTPHashContext &context) {
+  char hex[2 * 64 + 1];
+  if (context.algorithm == FTP_HASH_CRC32) {
+    snprintf(hex, sizeof(hex), "%08x", (unsigned) context.crc);
+    return hex;
+  }
+  uint8_t digest[64];
+  size_t len = finish_digest(context, digest);
+  for (size_t i = 0; i < len; i++) {
+    snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+  }
+  return std::string(hex, 2 * len);
+}
+
+void hash_restart(FTPHashContext &context) {
+  context.crc = 0;
+  if (context.algorithm == FTP_HASH_CRC32) {
+    return;
+  }
+#ifdef USE_ESP_IDF
+  mbedtls_md_starts(&context.md);
+#else
+  EVP_DigestInit_ex(context.md, evp_type(context.algorithm), nullptr);
+#endif
+}
+
+static const struct {
+  FTPHashAlgorithm algorithm;
+  const char *name;
+} HASH_ALGORITHMS[] = {
+    // Advertised by FEAT in this order
+    {FTP_HASH_SHA256, "SHA-256"},
+    {FTP_HASH_SHA512, "SHA-512"},
+    {FTP_HASH_SHA1, "SHA-1"},
+    {FTP_HASH_MD5, "MD5"},
+    {FTP_HASH_CRC32, "CRC32"},
+};
+
+const char *hash_algorithm_name(FTPHashAlgorithm algorithm) {
+  for (const auto &entry : HASH_ALGORITHMS) {
+    if (entry.algorithm == algorithm) {
+      return entry.name;
+    }
+  }
+  return "";
+}
+
+bool parse_hash_algorithm(std::string_view name, FTPHashAlgorithm *algorithm) {
+  for (const auto &entry : HASH_ALGORITHMS) {
+    std::string_view known(entry.name);
+    if (name.size() == known.size() &&
+        std::equal(name.begin(), name.end(), known.begin(),
+                   [](char a, char b) { return std::toupper((unsigned char) a) == b; })) {
+      *algorithm = entry.algorithm;
+      return true;
+    }
+  }
+  return false;
+}
+
+// "HASH SHA-256*;SHA-512;...": what this firmware can compute, '*' marking
+// the session's current choice.
+std::string FTPServer::hash_feature(const FTPSession &session) const {
+  std::string feature = "HASH ";
+  for (const auto &entry : HASH_ALGORITHMS) {
+    if (!make_hash_context(entry.algorithm)) {
+      continue;
+    }
+    if (feature.size() > 5) {
+      feature += ';';
+    }
+    feature += entry.name;
+    if (entry.algorithm == session.hash_algorithm) {
+      feature += '*';
+    }
+  }
+  return feature;
+}
+
+static bool parse_offset(std::string_view text, size_t *value) {
+  if (text.empty() || text.find_first_not_of("0123456789") != std::string_view::npos) {
+    return false;
+  }
+  *value = strtoull(std::string(text).c_str(), nullptr, 10);
+  return true;
+}
+
+// draft-bryan-ftpext-hash: the reply only comes once the file is hashed, so
+// nothing is sent here. Without RANG, a pending REST offset starts the range.
+void FTPServer::cmd_hash(FTPSession &session, std::string_view arg) {
+  size_t start = session.restart_offset;
+  size_t end = 0;
+  bool has_end = false;
+  if (session.hash_range_set) {
+    start = session.hash_range_start;
+    end = session.hash_range_end;
+    has_end = true;
+  }
+  session.restart_offset = 0;
+  session.hash_range_set = false;
+  start_hash_job(session, session.hash_algorithm, std::string(arg), start, end, has_end, true);
+}
+
+// "RANG <start> <end>" limits the next HASH to bytes [start, end).
+// "RANG 1 0" goes back to the whole file.
+void FTPServer::cmd_rang(FTPSession &session, std::string_view arg) {
+  size_t space = arg.find(' ');
+  size_t start;
+  size_t end;
+  if (space == std::string_view::npos || !parse_offset(arg.substr(0, space), &start) ||
+      !parse_offset(arg.substr(space + 1), &end)) {
+    send_response(session.control_socket, 501, "Syntax error in RANG parameters");
+    return;
+  }
+  if (start == 1 && end == 0) {
+    session.hash_range_set = false;
+    send_response(session.control_socket, 350, "Restarting at 0. End byte range reset");
+    return;
+  }
+  if (end < start) {
+    send_response(session.control_socket, 501, "End of range is before its start");
+    return;
+  }
+  session.hash_range_set = true;
+  session.hash_range_start = start;
+  session.hash_range_end = end;
+  send_response(session.control_socket, 350,
+                "Restarting at " + std::to_string(start) + ". Ending at " + std::to_string(end));
+}
+
+// "XCRC <file> [<start> [<end>]]". The name may be quoted; unquoted, up to
+// two trailing numbers are taken as the range.
+static bool parse_x_hash_args(std::string_view arg, std::string *name, size_t *start, size_t *end,
+                              bool *has_end) {
+  std::string_view range;
+  if (!arg.empty() && arg.front() == '"') {
+    size_t quote = arg.find('"', 1);
+    if (quote == std::string_view::npos) {
+      return false;
+    }
+    *name = std::string(arg.substr(1, quote - 1));
+    range = arg.substr(quote + 1);
+  } else {
+    size_t name_end = arg.size();
+    size_t number;
+    for (int numbers = 0; numbers < 2 && name_end > 0; numbers++) {
+      size_t space = arg.rfind(' ', name_end - 1);
+      if (space == std::string_view::npos || !parse_offset(arg.substr(space + 1, name_end - space - 1), &number)) {
+        break;
+      }
+      name_end = space;
+    }
+    *name = std::string(arg.substr(0, name_end));
+    range = arg.substr(name_end);
+  }
+
+  size_t first = range.find_first_not_of(' ');
+  if (first == std::string_view::npos) {
+    return true;
+  }
+  range = range.substr(first);
+  size_t space = range.find(' ');
+  if (!parse_offset(range.substr(0, space), start)) {
+    return false;
+  }
+  if (space == std::string_view::npos) {
+    return true;
+  }
+  *has_end = true;
+  return parse_offset(range.substr(space + 1), end);
+}
+
+// X* variants reply "250 <hash>". Without an explicit range, a pending REST
+// offset starts it.
+void FTPServer::cmd_x_hash(FTPSession &session, std::string_view arg, FTPHashAlgorithm algorithm) {
+  std::string name;
+  size_t start = session.restart_offset;
+  size_t end = 0;
+  bool has_end = false;
+  session.restart_offset = 0;
+  if (!parse_x_hash_args(arg, &name, &start, &end, &has_end)) {
+    send_response(session.control_socket, 501, "Syntax error in parameters");
+    return;
+  }
+  start_hash_job(session, algorithm, name, start, end, has_end, false);
+}
+
+void FTPServer::cmd_xcrc(FTPSession &session, std::string_view arg) { cmd_x_hash(session, arg, FTP_HASH_CRC32); }
+void FTPServer::cmd_xmd5(FTPSession &session, std::string_view arg) { cmd_x_hash(session, arg, FTP_HASH_MD5); }
+void FTPServer::cmd_xsha1(FTPSession &session, std::string_view arg) { cmd_x_hash(session, arg, FTP_HASH_SHA1); }
+void FTPServer::cmd_xsha256(FTPSession &session, std::string_view arg) {
+  cmd_x_hash(session, arg, FTP_HASH_SHA256);
+}
+void FTPServer::cmd_xsha512(FTPSession &session, std::string_view arg) {
+  cmd_x_hash(session, arg, FTP_HASH_SHA512);
+}
+
+void FTPServer::start_hash_job(FTPSession &session, FTPHashAlgorithm algorithm, const std::string& name,
+                               size_t start, size_t end, bool has_end, bool draft_reply) {
+  int client_socket = session.control_socket;
+  if (name.empty()) {
+    send_response(client_socket, 501, "File name required");
+    return;
+  }
+  std::string full_path;
+  if (!resolve_client_path(session, name, &full_path)) {
+    return;
+  }
+  struct stat file_stat;
+  if (storage_->stat(full_path, &file_stat) != 0) {
+    ESP_LOGE(TAG, "File not found for hash: %s (errno: %d)", full_path.c_str(), errno);
+    send_response(client_socket, 550, "File not found");
+    return;
+  }
+  if (!S_ISREG(file_stat.st_mode)) {
+    send_response(client_socket, 550, "Not a regular file");
+    return;
+  }
+
+  size_t size = file_stat.st_size;
+  end = has_end ? std::min(end, size) : size;
+  if (start > size || end < start) {
+    send_response(client_socket, 501, "Invalid byte range");
+    return;
+  }
+  FTPFilePtr file = storage_->open(full_path, O_RDONLY);
+  if (!file) {
+    ESP_LOGE(TAG, "Failed to open %s for hash (errno: %d)", full_path.c_str(), errno);
+    send_response(client_socket, 550, "File not found");
+    return;
+  }
+  if (start > 0 && !file->seek(start)) {
+    send_response(client_socket, 451, "Could not seek file");
+    return;
+  }
+
+  auto job = std::make_unique<FTPHashJob>();
+  job->context = make_hash_context(algorithm);
+  if (!job->context) {
+    send_response(client_socket, 504, std::string(hash_algorithm_name(algorithm)) + " is not available");
+    return;
+  }
+  job->buffer_size = std::min<size_t>(download_buffer_size_, HASH_TICK_BUDGET);
+  job->buffer = allocate_transfer_buffer(job->buffer_size, true);
+  if (!job->buffer) {
+    send_response(client_socket, 451, "Not enough memory to hash file");
+    return;
+  }
+  job->algorithm = algorithm;
+  job->file = std::move(file);
+  job->name = name;
+  job->start = start;
+  job->end = end;
+  job->pos = start;
+  job->draft_reply = draft_reply;
+  job->started_ms = millis();
+  ESP_LOGI(TAG, "Hashing %s with %s, bytes %u-%u", full_path.c_str(), hash_algorithm_name(algorithm),
+           (unsigned) start, (unsigned) end);
+
+  session.hash_job = std::move(job);
+  active_hash_jobs_++;
+  high_freq_.start();
+}
+
+void FTPServer::advance_hash_job(FTPSession &session) {
+  FTPHashJob &job = *session.hash_job;
+  size_t budget = HASH_TICK_BUDGET;
+  while (budget > 0 && job.pos < job.end) {
+    size_t want = std::min({job.buffer_size, budget, job.end - job.pos});
+    ssize_t len = job.file->read(job.buffer.get(), want);
+    if (len < 0) {
+      ESP_LOGE(TAG, "Read failed while hashing %s (errno: %d)", job.name.c_str(), errno);
+      finish_hash_job(session, 451, "Error reading file");
+      return;
+    }
+    if (len == 0) {
+      // Truncated since the command: hash what is there.
+      job.end = job.pos;
+      break;
+    }
+    hash_update(*job.context, job.buffer.get(), len);
+    job.pos += len;
+    budget -= len;
+  }
+  if (job.pos < job.end) {
+    return;
+  }
+
+  std::string digest = hash_finish(*job.context);
+  ESP_LOGI(TAG, "Hashed %u bytes of %s in %u ms", (unsigned) (job.end - job.start), job.name.c_str(),
+           (unsigned) (millis() - job.started_ms));
+  if (job.draft_reply) {
+    finish_hash_job(session, 213,
+                    std::string(hash_algorithm_name(job.algorithm)) + " " + std::to_string(job.start) + "-" +
+                        std::to_string(job.end) + " " + digest + " " + job.name);
+  } else {
+    finish_hash_job(session, 250, digest);
+  }
+}
+
+void FTPServer::finish_hash_job(FTPSession &session, int code, const std::string& message) {
+  abort_hash_job(session);
+  send_response(session.control_socket, code, message);
+}
+
+void FTPServer::abort_hash_job(FTPSession &session) {
+  if (!session.hash_job) {
+    return;
+  }
+  session.hash_job->file->close();
+  session.hash_job.reset();
+  active_hash_jobs_--;
+  session.last_activity_ms = millis();
+}
+
+}  // namespace ftp_server
+}  // namespace esphome
@@ -0,0 +1,329 @@
+#include "ftp_server.h"
+#include "esp_log.h"
+#include "esphome/core/hal.h"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+
+namespace esphome {
+namespace ftp_server {
+
+static const char *TAG = "ftp_server";
+
+// SITE CPY never crosses the network, so it reads and writes in much larger
+// steps than a transfer; PSRAM holds the buffer when internal RAM cannot.
+static const size_t COPY_BUFFER_SIZE = 65536;
+// Time a SITE CPY may spend per loop() tick. It always copies one buffer,
+// then goes on only while the card keeps up.
+static const uint32_t COPY_TICK_MS = 5;
+// Directory listings, unlinks and rmdirs per SITE RMTREE and per tick. Each
+// is a FAT directory update on the card, a few ms at worst.
+static const size_t REMOVE_TREE_TICK_OPERATIONS = 16;
+
+static std::string base_name(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// One job per session: a second one would only compete with the first for
+// the same card.
+bool FTPServer::admit_site_job(FTPSession &session) {
+  if (session.site_job) {
+    send_response(session.control_socket, 450,
+                  "Already running SITE " + describe_site_job(session) + ", see STAT");
+    return false;
+  }
+  return true;
+}
+
+// "SITE CPY <from> <to>". A directory as target receives a file of the same
+// name; an existing file is replaced.
+void FTPServer::site_cpy(FTPSession &session, std::string_view arg) {
+  int client_socket = session.control_socket;
+  std::vector<std::string> arguments = split_arguments(arg);
+  if (arguments.size() != 2) {
+    send_response(client_socket, 501, "Syntax: SITE CPY <from> <to>");
+    return;
+  }
+  if (!admit_site_job(session)) {
+    return;
+  }
+  std::string from_path;
+  std::string to_path;
+  if (!resolve_client_path(session, arguments[0], &from_path) ||
+      !resolve_client_path(session, arguments[1], &to_path)) {
+    return;
+  }
+  struct stat from_stat;
+  if (storage_->stat(from_path, &from_stat) != 0) {
+    ESP_LOGE(TAG, "File not found for copy: %s (errno: %d)", from_path.c_str(), errno);
+    send_response(client_socket, 550, "File not found");
+    return;
+  }
+  if (!S_ISREG(from_stat.st_mode)) {
+    send_response(client_socket, 550, "Not a regular file");
+    return;
+  }
+  if (is_directory(session, to_path)) {
+    to_path += "/" + base_name(from_path);
+  }
+  if (to_path == from_path) {
+    send_response(client_socket, 550, "Source and target are the same file");
+    return;
+  }
+
+  auto job = std::make_unique<FTPSiteJob>();
+  job->kind = FTP_JOB_COPY;
+  job->buffer_size = COPY_BUFFER_SIZE;
+  job->buffer = allocate_transfer_buffer(job->buffer_size, true);
+  if (!job->buffer) {
+    job->buffer_size = upload_buffer_size_;
+    job->buffer = allocate_transfer_buffer(job->buffer_size, true);
+  }
+  if (!job->buffer) {
+    send_response(client_socket, 451, "Not enough memory to copy file");
+    return;
+  }
+  job->from = storage_->open(from_path, O_RDONLY);
+  if (!job->from) {
+    ESP_LOGE(TAG, "Failed to open %s for copy (errno: %d)", from_path.c_str(), errno);
+    send_response(client_socket, 550, "File not found");
+    return;
+  }
+  // Built in FTP_TEMP_DIR like an atomic STOR: an existing target stays
+  // as it was until the copy is complete.
+  if (!parent_is_directory(session, to_path)) {
+    send_response(client_socket, 550, "Directory not found");
+    return;
+  }
+  if (prepare_temp_dir()) {
+    job->temp_path = temp_path_for(session);
+    job->to = storage_->open(job->temp_path, O_WRONLY | O_CREAT | O_TRUNC);
+  }
+  if (!job->to) {
+    ESP_LOGE(TAG, "Failed to create a temporary file for %s (errno: %d)", to_path.c_str(), errno);
+    send_response(client_socket, 550, "Failed to create file");
+    return;
+  }
+  job->size = from_stat.st_size;
+  // Same as STOR with ALLO: one contiguous allocation instead of a cluster
+  // chain grown a buffer at a time.
+  if (job->size > 0 && storage_->preallocation_helps()) {
+    job->preallocated = job->to->truncate(job->size);
+  }
+  job->source = client_path(from_path);
+  job->target = client_path(to_path);
+  job->to_path = to_path;
+
+  send_response(client_socket, 200,
+                "Copying " + job->source + " to " + job->target + " (" + std::to_string(job->size) +
+                    " bytes), see STAT for progress");
+  start_site_job(session, std::move(job));
+}
+
+// "SITE RMTREE <dir>": removes dir and everything below it. Entries that
+// cannot be removed are counted and left behind, with their parents.
+void FTPServer::site_rmtree(FTPSession &session, std::string_view arg) {
+  int client_socket = session.control_socket;
+  std::vector<std::string> arguments = split_arguments(arg);
+  if (arguments.size() != 1) {
+    send_response(client_socket, 501, "Syntax: SITE RMTREE <dir>");
+    return;
+  }
+  if (!admit_site_job(session)) {
+    return;
+  }
+  std::string path;
+  if (!resolve_client_path(session, arguments[0], &path)) {
+    return;
+  }
+  if (path == root_path_) {
+    send_response(client_socket, 550, "Refusing to remove the root directory");
+    return;
+  }
+  struct stat dir_stat;
+  if (storage_->stat(path, &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode)) {
+    send_response(client_socket, 550, "Not a directory");
+    return;
+  }
+
+  auto job = std::make_unique<FTPSiteJob>();
+  job->kind = FTP_JOB_REMOVE_TREE;
+  job->source = client_path(path);
+  job->directories.push_back({path, false, {}});
+  send_response(client_socket, 200, "Removing " + job->source + ", see STAT for progress");
+  start_site_job(session, std::move(job));
+}
+
+void FTPServer::start_site_job(FTPSession &session, std::unique_ptr<FTPSiteJob> job) {
+  job->started_ms = millis();
+  session.site_job = std::move(job);
+  session.site_job_result.clear();
+  active_site_jobs_++;
+  high_freq_.start();
+  ESP_LOGI(TAG, "Started SITE %s", describe_site_job(session).c_str());
+}
+
+void FTPServer::advance_site_job(FTPSession &session) {
+  FTPSiteJob &job = *session.site_job;
+  bool done = job.kind == FTP_JOB_COPY ? advance_copy(job) : advance_remove_tree(job);
+  if (!done) {
+    return;
+  }
+  uint32_t elapsed_ms = millis() - job.started_ms;
+  std::string result;
+  if (job.kind == FTP_JOB_COPY) {
+    if (job.failures > 0) {
+      result = "CPY " + job.source + " to " + job.target + " failed after " + std::to_string(job.pos) + " bytes";
+    } else {
+      result = "CPY " + job.source + " to " + job.target + ": " + std::to_string(job.pos) + " bytes in " +
+               std::to_string(elapsed_ms) + " ms";
+    }
+  } else {
+    result = "RMTREE " + job.source + ": " + std::to_string(job.files_removed) + " files and " +
+             std::to_string(job.directories_removed) + " directories removed, " + std::to_string(job.failures) +
+             " failed, in " + std::to_string(elapsed_ms) + " ms";
+  }
+  finish_site_job(session, result);
+}
+
+// Returns true once the copy is over, failures set if it did not complete.
+bool FTPServer::advance_copy(FTPSiteJob &job) {
+  uint32_t started_ms = millis();
+  ssize_t len;
+  do {
+    len = job.from->read(job.buffer.get(), job.buffer_size);
+    if (len < 0) {
+      ESP_LOGE(TAG, "Read failed while copying %s (errno: %d)", job.source.c_str(), errno);
+    } else if (len > 0 && job.to->write(job.buffer.get(), len) != len) {
+      ESP_LOGE(TAG, "Write failed while copying to %s (errno: %d)", job.target.c_str(), errno);
+      len = -1;
+    }
+    if (len <= 0) {
+      break;
+    }
+    job.pos += len;
+  } while (millis() - started_ms < COPY_TICK_MS);
+  if (len > 0) {
+    return false;
+  }
+  if (len == 0) {
+    // End of the source, which may have shrunk since it was stat'ed.
+    if (job.preallocated && job.pos < job.size && !job.to->truncate(job.pos)) {
+      ESP_LOGW(TAG, "Could not trim %s to %u bytes (errno: %d)", job.target.c_str(), (unsigned) job.pos, errno);
+    }
+    job.from->close();
+    job.from.reset();
+    int closed = job.to->close();
+    job.to.reset();
+    if (closed != 0) {
+      ESP_LOGE(TAG, "Failed to close %s after copy (errno: %d)", job.target.c_str(), errno);
+    } else if (storage_->replace(job.temp_path, job.to_path) != 0) {
+      ESP_LOGE(TAG, "Failed to rename %s to %s (errno: %d)", job.temp_path.c_str(), job.to_path.c_str(), errno);
+    } else {
+      invalidate_listings(job.to_path);
+      return true;
+    }
+  }
+  // A partial copy is worse than none, and the target keeps what it had.
+  job.failures++;
+  if (job.to) {
+    job.to->close();
+    job.to.reset();
+  }
+  storage_->unlink(job.temp_path);
+  return true;
+}
+
+// Depth first: a directory is listed, its files unlinked, then its
+// subdirectories emptied before it is removed itself.
+bool FTPServer::advance_remove_tree(FTPSiteJob &job) {
+  for (size_t operations = 0; operations < REMOVE_TREE_TICK_OPERATIONS && !job.directories.empty(); operations++) {
+    FTPSiteJob::Directory &dir = job.directories.back();
+    if (!dir.listed) {
+      dir.listed = true;
+      std::string parent = dir.path;
+      std::vector<std::string> subdirectories;
+      int result = storage_->list(parent, true, [&](const std::string &name, const struct stat &entry_stat) {
+        (S_ISDIR(entry_stat.st_mode) ? subdirectories : dir.files).push_back(name);
+      });
+      if (result != 0) {
+        ESP_LOGW(TAG, "Could not list %s for removal (errno: %d)", parent.c_str(), errno);
+        job.failures++;
+        job.directories.pop_back();
+        continue;
+      }
+      // dir is not used past this point: pushing may move it.
+      for (const std::string &name : subdirectories) {
+        job.directories.push_back({parent + "/" + name, false, {}});
+      }
+      continue;
+    }
+    if (!dir.files.empty()) {
+      std::string path = dir.path + "/" + dir.files.back();
+      dir.files.pop_back();
+      if (storage_->unlink(path) == 0) {
+        job.files_removed++;
+      } else {
+        ESP_LOGW(TAG, "Could not remove %s (errno: %d)", path.c_str(), errno);
+        job.failures++;
+      }
+      continue;
+    }
+    if (storage_->rmdir(dir.path) == 0) {
+      job.directories_removed++;
+      directory_generation_++;
+    } else {
+      ESP_LOGW(TAG, "Could not remove directory %s (errno: %d)", dir.path.c_str(), errno);
+      job.failures++;
+    }
+    invalidate_listings(dir.path);
+    job.directories.pop_back();
+  }
+  return job.directories.empty();
+}
+
+void FTPServer::finish_site_job(FTPSession &session, const std::string& result) {
+  ESP_LOGI(TAG, "SITE %s", result.c_str());
+  abort_site_job(session);
+  session.site_job_result = result;
+}
+
+// Also what ABOR and the end of the session do: a copy stopped midway is
+// dropped with the target untouched, a tree keeps whatever was not reached
+// yet.
+void FTPServer::abort_site_job(FTPSession &session) {
+  if (!session.site_job) {
+    return;
+  }
+  FTPSiteJob &job = *session.site_job;
+  if (job.to) {
+    job.to->close();
+    job.to.reset();
+    storage_->unlink(job.temp_path);
+  }
+  if (job.from) {
+    job.from->close();
+  }
+  session.site_job_result = "SITE " + describe_site_job(session) + " aborted";
+  session.site_job.reset();
+  active_site_jobs_--;
+  session.last_activity_ms = millis();
+}
+
+// One line for STAT, without the "SITE " prefix
+std::string FTPServer::describe_site_job(const FTPSession &session) const {
+  const FTPSiteJob &job = *session.site_job;
+  uint32_t elapsed_s = (millis() - job.started_ms) / 1000;
+  if (job.kind == FTP_JOB_COPY) {
+    return "CPY " + job.source + " to " + job.target + ": " + std::to_string(job.pos) + " of " +
+           std::to_string(job.size) + " bytes, " + std::to_string(elapsed_s) + " s";
+  }
+  return "RMTREE " + job.source + ": " + std::to_string(job.files_removed) + " files and " +
+         std::to_string(job.directories_removed) + " directories removed, " + std::to_string(job.failures) +
+         " failed, " + std::to_string(job.directories.size()) + " directories pending, " +
+         std::to_string(elapsed_s) + " s";
+}
+
+}  // namespace ftp_server
+}  // namespace esphome
@@ -1,88 +1,170 @@
 #include "ftp_server.h"
-#include "../sd_mmc_card/sd_mmc_card.h"
 #include "esp_log.h"
+#include "esphome/core/hal.h"
+#include <algorithm>
 #include <fcntl.h>
-#include <dirent.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <chrono>
 #include <ctime>
 #include "esp_netif.h"
 #include "esp_err.h"
+#include "esp_event.h"
 #include <errno.h>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef USE_ESP_IDF
+#include "esp_heap_caps.h"
+#endif
 
 namespace esphome {
 namespace ftp_server {
 
 static const char *TAG = "ftp_server";
 
-FTPServer::FTPServer() : 
-  ftp_server_socket_(-1),
-  passive_data_socket_(-1),
-  passive_data_port_(-1),
-  passive_mode_enabled_(false),
-  rename_from_("") {}
-
-std::string normalize_path(const std::string& base_path, const std::string& path) {
-  std::string result;
-  
-  if (path.empty() || path == ".") {
-    return base_path;
-  }
-  
-  if (path[0] == '/') {
-    if (path == "/sdcard") {
-      return base_path;
-    }
-    std::string clean_path = path;
-    if (base_path.back() == '/' && path[0] == '/') {
-      clean_path = path.substr(1);
-    }
-    result = base_path + clean_path;
-  } else {
-    if (base_path.back() == '/') {
-      result = base_path + path;
-    } else {
-      result = base_path + "/" + path;
+// For COMMAND_BURST_MS after a command, loop() runs back to back and an
+// otherwise idle select() waits up to REACTOR_SELECT_TIMEOUT_US, so the next
+// command of a client is dispatched as it arrives instead of a loop tick
+// later. Other components still get loop() every few ms; outside of a
+// burst select() only reports what is ready right now.
+static const long REACTOR_SELECT_TIMEOUT_US = 2000;
+static const uint32_t COMMAND_BURST_MS = 1000;
+
+// Transfers move at most TRANSFER_TICK_BUDGET bytes per loop() so a large
+// RETR/STOR never starves the API, sensors or other FTP clients.
+static const size_t TRANSFER_BUFFER_SIZE = 8192;
+static const size_t TRANSFER_TICK_BUDGET = 4 * TRANSFER_BUFFER_SIZE;
+// With bandwidth limits, a transfer waits for at least one TCP segment's
+// worth of tokens rather than trickling out tiny writes.
+static const size_t SHAPING_MIN_QUANTUM = 1440;
+static const uint32_t DATA_CONNECTION_TIMEOUT_MS = 5000;
+static const uint32_t TELEMETRY_PUBLISH_INTERVAL_MS = 10000;
+
+#ifdef USE_ESP_IDF
+// Workers wait on their data socket for at most this long per select().
+// loop() cancels one by shutting its socket down, which wakes it at once.
+static const long WORKER_SELECT_TIMEOUT_US = 500000;
+static const uint32_t WORKER_STACK_SIZE = 4096;
+static const UBaseType_t WORKER_PRIORITY = 2;
+#endif
+
+static bool can_read_ahead(const FTPTransfer &transfer);
+
+// Listings go out in whole TCP segments so lwIP never queues a runt behind
+// Nagle; only the last write of a listing can be short.
+#ifdef CONFIG_LWIP_TCP_MSS
+static const size_t LISTING_SEGMENT_SIZE = CONFIG_LWIP_TCP_MSS;
+#else
+static const size_t LISTING_SEGMENT_SIZE = 1440;
+#endif
+static const size_t LISTING_WRITE_SIZE = 4 * LISTING_SEGMENT_SIZE;
+
+// Rendered listings kept for repeated LIST/NLST/MLSD of the same directory.
+static const size_t LISTING_CACHE_ENTRIES = 8;
+static const uint32_t LISTING_CACHE_MAX_AGE_MS = 30000;
+// Same bound for directories a session validated, for the same reason.
+static const uint32_t DIR_CACHE_MAX_AGE_MS = LISTING_CACHE_MAX_AGE_MS;
+
+// Session slots are indexed by uint8_t in session_by_fd_, max_sessions is
+// capped well below NO_SESSION by the YAML schema.
+static const uint8_t NO_SESSION = 0xFF;
+
+// Login and idle timeouts are checked this often.
+static const uint32_t SESSION_CHECK_INTERVAL_MS = 1000;
+// A logged in session must have been quiet this long before a new client
+// may evict it; one still logging in can be evicted right away.
+static const uint32_t SESSION_EVICT_MIN_IDLE_MS = 10000;
+
+// Longest run of unconsumed control bytes kept per session, including
+// pipelined commands waiting for a transfer to finish.
+static const size_t MAX_COMMAND_BUFFER = 2048;
+
+FTPServer::FTPServer() : ftp_server_socket_(-1) {}
+
+// Works segment by segment in a fixed buffer: no temporaries, and nothing
+// a client sends can climb above root.
+bool resolve_path(std::string_view root, std::string_view cwd, std::string_view path, FTPPathBuffer &out) {
+  // The whole VFS as root: everything goes below an empty prefix.
+  if (root == "/") {
+    root = std::string_view();
+  }
+  if (root.size() >= FTP_PATH_MAX) {
+    return false;
+  }
+  memcpy(out.data, root.data(), root.size());
+  const size_t base = root.size();
+  out.len = base;
+
+  if (path.empty() || path.front() != '/') {
+    // cwd is already canonical and starts with root.
+    std::string_view relative = cwd.substr(std::min(cwd.size(), base));
+    if (relative == "/") {
+      relative = std::string_view();
+    }
+    if (base + relative.size() >= FTP_PATH_MAX) {
+      return false;
+    }
+    memcpy(out.data + base, relative.data(), relative.size());
+    out.len += relative.size();
+  }
+
+  while (!path.empty()) {
+    size_t slash = path.find('/');
+    std::string_view segment = path.substr(0, slash);
+    path = slash == std::string_view::npos ? std::string_view() : path.substr(slash + 1);
+    if (segment.empty() || segment == ".") {
+      continue;
+    }
+    if (segment == "..") {
+      if (out.len == base) {
+        return false;
+      }
+      while (out.len > base && out.data[out.len - 1] != '/') {
+        out.len--;
+      }
+      out.len--;
+      continue;
+    }
+    if (out.len + 1 + segment.size() >= FTP_PATH_MAX) {
+      return false;
     }
+    out.data[out.len++] = '/';
+    memcpy(out.data + out.len, segment.data(), segment.size());
+    out.len += segment.size();
   }
-  
-  ESP_LOGD(TAG, "Normalized path: %s (from base: %s, request: %s)", 
-           result.c_str(), base_path.c_str(), path.c_str());
-  
-  return result;
+
+  if (out.len == 0) {
+    out.data[out.len++] = '/';
+  }
+  out.data[out.len] = '\0';
+  return true;
 }
 
 void FTPServer::setup() {
   ESP_LOGI(TAG, "Setting up FTP server...");
 
-  if (root_path_.empty()) {
-    root_path_ = "/";
-  }
-  
-  if (root_path_.back() != '/') {
-    root_path_ += '/';
+  FTPPathBuffer root;
+  if (!resolve_path("/", "/", root_path_, root)) {
+    ESP_LOGE(TAG, "root_path %s is longer than %u characters", root_path_.c_str(), (unsigned) FTP_PATH_MAX - 1);
+    return;
   }
+  root_path_.assign(root.view());
+  temp_dir_ = (root_path_ == "/" ? std::string() : root_path_) + "/" + FTP_TEMP_DIR;
 
-  DIR *dir = opendir(root_path_.c_str());
-  if (dir == nullptr) {
+  setup_storage();
+  struct stat root_stat;
+  if (storage_->stat(root_path_, &root_stat) != 0 || !S_ISDIR(root_stat.st_mode)) {
     ESP_LOGE(TAG, "Root directory %s does not exist or is not accessible (errno: %d)", 
              root_path_.c_str(), errno);
-    if (mkdir(root_path_.c_str(), 0755) != 0) {
+    if (storage_->mkdir(root_path_) != 0) {
       ESP_LOGE(TAG, "Failed to create root directory %s (errno: %d)", 
                root_path_.c_str(), errno);
     } else {
       ESP_LOGI(TAG, "Created root directory %s", root_path_.c_str());
-      dir = opendir(root_path_.c_str());
     }
   }
-  
-  if (dir != nullptr) {
-    closedir(dir);
-  } else {
-    ESP_LOGE(TAG, "Root directory %s still not accessible after creation attempt", 
-             root_path_.c_str());
-  }
+  prepare_temp_dir();
 
   ftp_server_socket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (ftp_server_socket_ < 0) {
@@ -121,13 +203,219 @@ void FTPServer::setup() {
 
   ESP_LOGI(TAG, "FTP server started on port %d", port_);
   ESP_LOGI(TAG, "Root directory: %s", root_path_.c_str());
-  current_path_ = root_path_;
+
+  sessions_.resize(max_sessions_);
+  session_by_fd_.assign(FD_SETSIZE, NO_SESSION);
+
+  setup_passive_pool();
+#ifdef CONFIG_LWIP_MAX_SOCKETS
+  // Each session may hold a control, a passive listener and a data socket.
+  size_t sockets = 1 + passive_pool_.size() + max_sessions_ * (passive_pool_.empty() ? 3 : 2);
+  if (sockets > CONFIG_LWIP_MAX_SOCKETS) {
+    ESP_LOGW(TAG, "max_sessions %u may use %u of the %u lwIP sockets, leaving none for the API",
+             max_sessions_, (unsigned) sockets, (unsigned) CONFIG_LWIP_MAX_SOCKETS);
+  }
+#endif
+  if (max_bandwidth_ > 0) {
+    bandwidth_.configure(max_bandwidth_, max_sessions_ * SHAPING_MIN_QUANTUM + control_reserve_, millis());
+  }
+  if (transfer_workers_ > 0 && (max_bandwidth_ > 0 || session_bandwidth_ > 0)) {
+    // Buckets are only touched from loop(); shaped transfers stay there.
+    ESP_LOGW(TAG, "transfer_workers is ignored while bandwidth limits are set");
+    transfer_workers_ = 0;
+  }
+  setup_transfer_workers();
+  if (esp_event_handler_register(IP_EVENT, ESP_EVENT_ANY_ID, &FTPServer::ip_event_handler, this) != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to register IP event handler, passive address will not refresh");
+  }
+}
+
+void FTPServer::setup_storage() {
+  switch (storage_type_) {
+    case FTP_STORAGE_LITTLEFS:
+      if (!littlefs_partition_.empty()) {
+        mount_littlefs(littlefs_partition_, root_path_);
+      }
+      storage_ = make_littlefs_storage();
+      break;
+    case FTP_STORAGE_RAM:
+      storage_ = make_ram_storage(root_path_, ram_volume_size_);
+      break;
+    default:
+#ifdef USE_FTP_SD_MMC_CARD
+      storage_ = make_sd_card_storage(sd_card_);
+#else
+      storage_ = make_sd_card_storage();
+#endif
+      break;
+  }
+  // Staging a RAM volume in RAM would only copy every upload twice.
+  if (staging_size_ > 0 && storage_type_ != FTP_STORAGE_RAM) {
+    storage_ = make_staging_storage(std::move(storage_), staging_size_);
+  }
 }
 
 void FTPServer::loop() {
-  handle_new_clients();
-  for (size_t i = 0; i < client_sockets_.size(); i++) {
-    handle_ftp_client(client_sockets_[i]);
+  if (ftp_server_socket_ < 0) {
+    return;
+  }
+
+  drain_worker_completions();
+  if (storage_->busy()) {
+    // Write-back of staged uploads, a bounded amount per tick
+    storage_->loop();
+  }
+
+  if (millis() - last_telemetry_ms_ >= TELEMETRY_PUBLISH_INTERVAL_MS) {
+    last_telemetry_ms_ = millis();
+    publish_telemetry();
+  }
+
+  if (millis() - last_session_check_ms_ >= SESSION_CHECK_INTERVAL_MS) {
+    last_session_check_ms_ = millis();
+    expire_sessions(last_session_check_ms_);
+  }
+
+  // Build a single readiness set covering the listening socket, every control
+  // connection, every passive listener and every running data connection,
+  // then only dispatch what is ready.
+  fd_set read_fds;
+  fd_set write_fds;
+  FD_ZERO(&read_fds);
+  FD_ZERO(&write_fds);
+  int max_fd = ftp_server_socket_;
+  FD_SET(ftp_server_socket_, &read_fds);
+
+  for (auto &session : sessions_) {
+    if (!session.in_use || session.closing) {
+      continue;
+    }
+    FD_SET(session.control_socket, &read_fds);
+    max_fd = std::max(max_fd, session.control_socket);
+
+    if (session.passive_socket != -1 && session.pending_data_socket == -1) {
+      FD_SET(session.passive_socket, &read_fds);
+      max_fd = std::max(max_fd, session.passive_socket);
+    }
+
+    FTPTransfer &transfer = session.transfer;
+    if (transfer.state == FTP_TRANSFER_RUNNING) {
+      FD_SET(transfer.data_socket, transfer.direction == FTP_TRANSFER_SEND ? &write_fds : &read_fds);
+      max_fd = std::max(max_fd, transfer.data_socket);
+    }
+  }
+
+  bool background_work = active_transfers_ > 0 || active_hash_jobs_ > 0 || active_site_jobs_ > 0 || storage_->busy();
+  bool command_burst = millis() - last_command_ms_ < COMMAND_BURST_MS;
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = command_burst && !background_work ? REACTOR_SELECT_TIMEOUT_US : 0;
+
+  int ready = select(max_fd + 1, &read_fds, &write_fds, nullptr, &tv);
+  if (ready < 0) {
+    if (errno != EINTR) {
+      ESP_LOGW(TAG, "select() failed (errno: %d)", errno);
+    }
+    return;
+  }
+  if (ready == 0 && active_transfers_ == 0 && active_hash_jobs_ == 0 && active_site_jobs_ == 0) {
+    if (!storage_->busy() && !command_burst) {
+      high_freq_.stop();
+    }
+    return;
+  }
+  if (ready == 0) {
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+  }
+
+  if (FD_ISSET(ftp_server_socket_, &read_fds)) {
+    handle_new_clients();
+  }
+
+  // Slots never move, so handlers may release the session they are given.
+  // Transfers queued by a command are picked up in the same tick.
+  uint32_t now = millis();
+  for (auto &session : sessions_) {
+    if (!session.in_use || session.closing) {
+      continue;
+    }
+    int control_socket = session.control_socket;
+    if (session.passive_socket != -1 && session.pending_data_socket == -1 &&
+        FD_ISSET(session.passive_socket, &read_fds)) {
+      accept_data_connection(session);
+    }
+
+    if (FD_ISSET(control_socket, &read_fds)) {
+      handle_ftp_client(session);
+      if (!session.in_use || session.closing) {
+        continue;
+      }
+    }
+
+    FTPTransfer &transfer = session.transfer;
+    if (transfer.state == FTP_TRANSFER_WAIT_CONNECTION) {
+      if (session.pending_data_socket != -1) {
+        int data_socket = session.pending_data_socket;
+        session.pending_data_socket = -1;
+        attach_data_connection(session, data_socket);
+        if (transfer.state == FTP_TRANSFER_RUNNING && transfer_workers_ > 0 && !transfer.generated) {
+          offload_transfer(session);
+        }
+      } else if (now - transfer.started_ms > DATA_CONNECTION_TIMEOUT_MS) {
+        ESP_LOGW(TAG, "Timed out waiting for data connection");
+        close_data_connection(session);
+        finish_transfer(session, 425, "Can't open data connection");
+      }
+    }
+  }
+
+  // Running transfers go second. Each tick starts right after the transfer
+  // served first last time, so none is always first in line for the shared
+  // bandwidth.
+  size_t slot_count = sessions_.size();
+  size_t first_served = slot_count;
+  size_t runnable = 0;
+  for (auto &session : sessions_) {
+    if (session.in_use && !session.closing && transfer_ready(session.transfer, read_fds, write_fds)) {
+      runnable++;
+    }
+  }
+  if (max_bandwidth_ > 0) {
+    bandwidth_.refill(now);
+  }
+  for (size_t i = 0; i < slot_count; i++) {
+    FTPSession &session = sessions_[(next_transfer_slot_ + i) % slot_count];
+    if (!session.in_use || session.closing) {
+      continue;
+    }
+    FTPTransfer &transfer = session.transfer;
+    if (transfer_ready(transfer, read_fds, write_fds)) {
+      size_t budget = transfer_budget(session, runnable--);
+      if (budget > 0 && first_served == slot_count) {
+        first_served = (next_transfer_slot_ + i) % slot_count;
+      }
+      advance_transfer(session, budget);
+    }
+    if (session.hash_job) {
+      advance_hash_job(session);
+    }
+    if (session.site_job) {
+      advance_site_job(session);
+    }
+
+    // Resume commands pipelined behind a transfer or hash that just finished.
+    if (transfer.state == FTP_TRANSFER_DONE && !session.hash_job && !session.command_buffer.empty()) {
+      process_buffered_commands(session);
+    }
+  }
+  if (first_served != slot_count) {
+    next_transfer_slot_ = (first_served + 1) % slot_count;
+  }
+
+  if (active_transfers_ == 0 && active_hash_jobs_ == 0 && active_site_jobs_ == 0 && !storage_->busy() &&
+      millis() - last_command_ms_ >= COMMAND_BURST_MS) {
+    high_freq_.stop();
   }
 }
 
@@ -135,375 +423,235 @@ void FTPServer::dump_config() {
   ESP_LOGI(TAG, "FTP Server:");
   ESP_LOGI(TAG, "  Port: %d", port_);
   ESP_LOGI(TAG, "  Root Path: %s", root_path_.c_str());
+  if (storage_type_ == FTP_STORAGE_RAM) {
+    ESP_LOGI(TAG, "  Storage: ram (%u bytes)", (unsigned) ram_volume_size_);
+  } else if (staging_size_ > 0) {
+    ESP_LOGI(TAG, "  Storage: %s, write-back staging of %u bytes", storage_->name(), (unsigned) staging_size_);
+  } else {
+    ESP_LOGI(TAG, "  Storage: %s", storage_->name());
+  }
   ESP_LOGI(TAG, "  Username: %s", username_.c_str());
+  if (!passive_pool_.empty()) {
+    ESP_LOGI(TAG, "  Passive ports: %u-%u (%u pre-bound)", passive_port_start_, passive_port_end_,
+             (unsigned) passive_pool_.size());
+  }
+  if (transfer_workers_ > 0) {
+    ESP_LOGI(TAG, "  Transfer workers: %u", transfer_workers_);
+  }
+  if (max_bandwidth_ > 0) {
+    ESP_LOGI(TAG, "  Bandwidth limit: %u B/s (%u B/s kept for control)", (unsigned) max_bandwidth_,
+             (unsigned) control_reserve_);
+  }
+  if (session_bandwidth_ > 0) {
+    ESP_LOGI(TAG, "  Per-session bandwidth limit: %u B/s", (unsigned) session_bandwidth_);
+  }
+  ESP_LOGI(TAG, "  Max sessions: %u (%u bytes per slot)", max_sessions_, (unsigned) sizeof(FTPSession));
+  if (max_transfers_ > 0) {
+    ESP_LOGI(TAG, "  Max concurrent transfers: %u", max_transfers_);
+  }
+  ESP_LOGI(TAG, "  Login timeout: %u ms, idle timeout: %u ms", (unsigned) login_timeout_ms_,
+           (unsigned) idle_timeout_ms_);
   ESP_LOGI(TAG, "  Server status: %s", is_running() ? "Running" : "Not running");
 }
 
 void FTPServer::handle_new_clients() {
   struct sockaddr_in client_addr;
   socklen_t client_len = sizeof(client_addr);
-  int client_socket = accept(ftp_server_socket_, (struct sockaddr *)&client_addr, &client_len);
-  if (client_socket >= 0) {
+  int client_socket;
+  while ((client_socket = accept(ftp_server_socket_, (struct sockaddr *)&client_addr, &client_len)) >= 0) {
     fcntl(client_socket, F_SETFL, O_NONBLOCK);
+#ifdef SO_OOBINLINE
+    // Clients send the Telnet Synch before ABOR as TCP urgent data; keep it
+    // in the stream where receive_control_bytes() sees it. lwIP has no
+    // out-of-band queue and delivers it inline anyway.
+    int oob_inline = 1;
+    setsockopt(client_socket, SOL_SOCKET, SO_OOBINLINE, &oob_inline, sizeof(oob_inline));
+#endif
     char client_ip[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
     ESP_LOGI(TAG, "New FTP client connected from %s:%d", client_ip, ntohs(client_addr.sin_port));
-    client_sockets_.push_back(client_socket);
-    client_states_.push_back(FTP_WAIT_LOGIN);
-    client_usernames_.push_back("");
-    client_current_paths_.push_back(root_path_);
+    client_len = sizeof(client_addr);
+
+    FTPSession *session = allocate_session(client_socket);
+    if (session == nullptr && evict_idle_session(millis())) {
+      session = allocate_session(client_socket);
+    }
+    if (session == nullptr) {
+      ESP_LOGW(TAG, "Rejecting FTP client, all %u sessions in use", (unsigned) sessions_.size());
+      send_response(client_socket, 421, "Too many users, try again later");
+      close(client_socket);
+      continue;
+    }
     send_response(client_socket, 220, "Welcome to ESPHome FTP Server");
   }
 }
 
-void FTPServer::handle_ftp_client(int client_socket) {
+void FTPServer::handle_ftp_client(FTPSession &session) {
   char buffer[512];
-  int len = recv(client_socket, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+  int len = recv(session.control_socket, buffer, sizeof(buffer), MSG_DONTWAIT);
 
   if (len > 0) {
-    buffer[len] = '\0';
-    std::string command(buffer);
-    process_command(client_socket, command);
+    session.last_activity_ms = millis();
+    last_command_ms_ = session.last_activity_ms;
+    high_freq_.start();
+    // Measured after Telnet filtering: an IP or Synch in these bytes has
+    // already dropped what was queued, so the ABOR behind it survives.
+    receive_control_bytes(session, buffer, len);
+    if (session.command_buffer.size() > MAX_COMMAND_BUFFER) {
+      ESP_LOGW(TAG, "Control buffer overflow, discarding %u bytes", (unsigned) session.command_buffer.size());
+      session.command_buffer.clear();
+      send_response(session.control_socket, 500, "Command line too long");
+      return;
+    }
+    process_buffered_commands(session);
   } else if (len == 0) {
     ESP_LOGI(TAG, "FTP client disconnected");
-    close(client_socket);
-    auto it = std::find(client_sockets_.begin(), client_sockets_.end(), client_socket);
-    if (it != client_sockets_.end()) {
-      size_t index = it - client_sockets_.begin();
-      client_sockets_.erase(it);
-      client_states_.erase(client_states_.begin() + index);
-      client_usernames_.erase(client_usernames_.begin() + index);
-      client_current_paths_.erase(client_current_paths_.begin() + index);
-    }
+    release_session(session);
   } else if (errno != EWOULDBLOCK && errno != EAGAIN) {
     ESP_LOGW(TAG, "Socket error: %d", errno);
-    close(client_socket);
-    auto it = std::find(client_sockets_.begin(), client_sockets_.end(), client_socket);
-    if (it != client_sockets_.end()) {
-      size_t index = it - client_sockets_.begin();
-      client_sockets_.erase(it);
-      client_states_.erase(client_states_.begin() + index);
-      client_usernames_.erase(client_usernames_.begin() + index);
-      client_current_paths_.erase(client_current_paths_.begin() + index);
-    }
+    release_session(session);
   }
 }
 
+FTPSession *FTPServer::allocate_session(int client_socket) {
+  if (client_socket < 0 || static_cast<size_t>(client_socket) >= session_by_fd_.size()) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < sessions_.size(); i++) {
+    FTPSession &session = sessions_[i];
+    if (session.in_use) {
+      continue;
+    }
+    session = FTPSession();
+    session.in_use = true;
+    session.control_socket = client_socket;
+    session.current_path = root_path_;
+    session.connected_ms = millis();
+    session.last_activity_ms = session.connected_ms;
+    telemetry_.sessions_total++;
+    if (session_bandwidth_ > 0) {
+      session.bandwidth.configure(session_bandwidth_, 4 * SHAPING_MIN_QUANTUM, session.connected_ms);
+    }
+    session_by_fd_[client_socket] = i;
+    return &session;
+  }
+  return nullptr;
+}
 
-void FTPServer::process_command(int client_socket, const std::string& command) {
-  ESP_LOGI(TAG, "FTP command: %s", command.c_str());
-  std::string cmd_str = command;
-  size_t pos = cmd_str.find_first_of("\r\n");
-  if (pos != std::string::npos) {
-    cmd_str = cmd_str.substr(0, pos);
+FTPSession *FTPServer::find_session(int client_socket) {
+  if (client_socket < 0 || static_cast<size_t>(client_socket) >= session_by_fd_.size()) {
+    return nullptr;
+  }
+  uint8_t index = session_by_fd_[client_socket];
+  if (index == NO_SESSION) {
+    return nullptr;
   }
+  return &sessions_[index];
+}
 
-  auto it = std::find(client_sockets_.begin(), client_sockets_.end(), client_socket);
-  if (it == client_sockets_.end()) {
-    ESP_LOGE(TAG, "Client socket not found!");
+void FTPServer::release_session(FTPSession &session) {
+  if (!session.in_use || session.closing) {
     return;
   }
+  abort_transfer(session);
+  abort_hash_job(session);
+  abort_site_job(session);
+  close_data_connection(session);
+  close(session.control_socket);
+  session_by_fd_[session.control_socket] = NO_SESSION;
+  session.control_socket = -1;
+  if (session.transfer.state == FTP_TRANSFER_OFFLOADED) {
+    // The worker still owns the transfer; the slot is freed once it reports back.
+    session.closing = true;
+    return;
+  }
+  session.in_use = false;
+}
 
-  size_t client_index = it - client_sockets_.begin();
+bool FTPServer::session_busy(const FTPSession &session) {
+  return session.transfer.state != FTP_TRANSFER_DONE || session.hash_job != nullptr || session.site_job != nullptr;
+}
 
-  if (cmd_str.find("USER") == 0) {
-    std::string username = cmd_str.substr(5);
-    client_usernames_[client_index] = username;
-    send_response(client_socket, 331, "Password required for " + username);
-  } else if (cmd_str.find("PASS") == 0) {
-    std::string password = cmd_str.substr(5);
-    if (authenticate(client_usernames_[client_index], password)) {
-      client_states_[client_index] = FTP_LOGGED_IN;
-      send_response(client_socket, 230, "Login successful");
-    } else {
-      send_response(client_socket, 530, "Login incorrect");
-    }
-  } else if (client_states_[client_index] != FTP_LOGGED_IN) {
-    send_response(client_socket, 530, "Not logged in");
-  } else if (cmd_str.find("SYST") == 0) {
-    send_response(client_socket, 215, "UNIX Type: L8");
-  } else if (cmd_str.find("FEAT") == 0) {
-    send_response(client_socket, 211, "Features:");
-    send_response(client_socket, 211, " SIZE");
-    send_response(client_socket, 211, " MDTM");
-    send_response(client_socket, 211, "End");
-  } else if (cmd_str.find("TYPE") == 0) {
-    send_response(client_socket, 200, "Type set to " + cmd_str.substr(5));
-  } else if (cmd_str.find("PWD") == 0) {
-    std::string current_path = client_current_paths_[client_index];
-    std::string relative_path = "/";
-    if (current_path.length() > root_path_.length()) {
-      relative_path = current_path.substr(root_path_.length() - 1);
-    }
-    send_response(client_socket, 257, "\"" + relative_path + "\" is current directory");
-  } else if (cmd_str.find("CWD") == 0) {
-    std::string path = cmd_str.substr(4);
-    size_t first_non_space = path.find_first_not_of(" \t");
-    if (first_non_space != std::string::npos) {
-      path = path.substr(first_non_space);
-    }
-    
-    if (path.empty()) {
-      send_response(client_socket, 550, "Failed to change directory - path is empty");
-    } else {
-      std::string current_path = client_current_paths_[client_index];
-      std::string full_path;
-      
-      if (path == "/") {
-        full_path = root_path_;
-      } else {
-        full_path = normalize_path(current_path, path);
-      }
-      
-      ESP_LOGI(TAG, "Attempting to change directory to: %s", full_path.c_str());
-      
-      DIR *dir = opendir(full_path.c_str());
-      if (dir != nullptr) {
-        closedir(dir);
-        client_current_paths_[client_index] = full_path;
-        send_response(client_socket, 250, "Directory successfully changed");
-      } else {
-        ESP_LOGE(TAG, "Failed to open directory: %s (errno: %d)", full_path.c_str(), errno);
-        send_response(client_socket, 550, "Failed to change directory");
-      }
-    }
-  } else if (cmd_str.find("CDUP") == 0) {
-    std::string current = client_current_paths_[client_index];
-    
-    if (current == root_path_ || current.length() <= root_path_.length()) {
-      send_response(client_socket, 250, "Already at root directory");
-      return;
+// Sessions that never log in, or went quiet, hold a socket and lwIP buffers
+// out of a small pool; close them. A busy session is never idle.
+void FTPServer::expire_sessions(uint32_t now) {
+  for (auto &session : sessions_) {
+    if (!session.in_use || session.closing || session_busy(session)) {
+      continue;
     }
-    
-    size_t pos = current.find_last_of('/');
-    if (pos != std::string::npos && current.length() > 1) {
-      if (pos == current.length() - 1) {
-        std::string temp = current.substr(0, pos);
-        pos = temp.find_last_of('/');
-      }
-      
-      if (pos != std::string::npos) {
-        std::string parent_dir = current.substr(0, pos + 1);
-        
-        if (parent_dir.length() >= root_path_.length()) {
-          client_current_paths_[client_index] = parent_dir;
-          send_response(client_socket, 250, "Directory successfully changed");
-        } else {
-          client_current_paths_[client_index] = root_path_;
-          send_response(client_socket, 250, "Directory changed to root");
-        }
-      } else {
-        send_response(client_socket, 550, "Failed to change directory");
+    if (session.state != FTP_LOGGED_IN) {
+      if (login_timeout_ms_ > 0 && now - session.connected_ms > login_timeout_ms_) {
+        ESP_LOGI(TAG, "Closing session that did not log in within %u ms", (unsigned) login_timeout_ms_);
+        telemetry_.sessions_timed_out++;
+        send_response(session.control_socket, 421, "Login timeout, closing control connection");
+        release_session(session);
       }
-    } else {
-      send_response(client_socket, 550, "Failed to change directory");
+    } else if (idle_timeout_ms_ > 0 && now - session.last_activity_ms > idle_timeout_ms_) {
+      ESP_LOGI(TAG, "Closing session of %s, idle for %u ms", session.username.c_str(),
+               (unsigned) (now - session.last_activity_ms));
+      telemetry_.sessions_timed_out++;
+      send_response(session.control_socket, 421, "Idle timeout, closing control connection");
+      release_session(session);
     }
-  } else if (cmd_str.find("PASV") == 0) {
-    if (start_passive_mode(client_socket)) {
-      passive_mode_enabled_ = true;
-    } else {
-      send_response(client_socket, 425, "Can't open passive connection");
-    }
-  } else if (cmd_str.find("LIST") == 0 || cmd_str.find("NLST") == 0) {
-    std::string path_arg = "";
-    std::string cmd_type = cmd_str.substr(0, 4);
-    
-    if (cmd_str.length() > 5) {
-      path_arg = cmd_str.substr(5);
-      size_t first_non_space = path_arg.find_first_not_of(" \t");
-      if (first_non_space != std::string::npos) {
-        path_arg = path_arg.substr(first_non_space);
-      }
-    }
-    
-    std::string list_path;
-    if (path_arg.empty() || path_arg == ".") {
-      list_path = client_current_paths_[client_index];
-    } else {
-      list_path = normalize_path(client_current_paths_[client_index], path_arg);
-    }
-    
-    ESP_LOGI(TAG, "Listing directory: %s", list_path.c_str());
-    send_response(client_socket, 150, "Opening ASCII mode data connection for file list");
-    
-    if (cmd_type == "LIST") {
-      list_directory(client_socket, list_path);
-    } else {
-      list_names(client_socket, list_path);
-    }
-  } else if (cmd_str.find("STOR") == 0) {
-    std::string filename = cmd_str.substr(5);
-    size_t first_non_space = filename.find_first_not_of(" \t");
-    if (first_non_space != std::string::npos) {
-      filename = filename.substr(first_non_space);
-    }
-    
-    std::string full_path = normalize_path(client_current_paths_[client_index], filename);
-    ESP_LOGI(TAG, "Starting file upload to: %s", full_path.c_str());
-    send_response(client_socket, 150, "Opening connection for file upload");
-    start_file_upload(client_socket, full_path);
-  } else if (cmd_str.find("RETR") == 0) {
-    std::string filename = cmd_str.substr(5);
-    size_t first_non_space = filename.find_first_not_of(" \t");
-    if (first_non_space != std::string::npos) {
-      filename = filename.substr(first_non_space);
-    }
-    
-    std::string full_path = normalize_path(client_current_paths_[client_index], filename);
-    ESP_LOGI(TAG, "Starting file download from: %s", full_path.c_str());
-    
-    struct stat file_stat;
-    if (stat(full_path.c_str(), &file_stat) == 0) {
-      if (S_ISREG(file_stat.st_mode)) {
-        std::string size_msg = "Opening connection for file download (" +
-                              std::to_string(file_stat.st_size) + " bytes)";
-        send_response(client_socket, 150, size_msg);
-        start_file_download(client_socket, full_path);
-      } else {
-        send_response(client_socket, 550, "Not a regular file");
-      }
-    } else {
-      ESP_LOGE(TAG, "File not found: %s (errno: %d)", full_path.c_str(), errno);
-      send_response(client_socket, 550, "File not found");
-    }
-  } else if (cmd_str.find("DELE") == 0) {
-    std::string filename = cmd_str.substr(5);
-    size_t first_non_space = filename.find_first_not_of(" \t");
-    if (first_non_space != std::string::npos) {
-      filename = filename.substr(first_non_space);
-    }
-    
-    std::string full_path = normalize_path(client_current_paths_[client_index], filename);
-    ESP_LOGI(TAG, "Deleting file: %s", full_path.c_str());
-    
-    if (unlink(full_path.c_str()) == 0) {
-      send_response(client_socket, 250, "File deleted successfully");
-    } else {
-      ESP_LOGE(TAG, "Failed to delete file: %s (errno: %d)", full_path.c_str(), errno);
-      send_response(client_socket, 550, "Failed to delete file");
-    }
-  } else if (cmd_str.find("MKD") == 0) {
-    std::string dirname = cmd_str.substr(4);
-    size_t first_non_space = dirname.find_first_not_of(" \t");
-    if (first_non_space != std::string::npos) {
-      dirname = dirname.substr(first_non_space);
-    }
-    
-    std::string full_path = normalize_path(client_current_paths_[client_index], dirname);
-    ESP_LOGI(TAG, "Creating directory: %s", full_path.c_str());
-    
-    if (mkdir(full_path.c_str(), 0755) == 0) {
-      send_response(client_socket, 257, "Directory created");
-    } else {
-      ESP_LOGE(TAG, "Failed to create directory: %s (errno: %d)", full_path.c_str(), errno);
-      send_response(client_socket, 550, "Failed to create directory");
-    }
-  } else if (cmd_str.find("RMD") == 0) {
-    std::string dirname = cmd_str.substr(4);
-    size_t first_non_space = dirname.find_first_not_of(" \t");
-    if (first_non_space != std::string::npos) {
-      dirname = dirname.substr(first_non_space);
-    }
-    
-    std::string full_path = normalize_path(client_current_paths_[client_index], dirname);
-    ESP_LOGI(TAG, "Removing directory: %s", full_path.c_str());
-    
-    if (rmdir(full_path.c_str()) == 0) {
-      send_response(client_socket, 250, "Directory removed");
-    } else {
-      ESP_LOGE(TAG, "Failed to remove directory: %s (errno: %d)", full_path.c_str(), errno);
-      send_response(client_socket, 550, "Failed to remove directory");
-    }
-  } else if (cmd_str.find("RNFR") == 0) {
-    std::string filename = cmd_str.substr(5);
-    size_t first_non_space = filename.find_first_not_of(" \t");
-    if (first_non_space != std::string::npos) {
-      filename = filename.substr(first_non_space);
-    }
-    
-    rename_from_ = normalize_path(client_current_paths_[client_index], filename);
-    struct stat file_stat;
-    if (stat(rename_from_.c_str(), &file_stat) == 0) {
-      send_response(client_socket, 350, "Ready for RNTO");
-    } else {
-      ESP_LOGE(TAG, "File not found for rename: %s (errno: %d)", rename_from_.c_str(), errno);
-      send_response(client_socket, 550, "File not found");
-      rename_from_ = "";
+  }
+}
+
+// All slots are taken: close the least recently active session that is not
+// transferring, so a quiet client does not lock out a new one.
+bool FTPServer::evict_idle_session(uint32_t now) {
+  FTPSession *victim = nullptr;
+  for (auto &session : sessions_) {
+    if (!session.in_use || session.closing || session_busy(session)) {
+      continue;
     }
-  } else if (cmd_str.find("RNTO") == 0) {
-    if (rename_from_.empty()) {
-      send_response(client_socket, 503, "RNFR required first");
-    } else {
-      std::string filename = cmd_str.substr(5);
-      size_t first_non_space = filename.find_first_not_of(" \t");
-      if (first_non_space != std::string::npos) {
-        filename = filename.substr(first_non_space);
-      }
-      
-      std::string rename_to = normalize_path(client_current_paths_[client_index], filename);
-      ESP_LOGI(TAG, "Renaming from %s to %s", rename_from_.c_str(), rename_to.c_str());
-      
-      if (rename(rename_from_.c_str(), rename_to.c_str()) == 0) {
-        send_response(client_socket, 250, "Rename successful");
-      } else {
-        ESP_LOGE(TAG, "Failed to rename: %s -> %s (errno: %d)", 
-                 rename_from_.c_str(), rename_to.c_str(), errno);
-        send_response(client_socket, 550, "Rename failed");
-      }
-      rename_from_ = "";
-    }
-  } else if (cmd_str.find("SIZE") == 0) {
-    std::string filename = cmd_str.substr(5);
-    size_t first_non_space = filename.find_first_not_of(" \t");
-    if (first_non_space != std::string::npos) {
-      filename = filename.substr(first_non_space);
-    }
-    
-    std::string full_path = normalize_path(client_current_paths_[client_index], filename);
-    struct stat file_stat;
-    if (stat(full_path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
-      send_response(client_socket, 213, std::to_string(file_stat.st_size));
-    } else {
-      send_response(client_socket, 550, "File not found or not a regular file");
-    }
-  } else if (cmd_str.find("MDTM") == 0) {
-    std::string filename = cmd_str.substr(5);
-    size_t first_non_space = filename.find_first_not_of(" \t");
-    if (first_non_space != std::string::npos) {
-      filename = filename.substr(first_non_space);
-    }
-    
-    std::string full_path = normalize_path(client_current_paths_[client_index], filename);
-    struct stat file_stat;
-    if (stat(full_path.c_str(), &file_stat) == 0) {
-      char mdtm_str[15];
-      struct tm *tm_info = gmtime(&file_stat.st_mtime);
-      strftime(mdtm_str, sizeof(mdtm_str), "%Y%m%d%H%M%S", tm_info);
-      send_response(client_socket, 213, mdtm_str);
-    } else {
-      send_response(client_socket, 550, "File not found");
-    }
-  } else if (cmd_str.find("NOOP") == 0) {
-    send_response(client_socket, 200, "NOOP command successful");
-  } else if (cmd_str.find("QUIT") == 0) {
-    send_response(client_socket, 221, "Goodbye");
-    close(client_socket);
-    auto it = std::find(client_sockets_.begin(), client_sockets_.end(), client_socket);
-    if (it != client_sockets_.end()) {
-      size_t index = it - client_sockets_.begin();
-      client_sockets_.erase(it);
-      client_states_.erase(client_states_.begin() + index);
-      client_usernames_.erase(client_usernames_.begin() + index);
-      client_current_paths_.erase(client_current_paths_.begin() + index);
+    if (session.state == FTP_LOGGED_IN && now - session.last_activity_ms < SESSION_EVICT_MIN_IDLE_MS) {
+      continue;
+    }
+    if (victim == nullptr || now - session.last_activity_ms > now - victim->last_activity_ms) {
+      victim = &session;
     }
-  } else {
-    send_response(client_socket, 502, "Command not implemented");
   }
+  if (victim == nullptr) {
+    return false;
+  }
+  ESP_LOGI(TAG, "Evicting session idle for %u ms to admit a new client",
+           (unsigned) (now - victim->last_activity_ms));
+  telemetry_.sessions_evicted++;
+  send_response(victim->control_socket, 421, "Session closed to make room for another client");
+  release_session(*victim);
+  return true;
+}
+
+// Checked by the commands that open a data connection, before their 150.
+bool FTPServer::admit_transfer(FTPSession &session) {
+  if (max_transfers_ == 0 || active_transfers_ < max_transfers_) {
+    return true;
+  }
+  close_data_connection(session);
+  send_response(session.control_socket, 425, "Too many transfers in progress, try again later");
+  return false;
 }
 
 void FTPServer::send_response(int client_socket, int code, const std::string& message) {
   std::string response = std::to_string(code) + " " + message + "\r\n";
   send(client_socket, response.c_str(), response.length(), 0);
+  bandwidth_.consume(response.length());
+  ESP_LOGD(TAG, "Sent: %s", response.c_str());
+}
+
+// RFC 959 multi-line reply: "code-first", indented body lines, "code last".
+void FTPServer::send_multiline_response(int client_socket, int code, const std::vector<std::string>& lines) {
+  if (lines.size() < 2) {
+    send_response(client_socket, code, lines.empty() ? std::string() : lines.front());
+    return;
+  }
+  std::string response = std::to_string(code) + "-" + lines.front() + "\r\n";
+  for (size_t i = 1; i + 1 < lines.size(); i++) {
+    response += " " + lines[i] + "\r\n";
+  }
+  response += std::to_string(code) + " " + lines.back() + "\r\n";
+  send(client_socket, response.c_str(), response.length(), 0);
+  bandwidth_.consume(response.length());
   ESP_LOGD(TAG, "Sent: %s", response.c_str());
 }
 
@@ -511,314 +659,1273 @@ bool FTPServer::authenticate(const std::string& username, const std::string& pas
   return username == username_ && password == password_;
 }
 
-bool FTPServer::start_passive_mode(int client_socket) {
-  if (passive_data_socket_ != -1) {
-    close(passive_data_socket_);
-    passive_data_socket_ = -1;
+// Resolves a command argument for the session, replying 550 when it cannot be.
+bool FTPServer::resolve_client_path(FTPSession &session, std::string_view arg, std::string *path) {
+  FTPPathBuffer resolved;
+  if (!resolve_path(root_path_, session.current_path, arg, resolved)) {
+    ESP_LOGW(TAG, "Rejected path outside of root: %.*s", (int) arg.size(), arg.data());
+    send_response(session.control_socket, 550, "Invalid path");
+    return false;
+  }
+  if (is_temp_path(resolved.view())) {
+    send_response(session.control_socket, 550, "Invalid path");
+    return false;
+  }
+  path->assign(resolved.view());
+  return true;
+}
+
+// A canonical path as the client sees it, relative to root.
+std::string FTPServer::client_path(const std::string& path) const {
+  if (root_path_ == "/") {
+    return path;
   }
+  return path.size() > root_path_.size() ? path.substr(root_path_.size()) : "/";
+}
 
-  passive_data_socket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (passive_data_socket_ < 0) {
-    ESP_LOGE(TAG, "Failed to create passive data socket (errno: %d)", errno);
+// CWD and MLSD probe the same few directories over and over; a session
+// skips the storage for the ones it validated recently.
+bool FTPServer::is_directory(FTPSession &session, const std::string& path) {
+  uint32_t now = millis();
+  for (const auto &entry : session.dir_cache) {
+    if (entry.generation == directory_generation_ && now - entry.validated_ms < DIR_CACHE_MAX_AGE_MS &&
+        entry.path == path) {
+      return true;
+    }
+  }
+  struct stat dir_stat;
+  if (storage_->stat(path, &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode)) {
     return false;
   }
+  auto oldest = std::min_element(session.dir_cache.begin(), session.dir_cache.end(),
+                                 [this](const FTPDirCacheEntry &a, const FTPDirCacheEntry &b) {
+                                   // Stale entries go first
+                                   bool a_stale = a.generation != directory_generation_;
+                                   bool b_stale = b.generation != directory_generation_;
+                                   return a_stale != b_stale ? a_stale : a.validated_ms < b.validated_ms;
+                                 });
+  oldest->path = path;
+  oldest->generation = directory_generation_;
+  oldest->validated_ms = now;
+  return true;
+}
+
+// Whether a file could be created at path, which is canonical. Files built
+// in FTP_TEMP_DIR only find out at their rename otherwise.
+bool FTPServer::parent_is_directory(FTPSession &session, const std::string& path) {
+  size_t slash = path.rfind('/');
+  return is_directory(session, slash == 0 ? std::string("/") : path.substr(0, slash));
+}
+
+int FTPServer::create_passive_listener(uint16_t port) {
+  int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listener < 0) {
+    ESP_LOGE(TAG, "Failed to create passive data socket (errno: %d)", errno);
+    return -1;
+  }
 
   int opt = 1;
-  if (setsockopt(passive_data_socket_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+  if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
     ESP_LOGE(TAG, "Failed to set socket options for passive mode (errno: %d)", errno);
-    close(passive_data_socket_);
-    passive_data_socket_ = -1;
-    return false;
+    close(listener);
+    return -1;
   }
 
   struct sockaddr_in data_addr;
   memset(&data_addr, 0, sizeof(data_addr));
   data_addr.sin_family = AF_INET;
   data_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  data_addr.sin_port = htons(0);
+  data_addr.sin_port = htons(port);
 
-  if (bind(passive_data_socket_, (struct sockaddr *)&data_addr, sizeof(data_addr)) < 0) {
-    ESP_LOGE(TAG, "Failed to bind passive data socket (errno: %d)", errno);
-    close(passive_data_socket_);
-    passive_data_socket_ = -1;
-    return false;
+  if (bind(listener, (struct sockaddr *)&data_addr, sizeof(data_addr)) < 0) {
+    ESP_LOGE(TAG, "Failed to bind passive data socket to port %u (errno: %d)", port, errno);
+    close(listener);
+    return -1;
   }
 
-  if (listen(passive_data_socket_, 1) < 0) {
+  if (listen(listener, 1) < 0) {
     ESP_LOGE(TAG, "Failed to listen on passive data socket (errno: %d)", errno);
-    close(passive_data_socket_);
-    passive_data_socket_ = -1;
-    return false;
+    close(listener);
+    return -1;
   }
 
-  struct sockaddr_in sin;
-  socklen_t len = sizeof(sin);
-  if (getsockname(passive_data_socket_, (struct sockaddr *)&sin, &len) < 0) {
-    ESP_LOGE(TAG, "Failed to get socket name (errno: %d)", errno);
-    close(passive_data_socket_);
-    passive_data_socket_ = -1;
-    return false;
+  fcntl(listener, F_SETFL, O_NONBLOCK);
+  return listener;
+}
+
+void FTPServer::setup_passive_pool() {
+  if (passive_port_start_ == 0 || passive_port_end_ < passive_port_start_) {
+    return;
+  }
+  for (uint32_t port = passive_port_start_; port <= passive_port_end_; port++) {
+    int listener = create_passive_listener(port);
+    if (listener < 0) {
+      continue;
+    }
+    FTPPassivePort entry;
+    entry.socket = listener;
+    entry.port = port;
+    passive_pool_.push_back(entry);
+  }
+  ESP_LOGI(TAG, "Pre-bound %u passive ports in range %u-%u", (unsigned) passive_pool_.size(),
+           passive_port_start_, passive_port_end_);
+}
+
+bool FTPServer::acquire_passive_port(FTPSession &session) {
+  // Round-robin so a port is not handed out again right after being
+  // released, while a slow client may still be connecting to it.
+  for (size_t i = 0; i < passive_pool_.size(); i++) {
+    size_t slot = (passive_pool_next_ + i) % passive_pool_.size();
+    FTPPassivePort &entry = passive_pool_[slot];
+    if (entry.in_use) {
+      continue;
+    }
+    entry.in_use = true;
+    passive_pool_next_ = slot + 1;
+    session.passive_socket = entry.socket;
+    session.passive_port = entry.port;
+    session.passive_slot = slot;
+    return true;
+  }
+  return false;
+}
+
+void FTPServer::release_passive_port(FTPSession &session) {
+  FTPPassivePort &entry = passive_pool_[session.passive_slot];
+  // Drop connections that reached the listener after its session gave up
+  // on it, so the next owner does not pick up a stranger's data socket.
+  int stale;
+  while ((stale = accept(entry.socket, nullptr, nullptr)) >= 0) {
+    close(stale);
   }
+  entry.in_use = false;
+  session.passive_socket = -1;
+  session.passive_port = -1;
+  session.passive_slot = -1;
+}
 
-  passive_data_port_ = ntohs(sin.sin_port);
+void FTPServer::ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+  static_cast<FTPServer *>(arg)->passive_ip_stale_ = true;
+}
 
-  esp_netif_t *netif = esp_netif_get_default_netif();
-  if (netif == nullptr) {
-    ESP_LOGE(TAG, "Failed to get default netif");
-    close(passive_data_socket_);
-    passive_data_socket_ = -1;
-    return false;
+bool FTPServer::get_passive_address(uint32_t &ip) {
+  if (passive_ip_stale_.exchange(false) || passive_ip_ == 0) {
+    esp_netif_t *netif = esp_netif_get_default_netif();
+    if (netif == nullptr) {
+      ESP_LOGE(TAG, "Failed to get default netif");
+      passive_ip_stale_ = true;
+      return false;
+    }
+    esp_netif_ip_info_t ip_info;
+    if (esp_netif_get_ip_info(netif, &ip_info) != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to get IP info");
+      passive_ip_stale_ = true;
+      return false;
+    }
+    passive_ip_ = ip_info.ip.addr;
   }
-  esp_netif_ip_info_t ip_info;
-  if (esp_netif_get_ip_info(netif, &ip_info) != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to get IP info");
-    close(passive_data_socket_);
-    passive_data_socket_ = -1;
+  ip = passive_ip_;
+  return true;
+}
+
+bool FTPServer::start_passive_mode(FTPSession &session) {
+  close_data_connection(session);
+
+  uint32_t ip;
+  if (!get_passive_address(ip)) {
     return false;
   }
 
-  uint32_t ip = ip_info.ip.addr;
+  if (!passive_pool_.empty()) {
+    if (!acquire_passive_port(session)) {
+      ESP_LOGW(TAG, "All %u passive ports are in use", (unsigned) passive_pool_.size());
+      return false;
+    }
+  } else {
+    session.passive_socket = create_passive_listener(0);
+    if (session.passive_socket < 0) {
+      return false;
+    }
+
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    if (getsockname(session.passive_socket, (struct sockaddr *)&sin, &len) < 0) {
+      ESP_LOGE(TAG, "Failed to get socket name (errno: %d)", errno);
+      close(session.passive_socket);
+      session.passive_socket = -1;
+      return false;
+    }
+    session.passive_port = ntohs(sin.sin_port);
+  }
+
   std::string response = "Entering Passive Mode (" +
                         std::to_string((ip & 0xFF)) + "," +
                         std::to_string((ip >> 8) & 0xFF) + "," +
                         std::to_string((ip >> 16) & 0xFF) + "," +
                         std::to_string((ip >> 24) & 0xFF) + "," +
-                        std::to_string(passive_data_port_ >> 8) + "," +
-                        std::to_string(passive_data_port_ & 0xFF) + ")";
+                        std::to_string(session.passive_port >> 8) + "," +
+                        std::to_string(session.passive_port & 0xFF) + ")";
 
-  send_response(client_socket, 227, response);
+  session.passive_opened_ms = millis();
+  send_response(session.control_socket, 227, response);
   return true;
 }
 
-int FTPServer::open_data_connection(int client_socket) {
-  if (passive_data_socket_ == -1) {
-    return -1;
+void FTPServer::accept_data_connection(FTPSession &session) {
+  struct sockaddr_in client_addr;
+  socklen_t client_len = sizeof(client_addr);
+  int data_socket = accept(session.passive_socket, (struct sockaddr *)&client_addr, &client_len);
+  if (data_socket < 0) {
+    if (errno != EWOULDBLOCK && errno != EAGAIN) {
+      ESP_LOGW(TAG, "Failed to accept passive data connection (errno: %d)", errno);
+    }
+    return;
   }
+  ESP_LOGD(TAG, "Data connection accepted ahead of transfer command");
+  telemetry_.accept_latency.add(millis() - session.passive_opened_ms);
+  session.pending_data_socket = data_socket;
+}
 
-  struct timeval tv;
-  tv.tv_sec = 5;
-  tv.tv_usec = 0;
+void FTPServer::close_data_connection(FTPSession &session) {
+  if (session.pending_data_socket != -1) {
+    close(session.pending_data_socket);
+    session.pending_data_socket = -1;
+  }
+  if (session.passive_slot != -1) {
+    release_passive_port(session);
+  } else if (session.passive_socket != -1) {
+    close(session.passive_socket);
+    session.passive_socket = -1;
+    session.passive_port = -1;
+  }
+}
 
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(passive_data_socket_, &readfds);
+int format_mlsx_facts(const struct stat &entry_stat, char *out, size_t out_size) {
+  char modify[15];
+  struct tm tm_info;
+  gmtime_r(&entry_stat.st_mtime, &tm_info);
+  strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", &tm_info);
 
-  int ret = select(passive_data_socket_ + 1, &readfds, nullptr, nullptr, &tv);
-  if (ret <= 0) {
-    return -1;
+  bool writable = entry_stat.st_mode & S_IWUSR;
+  if (S_ISDIR(entry_stat.st_mode)) {
+    return snprintf(out, out_size, "type=dir;modify=%s;perm=%s;", modify, writable ? "elcmpdf" : "el");
   }
+  return snprintf(out, out_size, "type=file;size=%llu;modify=%s;perm=%s;", (unsigned long long) entry_stat.st_size,
+                  modify, writable ? "rwadf" : "r");
+}
 
-  struct sockaddr_in client_addr;
-  socklen_t client_len = sizeof(client_addr);
-  int data_socket = accept(passive_data_socket_, (struct sockaddr *)&client_addr, &client_len);
+// Cache keys have no trailing slash so "/sdcard/a/" and "/sdcard/a" match.
+static std::string listing_key(const std::string& path) {
+  std::string key = path;
+  while (key.size() > 1 && key.back() == '/') {
+    key.pop_back();
+  }
+  return key;
+}
 
-  if (data_socket < 0) {
-    return -1;
+static void append_listing_line(std::string &out, const std::string& name, const struct stat &entry_stat,
+                                FTPListFormat format) {
+  char line[512];
+  int line_len;
+  if (format == FTP_LIST_MACHINE) {
+    line_len = format_mlsx_facts(entry_stat, line, sizeof(line));
+    if (line_len > 0 && static_cast<size_t>(line_len) < sizeof(line)) {
+      line_len += snprintf(line + line_len, sizeof(line) - line_len, " %s\r\n", name.c_str());
+    }
+  } else {
+    char time_str[80];
+    strftime(time_str, sizeof(time_str), "%b %d %H:%M", localtime(&entry_stat.st_mtime));
+
+    char perm_str[11] = "----------";
+    if (S_ISDIR(entry_stat.st_mode)) perm_str[0] = 'd';
+    if (entry_stat.st_mode & S_IRUSR) perm_str[1] = 'r';
+    if (entry_stat.st_mode & S_IWUSR) perm_str[2] = 'w';
+    if (entry_stat.st_mode & S_IXUSR) perm_str[3] = 'x';
+    if (entry_stat.st_mode & S_IRGRP) perm_str[4] = 'r';
+    if (entry_stat.st_mode & S_IWGRP) perm_str[5] = 'w';
+    if (entry_stat.st_mode & S_IXGRP) perm_str[6] = 'x';
+    if (entry_stat.st_mode & S_IROTH) perm_str[7] = 'r';
+    if (entry_stat.st_mode & S_IWOTH) perm_str[8] = 'w';
+    if (entry_stat.st_mode & S_IXOTH) perm_str[9] = 'x';
+
+    line_len = snprintf(line, sizeof(line), "%s 1 root root %8ld %s %s\r\n",
+                        perm_str, (long)entry_stat.st_size, time_str, name.c_str());
   }
+  if (line_len > 0) {
+    out.append(line, std::min<size_t>(line_len, sizeof(line) - 1));
+  }
+}
 
-  int flags = fcntl(data_socket, F_GETFL, 0);
-  fcntl(data_socket, F_SETFL, flags & ~O_NONBLOCK);
+// Renders a whole listing into listing_scratch_, whose capacity is kept
+// between calls, and returns an immutable copy that transfers and the cache
+// can share. NLST only needs names, so it never stats anything. A pattern
+// keeps matching names only; NLST puts prefix in front of each.
+FTPListing FTPServer::render_listing(const std::string& path, FTPListFormat format, const std::string& pattern,
+                                     const std::string& prefix) {
+  std::string &out = listing_scratch_;
+  out.clear();
+  bool names_only = format == FTP_LIST_NAMES;
+  int result = storage_->list(path, !names_only, [&](const std::string &entry_name, const struct stat &entry_stat) {
+    if (entry_name == FTP_TEMP_DIR || (!pattern.empty() && !glob_match(pattern, entry_name))) {
+      return;
+    }
+    if (names_only) {
+      out.append(prefix).append(entry_name).append("\r\n");
+    } else {
+      append_listing_line(out, entry_name, entry_stat, format);
+    }
+  });
+  if (result != 0) {
+    return nullptr;
+  }
 
-  return data_socket;
+  return std::make_shared<const std::string>(out);
 }
 
-void FTPServer::close_data_connection(int client_socket) {
-  if (passive_data_socket_ != -1) {
-    close(passive_data_socket_);
-    passive_data_socket_ = -1;
-    passive_data_port_ = -1;
-    passive_mode_enabled_ = false;
+FTPListing FTPServer::cached_listing(const std::string& key, FTPListFormat format) {
+  uint32_t now = millis();
+  for (auto it = listing_cache_.begin(); it != listing_cache_.end(); ++it) {
+    if (it->path != key || it->format != format) {
+      continue;
+    }
+    if (now - it->rendered_ms > LISTING_CACHE_MAX_AGE_MS) {
+      // Bounds how long changes made behind our back (web UI, other
+      // components writing to the card) stay invisible.
+      listing_cache_bytes_ -= it->listing->size();
+      listing_cache_.erase(it);
+      return nullptr;
+    }
+    it->used_ms = now;
+    return it->listing;
   }
+  return nullptr;
 }
 
-void FTPServer::list_directory(int client_socket, const std::string& path) {
-  int data_socket = open_data_connection(client_socket);
-  if (data_socket < 0) {
-    send_response(client_socket, 425, "Can't open data connection");
+void FTPServer::cache_listing(const std::string& key, FTPListFormat format, const FTPListing &listing) {
+  size_t size = listing->size();
+  if (size > listing_cache_size_) {
     return;
   }
+  while (!listing_cache_.empty() &&
+         (listing_cache_.size() >= LISTING_CACHE_ENTRIES || listing_cache_bytes_ + size > listing_cache_size_)) {
+    auto lru = std::min_element(listing_cache_.begin(), listing_cache_.end(),
+                                [](const FTPListingCacheEntry &a, const FTPListingCacheEntry &b) {
+                                  return a.used_ms < b.used_ms;
+                                });
+    listing_cache_bytes_ -= lru->listing->size();
+    listing_cache_.erase(lru);
+  }
+
+  FTPListingCacheEntry cache_entry;
+  cache_entry.path = key;
+  cache_entry.format = format;
+  cache_entry.listing = listing;
+  cache_entry.rendered_ms = millis();
+  cache_entry.used_ms = cache_entry.rendered_ms;
+  listing_cache_.push_back(std::move(cache_entry));
+  listing_cache_bytes_ += size;
+}
 
-  DIR *dir = opendir(path.c_str());
-  if (dir == nullptr) {
-    close(data_socket);
-    close_data_connection(client_socket);
-    send_response(client_socket, 550, "Failed to open directory");
+// Drops cached listings that a change to path can make stale: the
+// directory holding it and, for directories, the path itself and below.
+void FTPServer::invalidate_listings(const std::string& path) {
+  if (listing_cache_.empty()) {
     return;
   }
+  std::string key = listing_key(path);
+  size_t slash = key.rfind('/');
+  std::string parent = slash == std::string::npos || slash == 0 ? "/" : key.substr(0, slash);
+  std::string subtree = key + "/";
+
+  for (size_t i = 0; i < listing_cache_.size();) {
+    const std::string &cached = listing_cache_[i].path;
+    if (cached == key || cached == parent || cached.compare(0, subtree.size(), subtree) == 0) {
+      listing_cache_bytes_ -= listing_cache_[i].listing->size();
+      listing_cache_.erase(listing_cache_.begin() + i);
+    } else {
+      i++;
+    }
+  }
+}
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != nullptr) {
-    std::string entry_name = entry->d_name;
-    if (entry_name == "." || entry_name == "..") {
-      continue;
+// Filtered listings are rendered every time; only whole directories are cached.
+void FTPServer::list_directory(FTPSession &session, const std::string& path, FTPListFormat format,
+                               const std::string& pattern, const std::string& prefix) {
+  std::string key = listing_key(path);
+  bool cacheable = listing_cache_size_ > 0 && pattern.empty();
+  FTPListing listing = cacheable ? cached_listing(key, format) : nullptr;
+  if (listing) {
+    ESP_LOGD(TAG, "Serving cached listing of %s", key.c_str());
+  } else {
+    listing = render_listing(path, format, pattern, prefix);
+    if (!listing) {
+      close_data_connection(session);
+      send_response(session.control_socket, 550, "Failed to open directory");
+      return;
     }
+    if (cacheable) {
+      cache_listing(key, format, listing);
+    }
+  }
 
-    std::string full_path = path + "/" + entry_name;
-    struct stat entry_stat;
-    if (stat(full_path.c_str(), &entry_stat) == 0) {
-      char time_str[80];
-      strftime(time_str, sizeof(time_str), "%b %d %H:%M", localtime(&entry_stat.st_mtime));
-      
-      char perm_str[11] = "----------";
-      if (S_ISDIR(entry_stat.st_mode)) perm_str[0] = 'd';
-      if (entry_stat.st_mode & S_IRUSR) perm_str[1] = 'r';
-      if (entry_stat.st_mode & S_IWUSR) perm_str[2] = 'w';
-      if (entry_stat.st_mode & S_IXUSR) perm_str[3] = 'x';
-      if (entry_stat.st_mode & S_IRGRP) perm_str[4] = 'r';
-      if (entry_stat.st_mode & S_IWGRP) perm_str[5] = 'w';
-      if (entry_stat.st_mode & S_IXGRP) perm_str[6] = 'x';
-      if (entry_stat.st_mode & S_IROTH) perm_str[7] = 'r';
-      if (entry_stat.st_mode & S_IWOTH) perm_str[8] = 'w';
-      if (entry_stat.st_mode & S_IXOTH) perm_str[9] = 'x';
-
-      char list_item[512];
-      snprintf(list_item, sizeof(list_item),
-               "%s 1 root root %8ld %s %s\r\n",
-               perm_str, (long)entry_stat.st_size, time_str, entry_name.c_str());
-      
-      send(data_socket, list_item, strlen(list_item), 0);
-    }
-  }
-
-  closedir(dir);
-  close(data_socket);
-  close_data_connection(client_socket);
-  send_response(client_socket, 226, "Directory send OK");
-}
-
-void FTPServer::list_names(int client_socket, const std::string& path) {
-  int data_socket = open_data_connection(client_socket);
-  if (data_socket < 0) {
-    send_response(client_socket, 425, "Can't open data connection");
-    return;
+  if (session.mode_z) {
+    // Listings are small and cached uncompressed; deflate them in one go.
+    listing = deflate_listing(listing, compression_level_, compression_window_bits_, compression_mem_level());
+    if (!listing) {
+      close_data_connection(session);
+      send_response(session.control_socket, 451, "Requested action aborted: local error in processing");
+      return;
+    }
   }
 
-  DIR *dir = opendir(path.c_str());
-  if (dir == nullptr) {
-    close(data_socket);
-    close_data_connection(client_socket);
-    send_response(client_socket, 550, "Failed to open directory");
+  abort_transfer(session);
+  FTPTransfer &transfer = session.transfer;
+  transfer = FTPTransfer();
+  transfer.direction = FTP_TRANSFER_SEND;
+  transfer.is_listing = true;
+  transfer.listing = std::move(listing);
+  queue_transfer(session);
+}
+
+void FTPServer::start_file_upload(FTPSession &session, const std::string& path, size_t size_hint, size_t offset,
+                                  bool append) {
+  abort_transfer(session);
+  FTPTransfer &transfer = session.transfer;
+  transfer = FTPTransfer();
+  transfer.direction = FTP_TRANSFER_RECEIVE;
+  transfer.path = path;
+  transfer.preallocated = size_hint;
+  transfer.file_pos = offset;
+  transfer.append = append;
+  // A resumed STOR or an APPE builds on the file itself. cmd_stor() made
+  // sure FTP_TEMP_DIR is there.
+  if (atomic_uploads_ && offset == 0 && !append) {
+    transfer.temp_path = temp_path_for(session);
+  }
+  queue_transfer(session);
+}
+
+// Empties FTP_TEMP_DIR of what a reboot mid-upload left behind, creating it
+// if needed. Tried again on the next upload while the storage is missing;
+// until then STOR is refused.
+bool FTPServer::prepare_temp_dir() {
+  if (temp_dir_ready_) {
+    return true;
+  }
+  std::vector<std::string> stale;
+  int result = storage_->list(temp_dir_, false, [&](const std::string &entry_name, const struct stat &entry_stat) {
+    stale.push_back(entry_name);
+  });
+  if (result == 0) {
+    for (const std::string &name : stale) {
+      if (storage_->unlink(temp_dir_ + "/" + name) != 0) {
+        ESP_LOGW(TAG, "Could not remove stale %s/%s (errno: %d)", temp_dir_.c_str(), name.c_str(), errno);
+      }
+    }
+    if (!stale.empty()) {
+      ESP_LOGI(TAG, "Removed %u stale temporary files", (unsigned) stale.size());
+    }
+  } else if (storage_->mkdir(temp_dir_) != 0) {
+    ESP_LOGW(TAG, "Failed to create %s (errno: %d)", temp_dir_.c_str(), errno);
+    return false;
+  }
+  temp_dir_ready_ = true;
+  return true;
+}
+
+// Session slot and a counter: two sessions storing the same path never
+// share a temporary file.
+std::string FTPServer::temp_path_for(const FTPSession &session) {
+  return temp_dir_ + "/" + std::to_string(&session - sessions_.data()) + "-" + std::to_string(++temp_counter_);
+}
+
+bool FTPServer::is_temp_path(std::string_view path) const {
+  return path.compare(0, temp_dir_.size(), temp_dir_) == 0 &&
+         (path.size() == temp_dir_.size() || path[temp_dir_.size()] == '/');
+}
+
+void FTPServer::start_file_download(FTPSession &session, const std::string& path, size_t offset) {
+  abort_transfer(session);
+  FTPTransfer &transfer = session.transfer;
+  transfer = FTPTransfer();
+  transfer.direction = FTP_TRANSFER_SEND;
+  transfer.path = path;
+  transfer.file_pos = offset;
+  queue_transfer(session);
+}
+
+// Sends what file produces, or hands it what is received, like RETR/STOR
+// of a plain file but without REST and without leaving loop(): these files
+// walk or write the storage as they go.
+void FTPServer::start_generated_transfer(FTPSession &session, FTPTransferDirection direction,
+                                         const std::string& path, FTPFilePtr file) {
+  abort_transfer(session);
+  FTPTransfer &transfer = session.transfer;
+  transfer = FTPTransfer();
+  transfer.direction = direction;
+  transfer.path = path;
+  transfer.file = std::move(file);
+  transfer.generated = true;
+  queue_transfer(session);
+}
+
+void FTPServer::queue_transfer(FTPSession &session) {
+  FTPTransfer &transfer = session.transfer;
+  if (session.passive_socket == -1 && session.pending_data_socket == -1) {
+    transfer = FTPTransfer();
+    send_response(session.control_socket, 425, "Can't open data connection");
     return;
   }
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != nullptr) {
-    std::string entry_name = entry->d_name;
-    if (entry_name == "." || entry_name == "..") {
+  transfer.state = FTP_TRANSFER_WAIT_CONNECTION;
+  transfer.started_ms = millis();
+  active_transfers_++;
+  high_freq_.start();
+}
+
+void FTPServer::attach_data_connection(FTPSession &session, int data_socket) {
+  FTPTransfer &transfer = session.transfer;
+  fcntl(data_socket, F_SETFL, O_NONBLOCK);
+  transfer.data_socket = data_socket;
+  transfer.attached_ms = millis();
+  // The passive listener only serves a single data connection.
+  close_data_connection(session);
+
+  if (!transfer.is_listing) {
+    if (transfer.direction == FTP_TRANSFER_SEND) {
+      if (!transfer.generated) {
+        transfer.file = storage_->open(transfer.path, O_RDONLY);
+      }
+      if (!transfer.file) {
+        ESP_LOGE(TAG, "Failed to open file for reading: %s (errno: %d)", transfer.path.c_str(), errno);
+        finish_transfer(session, 550, "Failed to open file for reading");
+        return;
+      }
+      if (transfer.file_pos > 0 && !transfer.file->seek(transfer.file_pos)) {
+        ESP_LOGE(TAG, "Failed to seek %s to %u (errno: %d)", transfer.path.c_str(), (unsigned) transfer.file_pos,
+                 errno);
+        finish_transfer(session, 554, "Invalid REST parameter");
+        return;
+      }
+      if (!allocate_read_ahead(transfer)) {
+        ESP_LOGE(TAG, "Not enough memory for %u download buffers of %u bytes", download_buffers_,
+                 (unsigned) download_buffer_size_);
+        finish_transfer(session, 451, "Requested action aborted: insufficient memory");
+        return;
+      }
+      if (session.mode_z && !setup_compression(session)) {
+        finish_transfer(session, 451, "Requested action aborted: insufficient memory");
+        return;
+      }
+    } else {
+      // A resumed STOR or an APPE keeps what is already in the file.
+      bool keep = transfer.append || transfer.file_pos > 0;
+      if (!transfer.generated) {
+        const std::string &target = transfer.temp_path.empty() ? transfer.path : transfer.temp_path;
+        transfer.file = storage_->open(target, O_WRONLY | O_CREAT | (keep ? 0 : O_TRUNC));
+      }
+      if (!transfer.file && errno == EBUSY) {
+        // Still being written back from the staging area
+        finish_transfer(session, 450, "File busy, try again later");
+        return;
+      }
+      if (!transfer.file) {
+        ESP_LOGE(TAG, "Failed to open file for writing: %s (errno: %d)", transfer.path.c_str(), errno);
+        finish_transfer(session, 550, "Failed to open file for writing");
+        return;
+      }
+      if (keep) {
+        // Not O_APPEND: preallocation below would move the end of the file.
+        ssize_t end = transfer.file->size();
+        transfer.existing_size = end > 0 ? end : 0;
+        if (transfer.append) {
+          transfer.file_pos = transfer.existing_size;
+        }
+        if (!transfer.file->seek(transfer.file_pos)) {
+          ESP_LOGE(TAG, "Failed to seek %s to %u (errno: %d)", transfer.path.c_str(), (unsigned) transfer.file_pos,
+                   errno);
+          finish_transfer(session, 554, "Invalid REST parameter");
+          return;
+        }
+      }
+      transfer.chunks.resize(1);
+      transfer.chunks[0].data = allocate_transfer_buffer(upload_buffer_size_, true);
+      if (!transfer.chunks[0].data) {
+        ESP_LOGE(TAG, "Not enough memory for a %u byte upload buffer", (unsigned) upload_buffer_size_);
+        finish_transfer(session, 451, "Requested action aborted: insufficient memory");
+        return;
+      }
+      transfer.chunk_size = upload_buffer_size_;
+      if (session.mode_z && !setup_compression(session)) {
+        finish_transfer(session, 451, "Requested action aborted: insufficient memory");
+        return;
+      }
+      // ALLO counts the bytes still to come, the file ends past them.
+      if (transfer.preallocated > 0) {
+        transfer.preallocated += transfer.file_pos;
+      }
+      if (transfer.preallocated > transfer.existing_size && storage_->preallocation_helps()) {
+        // Extending the file once lets FatFs build the cluster chain in one
+        // pass instead of growing it on every write.
+        if (!transfer.file->truncate(transfer.preallocated)) {
+          ESP_LOGW(TAG, "Could not preallocate %u bytes for %s (errno: %d)", (unsigned) transfer.preallocated,
+                   transfer.path.c_str(), errno);
+          transfer.preallocated = 0;
+        }
+        transfer.file->seek(transfer.file_pos);
+      } else {
+        transfer.preallocated = 0;
+      }
+    }
+  }
+
+  transfer.state = FTP_TRANSFER_RUNNING;
+}
+
+void FTPBufferDeleter::operator()(uint8_t *buffer) const {
+#ifdef USE_ESP_IDF
+  heap_caps_free(buffer);
+#else
+  free(buffer);
+#endif
+}
+
+FTPBuffer allocate_transfer_buffer(size_t size, bool dma) {
+#ifdef USE_ESP_IDF
+  uint8_t *buffer = nullptr;
+  if (dma) {
+    buffer = static_cast<uint8_t *>(heap_caps_malloc(size, MALLOC_CAP_DMA | MALLOC_CAP_8BIT));
+  }
+  if (buffer == nullptr) {
+    // Still works from PSRAM, the SD driver just bounces through its own buffer.
+    buffer = static_cast<uint8_t *>(heap_caps_malloc(size, MALLOC_CAP_8BIT));
+  }
+  return FTPBuffer(buffer);
+#else
+  return FTPBuffer(static_cast<uint8_t *>(malloc(size)));
+#endif
+}
+
+bool FTPServer::allocate_read_ahead(FTPTransfer &transfer) {
+  transfer.chunks.clear();
+  transfer.chunks.resize(download_buffers_);
+  for (auto &chunk : transfer.chunks) {
+    chunk.data = allocate_transfer_buffer(download_buffer_size_, true);
+    if (!chunk.data) {
+      transfer.chunks.clear();
+      return false;
+    }
+  }
+  transfer.chunk_size = download_buffer_size_;
+  transfer.chunk_head = 0;
+  transfer.chunks_filled = 0;
+  transfer.eof = false;
+  return true;
+}
+
+int FTPServer::compression_mem_level() const {
+  return std::max(1, std::min(9, compression_window_bits_ - 7));
+}
+
+// MODE Z needs a stream and one more chunk for data on its way through it.
+// Files that are already compressed are sent as stored deflate blocks.
+bool FTPServer::setup_compression(FTPSession &session) {
+  FTPTransfer &transfer = session.transfer;
+  if (transfer.direction == FTP_TRANSFER_SEND) {
+    bool stored = is_precompressed(transfer.path);
+    transfer.zstream = make_deflate_stream(stored ? 0 : compression_level_, compression_window_bits_,
+                                           stored ? 1 : compression_mem_level());
+  } else {
+    transfer.zstream = make_inflate_stream();
+  }
+  transfer.zinput.data = allocate_transfer_buffer(transfer.chunk_size, false);
+  if (!transfer.zstream || !transfer.zinput.data) {
+    ESP_LOGE(TAG, "Not enough memory for MODE Z on %s", transfer.path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Moves a running transfer forward by at most budget bytes. Returns 0 while
+// there is more to do, otherwise the reply code owed to the client. It only
+// touches the transfer itself so worker tasks can run it too.
+static int step_send_listing(FTPTransfer &transfer, size_t budget) {
+  const std::string &listing = *transfer.listing;
+  while (budget > 0) {
+    if (transfer.listing_pos == listing.size()) {
+      return 226;
+    }
+
+    size_t len = std::min({listing.size() - transfer.listing_pos, LISTING_WRITE_SIZE, budget});
+    ssize_t sent = send(transfer.data_socket, listing.data() + transfer.listing_pos, len, MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
+        return 0;
+      }
+      ESP_LOGE(TAG, "Error sending data: %d", errno);
+      return 426;
+    }
+    transfer.listing_pos += sent;
+    transfer.offset += sent;
+    budget -= std::min<size_t>(budget, sent);
+  }
+  return 0;
+}
+
+// True when a RETR can read its next chunk without waiting on the socket.
+static bool can_read_ahead(const FTPTransfer &transfer) {
+  return !transfer.is_listing && transfer.direction == FTP_TRANSFER_SEND && !transfer.eof &&
+         transfer.chunks_filled < transfer.chunks.size();
+}
+
+// After a REST the first read is shortened so the following ones start on a
+// chunk boundary again and stay cluster aligned.
+static ssize_t read_file_chunk(FTPTransfer &transfer, uint8_t *out) {
+  size_t want = transfer.chunk_size - transfer.file_pos % transfer.chunk_size;
+  ssize_t len = transfer.file->read(out, want);
+  if (len < 0) {
+    if (errno != EAGAIN) {
+      ESP_LOGE(TAG, "Error reading file: %d", errno);
+    }
+    return -1;
+  }
+  transfer.file_pos += len;
+  return len;
+}
+
+// Puts the next piece of the file into chunk and returns its length, or -1
+// on error. In MODE Z the file is read into zinput and chunk receives what
+// deflate produced, which can be nothing yet. Sets eof once all is queued.
+static ssize_t fill_chunk(FTPTransfer &transfer, FTPChunk &chunk) {
+  if (!transfer.zstream) {
+    ssize_t len = read_file_chunk(transfer, chunk.data.get());
+    if (len == 0) {
+      transfer.eof = true;
+    }
+    return len;
+  }
+
+  FTPChunk &input = transfer.zinput;
+  if (input.pos == input.len && !transfer.zinput_eof) {
+    ssize_t len = read_file_chunk(transfer, input.data.get());
+    if (len < 0) {
+      return -1;
+    }
+    input.len = len;
+    input.pos = 0;
+    transfer.zinput_eof = len == 0;
+  }
+  bool done = false;
+  int len = zstream_run(*transfer.zstream, input, chunk.data.get(), transfer.chunk_size, transfer.zinput_eof, &done);
+  transfer.eof = done;
+  return len;
+}
+
+// Sends filled chunks until the socket pushes back, then reads the next chunk
+// from the card into a free slot while lwIP drains what was queued, so the
+// SD bus and the radio are busy at the same time. Card reads count against
+// the budget too, keeping one call short.
+static int step_send_file(FTPTransfer &transfer, size_t budget) {
+  const size_t ring_size = transfer.chunks.size();
+  while (budget > 0) {
+    bool progressed = false;
+
+    if (transfer.chunks_filled > 0) {
+      FTPChunk &chunk = transfer.chunks[transfer.chunk_head];
+      ssize_t sent = send(transfer.data_socket, chunk.data.get() + chunk.pos, std::min(chunk.len - chunk.pos, budget),
+                          MSG_DONTWAIT);
+      if (sent < 0) {
+        if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+          ESP_LOGE(TAG, "Error sending data: %d", errno);
+          return 426;
+        }
+      } else {
+        if (transfer.first_byte_ms == 0 && sent > 0) {
+          transfer.first_byte_ms = millis();
+        }
+        chunk.pos += sent;
+        transfer.offset += sent;
+        budget -= std::min<size_t>(budget, sent);
+        progressed = sent > 0;
+        if (chunk.pos == chunk.len) {
+          chunk.pos = 0;
+          chunk.len = 0;
+          transfer.chunk_head = (transfer.chunk_head + 1) % ring_size;
+          transfer.chunks_filled--;
+        }
+      }
+    } else if (transfer.eof) {
+      return 226;
+    }
+
+    if (budget > 0 && can_read_ahead(transfer)) {
+      FTPChunk &chunk = transfer.chunks[(transfer.chunk_head + transfer.chunks_filled) % ring_size];
+      ssize_t len = fill_chunk(transfer, chunk);
+      if (len < 0) {
+        // A generated file with nothing more to give this tick
+        return errno == EAGAIN ? 0 : 551;
+      }
+      if (len > 0) {
+        chunk.len = len;
+        chunk.pos = 0;
+        transfer.chunks_filled++;
+        budget -= std::min<size_t>(budget, len);
+      }
+      progressed = true;
+    }
+
+    if (transfer.eof && transfer.chunks_filled == 0) {
+      return 226;
+    }
+    if (!progressed) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// Writes the coalesced STOR chunk out. Returns 0 or the reply code to fail with.
+static int flush_upload(FTPTransfer &transfer) {
+  FTPChunk &chunk = transfer.chunks[0];
+  if (chunk.len == 0) {
+    return 0;
+  }
+  ssize_t written = transfer.file->write(chunk.data.get(), chunk.len);
+  if (transfer.generated && written >= 0 && written < static_cast<ssize_t>(chunk.len)) {
+    // SITE DELTA took what it could this tick; the rest goes first next time.
+    memmove(chunk.data.get(), chunk.data.get() + written, chunk.len - written);
+    chunk.len -= written;
+    return 0;
+  }
+  if (written != static_cast<ssize_t>(chunk.len)) {
+    ESP_LOGE(TAG, "Error writing file: %s (errno: %d)", transfer.path.c_str(), errno);
+    return errno == ENOSPC ? 552 : 451;
+  }
+  transfer.file_pos += chunk.len;
+  chunk.len = 0;
+  return 0;
+}
+
+// Room left in the STOR chunk before it must be flushed. Like RETR, an upload
+// resumed mid-chunk flushes early once to get back onto chunk boundaries.
+static size_t upload_room(const FTPTransfer &transfer) {
+  return transfer.chunk_size - transfer.file_pos % transfer.chunk_size - transfer.chunks[0].len;
+}
+
+// Flushes what is still buffered and gives back preallocated space past the
+// last byte received. Also used when the upload is aborted, so the partial
+// file holds everything that actually arrived.
+static int close_upload(FTPTransfer &transfer) {
+  int code = flush_upload(transfer);
+  size_t written = std::max(transfer.file_pos, transfer.existing_size);
+  if (transfer.preallocated > written && !transfer.file->truncate(written)) {
+    ESP_LOGW(TAG, "Could not trim %s to %u bytes (errno: %d)", transfer.path.c_str(), (unsigned) written, errno);
+  }
+  transfer.preallocated = 0;
+  return code;
+}
+
+// MODE Z: inflates what is waiting in zinput into the upload chunk,
+// flushing it to the card whenever it fills up.
+static int inflate_upload(FTPTransfer &transfer) {
+  FTPChunk &chunk = transfer.chunks[0];
+  FTPChunk &input = transfer.zinput;
+  while (input.pos < input.len && !transfer.eof) {
+    bool done = false;
+    int len = zstream_run(*transfer.zstream, input, chunk.data.get() + chunk.len, upload_room(transfer), false, &done);
+    if (len < 0) {
+      return 451;
+    }
+    chunk.len += len;
+    transfer.eof = done;
+    if (upload_room(transfer) == 0) {
+      int code = flush_upload(transfer);
+      if (code != 0 || transfer.generated) {
+        // The rest of the input waits for the next tick, as in step_receive().
+        return code;
+      }
+    }
+  }
+  // Anything after the end of the deflate stream is dropped.
+  input.pos = 0;
+  input.len = 0;
+  return 0;
+}
+
+// Coalesces incoming segments into one allocation-unit sized buffer so
+// FatFs sees few large, cluster-aligned writes instead of one per segment.
+// A generated file gets a single write() per tick: each one is bounded
+// (delta copies, tar members), not a whole tick of them.
+static int step_receive(FTPTransfer &transfer, size_t budget) {
+  FTPChunk &chunk = transfer.chunks[0];
+  while (budget > 0) {
+    uint8_t *dest;
+    size_t room;
+    if (transfer.zstream) {
+      if (transfer.zinput.pos < transfer.zinput.len) {
+        // Input a generated file had no room for last tick
+        return inflate_upload(transfer);
+      }
+      dest = transfer.zinput.data.get();
+      room = transfer.chunk_size;
+    } else {
+      room = upload_room(transfer);
+      if (room == 0) {
+        // Left full by a generated file that took part of it
+        return flush_upload(transfer);
+      }
+      dest = chunk.data.get() + chunk.len;
+    }
+    ssize_t len = recv(transfer.data_socket, dest, std::min(room, budget), MSG_DONTWAIT);
+    if (len == 0) {
+      if (transfer.generated && chunk.len > 0) {
+        // The end stays readable; drain the chunk a tick at a time.
+        int code = flush_upload(transfer);
+        if (code != 0 || chunk.len > 0) {
+          return code;
+        }
+      }
+      int code = close_upload(transfer);
+      if (code == 0 && transfer.zstream && !transfer.eof) {
+        ESP_LOGE(TAG, "Compressed upload ended before the end of its deflate stream");
+        code = 426;
+      }
+      if (code == 0 && transfer.generated && transfer.file->close() != 0) {
+        // A tar extraction cut in the middle of a member, a delta without its end
+        code = 451;
+      }
+      return code != 0 ? code : 226;
+    }
+    if (len < 0) {
+      if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
+        return 0;
+      }
+      ESP_LOGE(TAG, "Error receiving data: %d", errno);
+      return 426;
+    }
+
+    transfer.offset += len;
+    budget -= std::min<size_t>(budget, len);
+    if (transfer.zstream) {
+      transfer.zinput.pos = 0;
+      transfer.zinput.len = len;
+      int code = inflate_upload(transfer);
+      if (code != 0 || transfer.generated) {
+        return code;
+      }
       continue;
     }
 
-    std::string full_path = path + "/" + entry_name;
-    struct stat entry_stat;
-    if (stat(full_path.c_str(), &entry_stat) == 0) {
-      std::string list_item = entry_name + "\r\n";
-      send(data_socket, list_item.c_str(), list_item.length(), 0);
+    chunk.len += len;
+    if (upload_room(transfer) == 0) {
+      int code = flush_upload(transfer);
+      if (code != 0 || transfer.generated) {
+        return code;
+      }
     }
   }
+  return 0;
+}
 
-  closedir(dir);
-  close(data_socket);
-  close_data_connection(client_socket);
-  send_response(client_socket, 226, "Directory send OK");
+static int step_transfer(FTPTransfer &transfer, size_t budget) {
+  if (transfer.is_listing) {
+    return step_send_listing(transfer, budget);
+  }
+  if (transfer.direction == FTP_TRANSFER_SEND) {
+    return step_send_file(transfer, budget);
+  }
+  return step_receive(transfer, budget);
 }
 
-void FTPServer::start_file_upload(int client_socket, const std::string& path) {
-  int data_socket = open_data_connection(client_socket);
-  if (data_socket < 0) {
-    send_response(client_socket, 425, "Can't open data connection");
-    return;
+static const char *transfer_reply(const FTPTransfer &transfer, int code) {
+  switch (code) {
+    case 226:
+      return transfer.is_listing ? "Directory send OK" : "Transfer complete";
+    case 426:
+      return "Connection closed; transfer aborted";
+    case 451:
+      return "Requested action aborted: local error in processing";
+    case 551:
+      return "Error reading file";
+    case 552:
+      return "Requested file action aborted: exceeded storage allocation";
+    case 554:
+      return "Invalid REST parameter";
+    default:
+      return "Transfer failed";
   }
+}
 
-  int file_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-  if (file_fd < 0) {
-    close(data_socket);
-    close_data_connection(client_socket);
-    send_response(client_socket, 550, "Failed to open file for writing");
-    return;
+bool FTPServer::transfer_ready(const FTPTransfer &transfer, const fd_set &read_fds, const fd_set &write_fds) {
+  if (transfer.state != FTP_TRANSFER_RUNNING) {
+    return false;
   }
+  bool is_ready = transfer.direction == FTP_TRANSFER_SEND ? FD_ISSET(transfer.data_socket, &write_fds)
+                                                           : FD_ISSET(transfer.data_socket, &read_fds);
+  return is_ready || can_read_ahead(transfer);
+}
 
-  char buffer[2048];
-  int len;
-  while ((len = recv(data_socket, buffer, sizeof(buffer), 0)) > 0) {
-    write(file_fd, buffer, len);
+// What one transfer may move this tick: its own bucket, and an equal split
+// of what the global bucket holds above the control reserve among the
+// transfers still waiting for their turn.
+size_t FTPServer::transfer_budget(FTPSession &session, size_t waiting) {
+  size_t budget = TRANSFER_TICK_BUDGET;
+  if (session_bandwidth_ > 0) {
+    session.bandwidth.refill(millis());
+    budget = std::min(budget, session.bandwidth.available(0));
+  }
+  if (max_bandwidth_ > 0) {
+    size_t shared = bandwidth_.available(control_reserve_);
+    size_t share = std::max(shared / std::max<size_t>(waiting, 1), std::min(shared, SHAPING_MIN_QUANTUM));
+    budget = std::min(budget, share);
   }
+  return budget;
+}
 
-  close(file_fd);
-  close(data_socket);
-  close_data_connection(client_socket);
-  send_response(client_socket, 226, "Transfer complete");
+void FTPServer::advance_transfer(FTPSession &session, size_t budget) {
+  if (budget == 0) {
+    return;
+  }
+  size_t before = session.transfer.offset;
+  int code = step_transfer(session.transfer, budget);
+  size_t moved = session.transfer.offset - before;
+  if (session_bandwidth_ > 0) {
+    session.bandwidth.consume(moved);
+  }
+  if (max_bandwidth_ > 0) {
+    bandwidth_.consume(moved);
+  }
+  if (code != 0) {
+    finish_transfer(session, code, transfer_reply(session.transfer, code));
+  }
 }
 
-void FTPServer::start_file_download(int client_socket, const std::string& path) {
-  int data_socket = open_data_connection(client_socket);
-  if (data_socket < 0) {
-    ESP_LOGE(TAG, "Failed to open data connection for download");
-    send_response(client_socket, 425, "Can't open data connection");
+// Bursts are large enough that every waiting transfer can get a full TCP
+// segment, so shaping never degrades into a stream of runts.
+void FTPTokenBucket::configure(uint32_t bytes_per_second, size_t min_burst, uint32_t now) {
+  rate = bytes_per_second;
+  burst = std::max<size_t>(bytes_per_second / 4, min_burst);
+  tokens = burst;
+  last_ms = now;
+}
+
+void FTPTokenBucket::refill(uint32_t now) {
+  if (rate == 0) {
     return;
   }
+  uint64_t added = uint64_t(rate) * (now - last_ms) / 1000;
+  if (added == 0) {
+    return;
+  }
+  tokens = std::min<uint64_t>(burst, tokens + added);
+  // Only the time that turned into tokens is used up, so slow rates still
+  // accrue across many short ticks.
+  last_ms += added * 1000 / rate;
+}
 
-  int file_fd = open(path.c_str(), O_RDONLY);
-  if (file_fd < 0) {
-    ESP_LOGE(TAG, "Failed to open file for reading: %s (errno: %d)", path.c_str(), errno);
-    close(data_socket);
-    close_data_connection(client_socket);
-    send_response(client_socket, 550, "Failed to open file for reading");
+size_t FTPTokenBucket::available(size_t reserve) const {
+  return tokens > reserve ? tokens - reserve : 0;
+}
+
+void FTPTokenBucket::consume(size_t bytes) {
+  tokens -= std::min(tokens, bytes);
+}
+
+void FTPServer::finish_transfer(FTPSession &session, int code, const std::string& message) {
+  FTPTransfer &transfer = session.transfer;
+  if (code == 226 && !transfer.temp_path.empty() && !commit_upload(transfer)) {
+    finish_transfer(session, 451, transfer_reply(transfer, 451));
     return;
   }
+  ESP_LOGI(TAG, "Transfer finished (%d): %u bytes in %u ms", code, (unsigned) transfer.offset,
+           (unsigned) (millis() - transfer.started_ms));
+  if (transfer.direction == FTP_TRANSFER_SEND) {
+    session.bytes_sent += transfer.offset;
+  } else {
+    session.bytes_received += transfer.offset;
+  }
+  record_transfer(session, code);
+  abort_transfer(session);
+  send_response(session.control_socket, code, message);
+}
 
-  // Set socket timeout
-  struct timeval timeout;
-  timeout.tv_sec = 30;  // 30 seconds timeout
-  timeout.tv_usec = 0;
-  if (setsockopt(data_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
-    ESP_LOGW(TAG, "Could not set socket send timeout (errno: %d)", errno);
-  }
-
-  // Increase buffer size for larger files
-  const size_t buffer_size = 8192;  // 8KB buffer
-  char buffer[buffer_size];
-  int len;
-  size_t total_sent = 0;
-  
-  while ((len = read(file_fd, buffer, buffer_size)) > 0) {
-    int sent = 0;
-    while (sent < len) {
-      int result = send(data_socket, buffer + sent, len - sent, 0);
-      if (result < 0) {
-        if (errno == EINTR) {
-          // Interrupted, try again
-          continue;
-        }
-        ESP_LOGE(TAG, "Error sending data: %d", errno);
-        close(file_fd);
-        close(data_socket);
-        close_data_connection(client_socket);
-        send_response(client_socket, 426, "Connection closed; transfer aborted");
-        return;
+void FTPServer::abort_transfer(FTPSession &session) {
+  FTPTransfer &transfer = session.transfer;
+  if (transfer.state == FTP_TRANSFER_DONE) {
+    return;
+  }
+  if (transfer.state == FTP_TRANSFER_OFFLOADED) {
+    // Wakes the worker, which reports back through drain_worker_completions().
+    shutdown(transfer.data_socket, SHUT_RDWR);
+    return;
+  }
+  if (transfer.file) {
+    if (transfer.direction == FTP_TRANSFER_RECEIVE && !transfer.is_listing) {
+      if (!transfer.chunks.empty()) {
+        close_upload(transfer);
       }
-      sent += result;
+      invalidate_listings(transfer.path);
     }
-    total_sent += len;
-    ESP_LOGD(TAG, "Sent %d bytes, total: %d", len, total_sent);
+    transfer.file->close();
+    transfer.file.reset();
+  }
+  if (!transfer.temp_path.empty()) {
+    // Never committed: whatever path held before is left as it was.
+    storage_->unlink(transfer.temp_path);
+    transfer.temp_path.clear();
   }
+  if (transfer.data_socket >= 0) {
+    close(transfer.data_socket);
+    transfer.data_socket = -1;
+  }
+  transfer.listing.reset();
+  transfer.zstream.reset();
+  transfer.zinput = FTPChunk();
+  transfer.chunks.clear();
+  transfer.state = FTP_TRANSFER_DONE;
+  active_transfers_--;
+  // Idle time counts from the end of the transfer, not from its command.
+  session.last_activity_ms = millis();
+}
 
-  // Check for read errors
-  if (len < 0) {
-    ESP_LOGE(TAG, "Error reading file: %d", errno);
-    close(file_fd);
-    close(data_socket);
-    close_data_connection(client_socket);
-    send_response(client_socket, 551, "Error reading file");
+// Closes the temporary file of an atomic STOR, which commits it on FatFs
+// and LittleFS, then renames it over path. On failure path is left as it
+// was, and abort_transfer() removes the temporary file.
+bool FTPServer::commit_upload(FTPTransfer &transfer) {
+  bool committed = transfer.file->close() == 0;
+  if (!committed) {
+    ESP_LOGE(TAG, "Failed to close %s (errno: %d)", transfer.temp_path.c_str(), errno);
+  }
+  transfer.file.reset();
+  if (committed && storage_->replace(transfer.temp_path, transfer.path) != 0) {
+    ESP_LOGE(TAG, "Failed to rename %s to %s (errno: %d)", transfer.temp_path.c_str(), transfer.path.c_str(),
+             errno);
+    committed = false;
+  }
+  if (committed) {
+    transfer.temp_path.clear();
+    invalidate_listings(transfer.path);
+  }
+  return committed;
+}
+
+#ifdef USE_ESP_IDF
+void FTPServer::setup_transfer_workers() {
+  if (transfer_workers_ == 0) {
+    return;
+  }
+  worker_jobs_ = xQueueCreate(max_sessions_, sizeof(FTPWorkerJob));
+  worker_done_ = xQueueCreate(max_sessions_, sizeof(FTPWorkerJob));
+  if (worker_jobs_ == nullptr || worker_done_ == nullptr) {
+    ESP_LOGE(TAG, "Failed to create transfer worker queues, transfers stay in loop()");
+    transfer_workers_ = 0;
+    return;
+  }
+
+  // By default run on the core loop() is not using.
+  BaseType_t core = transfer_worker_core_;
+  if (portNUM_PROCESSORS < 2) {
+    core = tskNO_AFFINITY;
+  } else if (core < 0) {
+    core = 1 - xPortGetCoreID();
+  }
+
+  uint8_t started = 0;
+  for (uint8_t i = 0; i < transfer_workers_; i++) {
+    if (xTaskCreatePinnedToCore(&FTPServer::transfer_worker_task, "ftp_xfer", WORKER_STACK_SIZE, this,
+                                WORKER_PRIORITY, nullptr, core) == pdPASS) {
+      started++;
+    }
+  }
+  if (started != transfer_workers_) {
+    ESP_LOGW(TAG, "Only %u of %u transfer workers started", started, transfer_workers_);
+    transfer_workers_ = started;
+  }
+  ESP_LOGI(TAG, "Started %u transfer workers on core %d", started, (int) core);
+}
+
+bool FTPServer::offload_transfer(FTPSession &session) {
+  FTPWorkerJob job;
+  job.slot = &session - sessions_.data();
+  job.code = 0;
+  session.transfer.state = FTP_TRANSFER_OFFLOADED;
+  if (xQueueSend(worker_jobs_, &job, 0) != pdTRUE) {
+    // Queue full: keep advancing this one from loop().
+    session.transfer.state = FTP_TRANSFER_RUNNING;
+    return false;
+  }
+  return true;
+}
+
+void FTPServer::drain_worker_completions() {
+  if (worker_done_ == nullptr) {
     return;
   }
+  FTPWorkerJob job;
+  while (xQueueReceive(worker_done_, &job, 0) == pdTRUE) {
+    FTPSession &session = sessions_[job.slot];
+    session.transfer.state = FTP_TRANSFER_RUNNING;
+    if (session.closing) {
+      abort_transfer(session);
+      session.closing = false;
+      session.in_use = false;
+      continue;
+    }
+    if (session.abort_requested) {
+      // The shutdown() from ABOR reads as a clean end of stream in the
+      // worker, so its 226 does not mean the transfer completed.
+      finish_transfer(session, 426, "Transfer aborted");
+      session.abort_requested = false;
+      send_response(session.control_socket, 226, "ABOR successful");
+    } else {
+      finish_transfer(session, job.code, transfer_reply(session.transfer, job.code));
+    }
+  }
+}
 
-  close(file_fd);
-  close(data_socket);
-  close_data_connection(client_socket);
-  send_response(client_socket, 226, "Transfer complete");
+void FTPServer::transfer_worker_task(void *arg) {
+  FTPServer *server = static_cast<FTPServer *>(arg);
+  FTPWorkerJob job;
+  for (;;) {
+    if (xQueueReceive(server->worker_jobs_, &job, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    // Until this job is handed back, loop() does not touch the transfer.
+    FTPTransfer &transfer = server->sessions_[job.slot].transfer;
+    int code = 0;
+    while (code == 0) {
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(transfer.data_socket, &fds);
+      struct timeval tv;
+      tv.tv_sec = 0;
+      // Never sleep on the socket while the read-ahead ring has room.
+      tv.tv_usec = can_read_ahead(transfer) ? 0 : WORKER_SELECT_TIMEOUT_US;
+      bool sending = transfer.direction == FTP_TRANSFER_SEND;
+      int ready = select(transfer.data_socket + 1, sending ? nullptr : &fds, sending ? &fds : nullptr, nullptr, &tv);
+      if (ready < 0 && errno != EINTR) {
+        code = 426;
+      } else if (ready > 0 || can_read_ahead(transfer)) {
+        code = step_transfer(transfer, TRANSFER_TICK_BUDGET);
+      }
+    }
+    job.code = code;
+    xQueueSend(server->worker_done_, &job, portMAX_DELAY);
+  }
 }
+#else
+void FTPServer::setup_transfer_workers() {
+  if (transfer_workers_ > 0) {
+    ESP_LOGW(TAG, "Transfer workers need ESP-IDF, transfers stay in loop()");
+    transfer_workers_ = 0;
+  }
 }
 
+bool FTPServer::offload_transfer(FTPSession &session) { return false; }
+
+void FTPServer::drain_worker_completions() {}
+#endif
+
 bool FTPServer::is_running() const {
   return ftp_server_socket_ != -1;
 }
@@ -1,11 +1,34 @@
 #pragma once
 
 #include "esphome/core/component.h"
+#include "esphome/core/defines.h"
+#include "esphome/core/helpers.h"
+#include "esp_event.h"
+#include "ftp_storage.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef USE_SENSOR
+#include "esphome/components/sensor/sensor.h"
+#endif
+#ifdef USE_TEXT_SENSOR
+#include "esphome/components/text_sensor/text_sensor.h"
+#endif
+
+#ifdef USE_ESP_IDF
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#endif
 
 namespace esphome {
 namespace ftp_server {
@@ -15,7 +38,433 @@ enum FTPClientState {
   FTP_LOGGED_IN
 };
 
+enum FTPTransferDirection {
+  FTP_TRANSFER_SEND,
+  FTP_TRANSFER_RECEIVE
+};
+
+enum FTPTransferState {
+  FTP_TRANSFER_WAIT_CONNECTION,
+  FTP_TRANSFER_RUNNING,
+  // Owned by a worker task until its completion is drained by loop()
+  FTP_TRANSFER_OFFLOADED,
+  FTP_TRANSFER_DONE
+};
+
+// Transfer buffers come from heap_caps_malloc() so they can be DMA-capable:
+// the SD driver then reads whole sectors straight into them.
+struct FTPBufferDeleter {
+  void operator()(uint8_t *buffer) const;
+};
+using FTPBuffer = std::unique_ptr<uint8_t[], FTPBufferDeleter>;
+FTPBuffer allocate_transfer_buffer(size_t size, bool dma);
+
+// One slot of the RETR read-ahead ring, or the STOR coalescing buffer.
+struct FTPChunk {
+  FTPBuffer data;
+  size_t len{0};
+  size_t pos{0};
+};
+
+enum FTPListFormat {
+  FTP_LIST_LONG,
+  FTP_LIST_NAMES,
+  FTP_LIST_MACHINE
+};
+
+using FTPListing = std::shared_ptr<const std::string>;
+
+// État deflate/inflate de MODE Z, défini dans ftp_compression.cpp
+struct FTPZStream;
+struct FTPZStreamDeleter {
+  void operator()(FTPZStream *stream) const;
+};
+using FTPZStreamPtr = std::unique_ptr<FTPZStream, FTPZStreamDeleter>;
+
+// Without USE_FTP_MODE_Z these never create a stream.
+FTPZStreamPtr make_deflate_stream(int level, int window_bits, int mem_level);
+FTPZStreamPtr make_inflate_stream();
+// Moves input through the stream into out. Returns the bytes written to out
+// or -1 on a stream error, and sets *done once the stream has ended.
+int zstream_run(FTPZStream &stream, FTPChunk &input, uint8_t *out, size_t out_len, bool finish, bool *done);
+FTPListing deflate_listing(const FTPListing &listing, int level, int window_bits, int mem_level);
+bool is_precompressed(const std::string& path);
+
+enum FTPHashAlgorithm {
+  FTP_HASH_CRC32,
+  FTP_HASH_MD5,
+  FTP_HASH_SHA1,
+  FTP_HASH_SHA256,
+  FTP_HASH_SHA512
+};
+
+// État d'un condensat en cours, défini dans ftp_hash.cpp
+struct FTPHashContext;
+struct FTPHashContextDeleter {
+  void operator()(FTPHashContext *context) const;
+};
+using FTPHashContextPtr = std::unique_ptr<FTPHashContext, FTPHashContextDeleter>;
+
+// nullptr when the algorithm is not built into this firmware.
+FTPHashContextPtr make_hash_context(FTPHashAlgorithm algorithm);
+void hash_update(FTPHashContext &context, const uint8_t *data, size_t len);
+// Lower-case hex digest; the context cannot be updated afterwards.
+std::string hash_finish(FTPHashContext &context);
+// Starts a new digest in a finished context, without allocating again.
+void hash_restart(FTPHashContext &context);
+// Names as used by HASH and OPTS HASH ("SHA-256")
+const char *hash_algorithm_name(FTPHashAlgorithm algorithm);
+bool parse_hash_algorithm(std::string_view name, FTPHashAlgorithm *algorithm);
+
+// A HASH/XCRC/XMD5/XSHA* computation. loop() hashes a bounded amount of the
+// file per tick, so large files do not stall the control connections.
+struct FTPHashJob {
+  FTPHashAlgorithm algorithm{FTP_HASH_SHA256};
+  FTPHashContextPtr context;
+  FTPFilePtr file;
+  // Name as given by the client, echoed in the HASH reply
+  std::string name;
+  // Byte range being hashed, end excluded
+  size_t start{0};
+  size_t end{0};
+  size_t pos{0};
+  // HASH replies "213 <algo> <start>-<end> <hash> <name>", X* "250 <hash>"
+  bool draft_reply{false};
+  FTPBuffer buffer;
+  size_t buffer_size{0};
+  uint32_t started_ms{0};
+};
+
+enum FTPSiteJobKind {
+  FTP_JOB_COPY,
+  FTP_JOB_REMOVE_TREE
+};
+
+// SITE CPY or SITE RMTREE (ftp_jobs.cpp). Unlike a hash job it is answered
+// as soon as it starts and holds no command: loop() advances it a bounded
+// step per tick while the client goes on, and STAT shows how far it got.
+struct FTPSiteJob {
+  FTPSiteJobKind kind{FTP_JOB_COPY};
+  // Client paths, for STAT and the log
+  std::string source;
+  std::string target;
+
+  // SITE CPY
+  FTPFilePtr from;
+  FTPFilePtr to;
+  // Full path of the copy, and where it is built until complete
+  std::string to_path;
+  std::string temp_path;
+  FTPBuffer buffer;
+  size_t buffer_size{0};
+  size_t size{0};
+  size_t pos{0};
+  bool preallocated{false};
+
+  // SITE RMTREE: directories being emptied, innermost last
+  struct Directory {
+    std::string path;
+    bool listed{false};
+    // Files still to unlink once listed
+    std::vector<std::string> files;
+  };
+  std::vector<Directory> directories;
+  size_t files_removed{0};
+  size_t directories_removed{0};
+  size_t failures{0};
+
+  uint32_t started_ms{0};
+};
+
+// SITE FIND filters (ftp_find.cpp). Depth 1 is the entries of the
+// directory searched; size filters only ever match files.
+struct FTPFindQuery {
+  // Glob on entry names, case-insensitive; empty matches everything
+  std::string pattern;
+  uint8_t min_depth{1};
+  uint8_t max_depth{32};
+  bool files{true};
+  bool directories{true};
+  size_t min_size{0};
+  size_t max_size{SIZE_MAX};
+  // Modification time bounds, 0 when not set
+  time_t newer{0};
+  time_t older{0};
+  // MLSD-style facts before each path instead of the bare path
+  bool facts{false};
+};
+
+// "*", "?" and "[a-z]"/"[!a-z]" sets, ASCII letters compared without case
+// as FAT stores them.
+bool glob_match(std::string_view pattern, std::string_view name);
+bool has_glob(std::string_view text);
+// "YYYYMMDDHHMMSS" in UTC, as MDTM sends it
+bool parse_mdtm_time(std::string_view text, time_t *time);
+// Walks dir on the storage as the transfer reads it, a few directories per
+// read, producing one line per match with its path as the client sees it.
+// read() fails with EAGAIN when it walked without finding anything yet.
+FTPFilePtr make_find_stream(FTPStorage &storage, const std::string &root, const std::string &dir,
+                            const FTPFindQuery &query);
+
+// ustar archive of dir's content, produced as it is read (ftp_tar.cpp).
+FTPFilePtr make_tar_stream(FTPStorage &storage, const std::string &dir);
+// Extracts an archive written to it into dir, each file member through
+// temp_path. close() fails when the archive ended in the middle of a member.
+FTPFilePtr make_tar_extractor(FTPStorage &storage, const std::string &dir, const std::string &temp_path);
+
+// rsync's weak block checksum, the one that can roll a byte at a time (ftp_delta.cpp)
+uint32_t rolling_checksum(const uint8_t *data, size_t len);
+// SITE BLOCKSUMS listing of file, read a block_size sized block at a time into block.
+FTPFilePtr make_block_sums_stream(FTPFilePtr file, size_t file_size, size_t block_size, FTPHashAlgorithm algorithm,
+                                  FTPBuffer block);
+// Builds temp_path from basis (the current path, may be null) and the delta
+// written to it, then replaces path on close(). write() may take less than
+// it was given while copying, and wants the rest again later.
+FTPFilePtr make_delta_applier(FTPStorage &storage, FTPFilePtr basis, size_t basis_size, FTPFilePtr temp,
+                              const std::string &temp_path, const std::string &path, size_t block_size,
+                              FTPBuffer buffer);
+
+// A rendered listing kept by FTPServer until a change in that directory made
+// through this server, its age, or memory pressure evicts it.
+struct FTPListingCacheEntry {
+  std::string path;
+  FTPListFormat format;
+  FTPListing listing;
+  uint32_t rendered_ms{0};
+  uint32_t used_ms{0};
+};
+
+// One in-flight RETR/STOR/LIST. It is advanced a bounded amount per loop()
+// so the rest of the firmware keeps running during large transfers.
+struct FTPTransfer {
+  int data_socket{-1};
+  FTPFilePtr file;
+  FTPTransferDirection direction{FTP_TRANSFER_SEND};
+  FTPTransferState state{FTP_TRANSFER_DONE};
+  bool is_listing{false};
+  // file is produced or consumed by the server (SITE FIND, tar archives)
+  // rather than opened on the storage, so it never leaves loop()
+  bool generated{false};
+  std::string path;
+  // Atomic STOR: written here, in FTP_TEMP_DIR, renamed over path on success
+  std::string temp_path;
+  // Bytes moved over the data connection so far
+  size_t offset{0};
+  // File position of the next read (RETR) or of chunks[0] (STOR). Starts at
+  // the REST offset, or at the end of the file for APPE.
+  size_t file_pos{0};
+  // LIST/NLST/MLSD: rendered listing, possibly shared with the cache
+  FTPListing listing;
+  size_t listing_pos{0};
+  uint32_t started_ms{0};
+  // Data connection attached, and first file byte handed to lwIP (RETR)
+  uint32_t attached_ms{0};
+  uint32_t first_byte_ms{0};
+
+  // RETR read-ahead ring: chunks_filled chunks starting at chunk_head are
+  // waiting to be sent, the others are free for the next read. STOR uses a
+  // single chunk to coalesce segments into allocation-unit sized writes.
+  std::vector<FTPChunk> chunks;
+  size_t chunk_size{0};
+  size_t chunk_head{0};
+  size_t chunks_filled{0};
+  // RETR: nothing left to queue. STOR in MODE Z: the deflate stream ended.
+  bool eof{false};
+
+  // MODE Z: file data (RETR) or wire data (STOR) on its way through zstream
+  FTPZStreamPtr zstream;
+  FTPChunk zinput;
+  bool zinput_eof{false};
+
+  // STOR: bytes reserved up front from an ALLO hint, trimmed when done
+  size_t preallocated{0};
+  // STOR/APPE: size of the file before the upload, never trimmed below
+  size_t existing_size{0};
+  bool append{false};
+};
+
+// Token bucket used for bandwidth shaping. Only loop() touches it.
+struct FTPTokenBucket {
+  uint32_t rate{0};
+  size_t burst{0};
+  size_t tokens{0};
+  uint32_t last_ms{0};
+
+  void configure(uint32_t bytes_per_second, size_t min_burst, uint32_t now);
+  void refill(uint32_t now);
+  // Tokens above reserve, which stays available to someone else
+  size_t available(size_t reserve) const;
+  void consume(size_t bytes);
+};
+
+// A listener pre-bound at setup() when passive_port_range is configured.
+// PASV hands it to one session at a time instead of binding a fresh socket.
+struct FTPPassivePort {
+  int socket{-1};
+  uint16_t port{0};
+  bool in_use{false};
+};
+
+// Sent from loop() to a worker task, and back once the transfer is over.
+struct FTPWorkerJob {
+  uint8_t slot;
+  int code;
+};
+
+// Longest absolute path a command can name, root_path included, with its NUL.
+static const size_t FTP_PATH_MAX = 256;
+// Directory below root_path where atomic STOR and SITE DELTA build files
+// before renaming them into place. Emptied at boot, never listed, and out
+// of reach of client paths.
+static const char *const FTP_TEMP_DIR = ".ftp_tmp";
+// Directories each session remembers having validated
+static const size_t FTP_DIR_CACHE_ENTRIES = 4;
+
+// Canonical absolute path built by resolve_path() without allocating.
+struct FTPPathBuffer {
+  char data[FTP_PATH_MAX];
+  size_t len{0};
+  std::string_view view() const { return std::string_view(data, len); }
+};
+
+// A directory CWD or MLSD found on the storage. It stays trusted until it
+// ages out or a RMD/RNTO bumps FTPServer's directory generation.
+struct FTPDirCacheEntry {
+  std::string path;
+  uint32_t generation{0};
+  uint32_t validated_ms{0};
+};
+
+// Everything that belongs to one control connection. Sessions live in a
+// fixed slab owned by FTPServer and are found by socket through an fd table.
+struct FTPSession {
+  bool in_use{false};
+  // Control connection already closed, slot held until a worker hands back
+  // the transfer it still owns.
+  bool closing{false};
+  int control_socket{-1};
+  FTPClientState state{FTP_WAIT_LOGIN};
+  std::string username;
+  // Canonical, root_path included
+  std::string current_path;
+  std::array<FTPDirCacheEntry, FTP_DIR_CACHE_ENTRIES> dir_cache;
+  // Bytes received on the control connection not yet consumed as commands
+  std::string command_buffer;
+  // Telnet sequence split across two reads (RFC 854)
+  uint8_t telnet_state{0};
+  // ABOR reached a transfer owned by a worker; 426/226 follow its completion.
+  bool abort_requested{false};
+
+  // Mode passif propre à la session
+  int passive_socket{-1};
+  int passive_port{-1};
+  int passive_slot{-1};
+  int pending_data_socket{-1};
+
+  // Commande RNFR en attente
+  std::string rename_from;
+
+  // Taille annoncée par ALLO pour le prochain STOR
+  size_t allocation_hint{0};
+
+  // Position donnée par REST pour le prochain RETR/STOR
+  size_t restart_offset{0};
+
+  // MODE Z actif pour les prochaines connexions de données
+  bool mode_z{false};
+
+  // Algorithme choisi par OPTS HASH, plage donnée par RANG pour le prochain HASH
+  FTPHashAlgorithm hash_algorithm{FTP_HASH_SHA256};
+  bool hash_range_set{false};
+  size_t hash_range_start{0};
+  size_t hash_range_end{0};
+  // Calcul HASH/X* en cours, avancé par loop()
+  std::unique_ptr<FTPHashJob> hash_job;
+  // SITE CPY/RMTREE en tâche de fond, et bilan du dernier pour STAT
+  std::unique_ptr<FTPSiteJob> site_job;
+  std::string site_job_result;
+
+  // Débit propre à la session (session_bandwidth)
+  FTPTokenBucket bandwidth;
+
+  FTPTransfer transfer;
+
+  uint32_t connected_ms{0};
+  // Dernière commande reçue ou fin de transfert : délai d'inactivité et éviction LRU
+  uint32_t last_activity_ms{0};
+  // Réponse PASV envoyée, pour mesurer le délai d'acceptation des données
+  uint32_t passive_opened_ms{0};
+  uint32_t commands{0};
+  uint64_t bytes_sent{0};
+  uint64_t bytes_received{0};
+};
+
+// Log2 histogram: bucket i counts values below 2^i that did not fit in i-1.
+// Percentiles are reported as the upper bound of their bucket.
+struct FTPHistogram {
+  static const size_t BUCKETS = 24;
+  uint32_t buckets[BUCKETS]{};
+  uint32_t count{0};
+  uint64_t sum{0};
+  uint32_t max{0};
+
+  void add(uint32_t value);
+  uint32_t percentile(uint8_t percent) const;
+  uint32_t mean() const { return count == 0 ? 0 : sum / count; }
+};
+
+// Counters since boot, reported by STAT and published to the sensors.
+struct FTPTelemetry {
+  uint64_t bytes_sent{0};
+  uint64_t bytes_received{0};
+  uint32_t sessions_total{0};
+  uint32_t sessions_timed_out{0};
+  uint32_t sessions_evicted{0};
+  uint32_t transfers_ok{0};
+  uint32_t transfers_failed{0};
+  uint32_t last_throughput{0};  // B/s of the last completed file transfer
+  FTPHistogram throughput;      // B/s
+  FTPHistogram retr_ttfb;       // ms
+  FTPHistogram command_latency; // us
+  FTPHistogram accept_latency;  // ms
+};
+
+class FTPServer;
+
+using FTPCommandHandler = void (FTPServer::*)(FTPSession &session, std::string_view arg);
+
+// Entry of the dispatch table: a verb of up to 8 letters packed into an integer.
+struct FTPCommand {
+  uint64_t verb;
+  FTPCommandHandler handler;
+  uint8_t flags;
+};
+
+// Resolves a client path against root and the canonical cwd: absolute
+// paths start at root, ".", ".." and repeated slashes are folded. Returns
+// false when ".." would leave root or the result does not fit in out.
+bool resolve_path(std::string_view root, std::string_view cwd, std::string_view path, FTPPathBuffer &out);
+// Splits SITE arguments on spaces; "double quotes" keep a name with spaces
+// in one argument.
+std::vector<std::string> split_arguments(std::string_view arg);
+// Faits RFC 3659 (type, size, modify, perm) pour MLSD/MLST, terminés par ';'
+int format_mlsx_facts(const struct stat &entry_stat, char *out, size_t out_size);
+
 class FTPServer : public Component {
+#ifdef USE_SENSOR
+  SUB_SENSOR(bytes_sent)
+  SUB_SENSOR(bytes_received)
+  SUB_SENSOR(active_sessions)
+  SUB_SENSOR(active_transfers)
+  SUB_SENSOR(transfer_throughput)
+  SUB_SENSOR(retr_ttfb)
+  SUB_SENSOR(command_latency)
+  SUB_SENSOR(accept_latency)
+  SUB_SENSOR(session_memory)
+#endif
+#ifdef USE_TEXT_SENSOR
+  SUB_TEXT_SENSOR(last_transfer)
+#endif
  public:
   FTPServer();
   void setup() override;
@@ -31,45 +480,272 @@ class FTPServer : public Component {
   void set_username(const std::string &username) { username_ = username; }
   void set_password(const std::string &password) { password_ = password; }
   void set_root_path(const std::string &root_path) { root_path_ = root_path; }
+  void set_storage_type(FTPStorageType type) { storage_type_ = type; }
+  void set_ram_volume_size(uint32_t size) { ram_volume_size_ = size; }
+  void set_littlefs_partition(const std::string &label) { littlefs_partition_ = label; }
+  void set_staging_size(uint32_t size) { staging_size_ = size; }
+  void set_atomic_uploads(bool enabled) { atomic_uploads_ = enabled; }
+#ifdef USE_FTP_SD_MMC_CARD
+  void set_sd_card(sd_mmc_card::SdMmc *card) { sd_card_ = card; }
+#endif
+  void set_passive_port_range(uint16_t start, uint16_t end) {
+    passive_port_start_ = start;
+    passive_port_end_ = end;
+  }
+  void set_download_buffer_size(uint32_t size) { download_buffer_size_ = size; }
+  void set_download_buffers(uint8_t count) { download_buffers_ = count; }
+  void set_upload_buffer_size(uint32_t size) { upload_buffer_size_ = size; }
+  void set_listing_cache_size(uint32_t size) { listing_cache_size_ = size; }
+  void set_mode_z(bool enabled) { mode_z_enabled_ = enabled; }
+  void set_max_bandwidth(uint32_t bytes_per_second) { max_bandwidth_ = bytes_per_second; }
+  void set_session_bandwidth(uint32_t bytes_per_second) { session_bandwidth_ = bytes_per_second; }
+  void set_control_reserve(uint32_t bytes) { control_reserve_ = bytes; }
+  void set_compression_level(uint8_t level) { compression_level_ = level; }
+  void set_compression_window_bits(uint8_t bits) { compression_window_bits_ = bits; }
+  void set_max_sessions(uint8_t sessions) { max_sessions_ = sessions; }
+  void set_max_transfers(uint8_t transfers) { max_transfers_ = transfers; }
+  void set_login_timeout(uint32_t timeout_ms) { login_timeout_ms_ = timeout_ms; }
+  void set_idle_timeout(uint32_t timeout_ms) { idle_timeout_ms_ = timeout_ms; }
+  void set_transfer_workers(uint8_t workers) { transfer_workers_ = workers; }
+  void set_transfer_worker_core(int8_t core) { transfer_worker_core_ = core; }
 
   // Méthode pour vérifier si le serveur est en cours d'exécution
   bool is_running() const;
 
  protected:
+  void setup_storage();
   void handle_new_clients();
-  void handle_ftp_client(int client_socket);
-  void process_command(int client_socket, const std::string& command);
+  void handle_ftp_client(FTPSession &session);
+  void process_buffered_commands(FTPSession &session);
+  void process_command(FTPSession &session, std::string_view line);
+  bool can_run_now(const FTPSession &session, std::string_view line);
+  static const FTPCommand *lookup_command(uint64_t verb);
+  void receive_control_bytes(FTPSession &session, const char *data, size_t len);
   void send_response(int client_socket, int code, const std::string& message);
+  void send_multiline_response(int client_socket, int code, const std::vector<std::string>& lines);
   bool authenticate(const std::string& username, const std::string& password);
-  void list_directory(int client_socket, const std::string& path);
-  void list_names(int client_socket, const std::string& path);  // Add this line
-  void start_file_upload(int client_socket, const std::string& path);
-  void start_file_download(int client_socket, const std::string& path);
+  bool resolve_client_path(FTPSession &session, std::string_view arg, std::string *path);
+  std::string client_path(const std::string& path) const;
+  bool is_directory(FTPSession &session, const std::string& path);
+  bool parent_is_directory(FTPSession &session, const std::string& path);
+  bool resolve_listing_path(FTPSession &session, std::string_view arg, std::string *path, std::string *pattern,
+                            std::string *prefix);
+  void list_directory(FTPSession &session, const std::string& path, FTPListFormat format,
+                      const std::string& pattern, const std::string& prefix);
+  FTPListing render_listing(const std::string& path, FTPListFormat format, const std::string& pattern,
+                            const std::string& prefix);
+  FTPListing cached_listing(const std::string& key, FTPListFormat format);
+  void cache_listing(const std::string& key, FTPListFormat format, const FTPListing &listing);
+  void invalidate_listings(const std::string& path);
+  void start_file_upload(FTPSession &session, const std::string& path, size_t size_hint, size_t offset, bool append);
+  void start_file_download(FTPSession &session, const std::string& path, size_t offset);
+  void start_generated_transfer(FTPSession &session, FTPTransferDirection direction, const std::string& path,
+                                FTPFilePtr file);
+  bool archive_directory(FTPSession &session, const std::string& path, std::string *dir);
+  bool start_archive_download(FTPSession &session, const std::string& path);
+
+  // Commandes FTP
+  void cmd_user(FTPSession &session, std::string_view arg);
+  void cmd_pass(FTPSession &session, std::string_view arg);
+  void cmd_quit(FTPSession &session, std::string_view arg);
+  void cmd_abor(FTPSession &session, std::string_view arg);
+  void cmd_noop(FTPSession &session, std::string_view arg);
+  void cmd_syst(FTPSession &session, std::string_view arg);
+  void cmd_feat(FTPSession &session, std::string_view arg);
+  void cmd_type(FTPSession &session, std::string_view arg);
+  void cmd_pwd(FTPSession &session, std::string_view arg);
+  void cmd_cwd(FTPSession &session, std::string_view arg);
+  void cmd_cdup(FTPSession &session, std::string_view arg);
+  void cmd_pasv(FTPSession &session, std::string_view arg);
+  void cmd_list(FTPSession &session, std::string_view arg);
+  void cmd_nlst(FTPSession &session, std::string_view arg);
+  void cmd_stor(FTPSession &session, std::string_view arg);
+  void cmd_retr(FTPSession &session, std::string_view arg);
+  void cmd_dele(FTPSession &session, std::string_view arg);
+  void cmd_mkd(FTPSession &session, std::string_view arg);
+  void cmd_rmd(FTPSession &session, std::string_view arg);
+  void cmd_rnfr(FTPSession &session, std::string_view arg);
+  void cmd_rnto(FTPSession &session, std::string_view arg);
+  void cmd_size(FTPSession &session, std::string_view arg);
+  void cmd_mdtm(FTPSession &session, std::string_view arg);
+  void cmd_allo(FTPSession &session, std::string_view arg);
+  void cmd_rest(FTPSession &session, std::string_view arg);
+  void cmd_appe(FTPSession &session, std::string_view arg);
+  void cmd_mlsd(FTPSession &session, std::string_view arg);
+  void cmd_mlst(FTPSession &session, std::string_view arg);
+  void cmd_mode(FTPSession &session, std::string_view arg);
+  void cmd_stat(FTPSession &session, std::string_view arg);
+  void cmd_opts(FTPSession &session, std::string_view arg);
+  void cmd_site(FTPSession &session, std::string_view arg);
+
+  // Sous-commandes SITE
+  void site_find(FTPSession &session, std::string_view arg);
+  void site_cpy(FTPSession &session, std::string_view arg);
+  void site_rmtree(FTPSession &session, std::string_view arg);
+  void site_blocksums(FTPSession &session, std::string_view arg);
+  void site_delta(FTPSession &session, std::string_view arg);
+  void site_untar(FTPSession &session, std::string_view arg);
+
+  // Copies et suppressions en tâche de fond (ftp_jobs.cpp)
+  bool admit_site_job(FTPSession &session);
+  void start_site_job(FTPSession &session, std::unique_ptr<FTPSiteJob> job);
+  void advance_site_job(FTPSession &session);
+  bool advance_copy(FTPSiteJob &job);
+  bool advance_remove_tree(FTPSiteJob &job);
+  void finish_site_job(FTPSession &session, const std::string& result);
+  void abort_site_job(FTPSession &session);
+  std::string describe_site_job(const FTPSession &session) const;
+
+  // Sommes de contrôle (ftp_hash.cpp)
+  void cmd_hash(FTPSession &session, std::string_view arg);
+  void cmd_rang(FTPSession &session, std::string_view arg);
+  void cmd_xcrc(FTPSession &session, std::string_view arg);
+  void cmd_xmd5(FTPSession &session, std::string_view arg);
+  void cmd_xsha1(FTPSession &session, std::string_view arg);
+  void cmd_xsha256(FTPSession &session, std::string_view arg);
+  void cmd_xsha512(FTPSession &session, std::string_view arg);
+  void cmd_x_hash(FTPSession &session, std::string_view arg, FTPHashAlgorithm algorithm);
+  void start_hash_job(FTPSession &session, FTPHashAlgorithm algorithm, const std::string& name, size_t start,
+                      size_t end, bool has_end, bool draft_reply);
+  void advance_hash_job(FTPSession &session);
+  void finish_hash_job(FTPSession &session, int code, const std::string& message);
+  void abort_hash_job(FTPSession &session);
+  std::string hash_feature(const FTPSession &session) const;
+
+  // Télémétrie (ftp_telemetry.cpp)
+  void record_transfer(FTPSession &session, int code);
+  void publish_telemetry();
+  size_t count_active_sessions() const;
+  size_t session_memory(const FTPSession &session) const;
+  size_t total_session_memory() const;
+
+  // Table des sessions
+  FTPSession *allocate_session(int client_socket);
+  FTPSession *find_session(int client_socket);
+  void release_session(FTPSession &session);
+  static bool session_busy(const FTPSession &session);
+  void expire_sessions(uint32_t now);
+  bool evict_idle_session(uint32_t now);
+  bool admit_transfer(FTPSession &session);
+
+  // Transfer engine
+  void queue_transfer(FTPSession &session);
+  void attach_data_connection(FTPSession &session, int data_socket);
+  bool allocate_read_ahead(FTPTransfer &transfer);
+  bool setup_compression(FTPSession &session);
+  int compression_mem_level() const;
+  static bool transfer_ready(const FTPTransfer &transfer, const fd_set &read_fds, const fd_set &write_fds);
+  size_t transfer_budget(FTPSession &session, size_t waiting);
+  void advance_transfer(FTPSession &session, size_t budget);
+  void finish_transfer(FTPSession &session, int code, const std::string& message);
+  bool commit_upload(FTPTransfer &transfer);
+  bool prepare_temp_dir();
+  std::string temp_path_for(const FTPSession &session);
+  bool is_temp_path(std::string_view path) const;
+  void abort_transfer(FTPSession &session);
+
+  // Workers du plan de données
+  void setup_transfer_workers();
+  bool offload_transfer(FTPSession &session);
+  void drain_worker_completions();
+#ifdef USE_ESP_IDF
+  static void transfer_worker_task(void *arg);
+#endif
+
+  // Méthodes pour le mode passif
+  bool start_passive_mode(FTPSession &session);
+  void accept_data_connection(FTPSession &session);
+  void close_data_connection(FTPSession &session);
+  int create_passive_listener(uint16_t port);
+  void setup_passive_pool();
+  bool acquire_passive_port(FTPSession &session);
+  void release_passive_port(FTPSession &session);
+  bool get_passive_address(uint32_t &ip);
+  static void ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
 
   uint16_t port_{21};
   std::string username_{"admin"};
   std::string password_{"admin"};
+  // Canonical after setup(): no trailing slash, "/" alone for the whole VFS
   std::string root_path_{"/sdcard"};
-  std::string current_path_;
   int ftp_server_socket_{-1};
-  std::vector<int> client_sockets_;
-  std::vector<FTPClientState> client_states_;
-  std::vector<std::string> client_usernames_;
-  std::vector<std::string> client_current_paths_;
+  // Incrémenté par RMD/RNTO, invalide les dir_cache des sessions
+  uint32_t directory_generation_{1};
 
-  // Variables pour le mode passif
-  bool passive_mode_enabled_ = false;
-  int passive_data_socket_ = -1;
-  int passive_data_port_ = -1;
-  std::string passive_client_ip_;
+  // Stockage des fichiers, choisi dans setup() (staging_size 0 = écriture directe)
+  FTPStoragePtr storage_;
+  FTPStorageType storage_type_{FTP_STORAGE_SD_CARD};
+  uint32_t ram_volume_size_{262144};
+  std::string littlefs_partition_;
+  uint32_t staging_size_{0};
+  // Téléversements vers un nom temporaire dans temp_dir_, renommés au 226
+  bool atomic_uploads_{true};
+  std::string temp_dir_;
+  bool temp_dir_ready_{false};
+  uint32_t temp_counter_{0};
+#ifdef USE_FTP_SD_MMC_CARD
+  sd_mmc_card::SdMmc *sd_card_{nullptr};
+#endif
 
-  // Variable pour la commande RNFR
-  std::string rename_from_;  // Add this line
+  // Pool de ports passifs et adresse annoncée en cache
+  uint16_t passive_port_start_{0};
+  uint16_t passive_port_end_{0};
+  std::vector<FTPPassivePort> passive_pool_;
+  size_t passive_pool_next_{0};
+  uint32_t passive_ip_{0};
+  std::atomic<bool> passive_ip_stale_{true};
 
-  // Méthodes pour le mode passif
-  bool start_passive_mode(int client_socket);
-  int open_data_connection(int client_socket);
-  void close_data_connection(int client_socket);
+  std::vector<FTPSession> sessions_;
+  std::vector<uint8_t> session_by_fd_;
+  size_t active_transfers_{0};
+  // Limites d'admission (max_transfers 0 = pas de limite, timeouts 0 = désactivés)
+  uint8_t max_sessions_{8};
+  uint8_t max_transfers_{0};
+  uint32_t login_timeout_ms_{30000};
+  uint32_t idle_timeout_ms_{300000};
+  uint32_t last_session_check_ms_{0};
+  size_t active_hash_jobs_{0};
+  size_t active_site_jobs_{0};
+  HighFrequencyLoopRequester high_freq_;
+  // Last control bytes from any session, see COMMAND_BURST_MS
+  uint32_t last_command_ms_{0};
+
+  uint32_t download_buffer_size_{16384};
+  uint8_t download_buffers_{2};
+  // Matches allocation_unit_size of the sd_mmc_card mount
+  uint32_t upload_buffer_size_{16384};
+
+  uint8_t transfer_workers_{0};
+  int8_t transfer_worker_core_{-1};
+
+  // Cache des listings (0 = désactivé)
+  uint32_t listing_cache_size_{32768};
+  size_t listing_cache_bytes_{0};
+  std::vector<FTPListingCacheEntry> listing_cache_;
+  std::string listing_scratch_;
+
+  // Limitation de débit (0 = illimité) et rotation entre transferts
+  uint32_t max_bandwidth_{0};
+  uint32_t session_bandwidth_{0};
+  uint32_t control_reserve_{0};
+  FTPTokenBucket bandwidth_;
+  size_t next_transfer_slot_{0};
+
+  FTPTelemetry telemetry_;
+  uint32_t last_telemetry_ms_{0};
+  // Valeurs au dernier envoi, pour publier des moyennes par intervalle
+  FTPHistogram published_ttfb_;
+  FTPHistogram published_command_latency_;
+  FTPHistogram published_accept_latency_;
+
+  // MODE Z (compilé seulement avec USE_FTP_MODE_Z)
+  bool mode_z_enabled_{false};
+  uint8_t compression_level_{6};
+  uint8_t compression_window_bits_{12};
+#ifdef USE_ESP_IDF
+  QueueHandle_t worker_jobs_{nullptr};
+  QueueHandle_t worker_done_{nullptr};
+#endif
 };
 
 }  // namespace ftp_server
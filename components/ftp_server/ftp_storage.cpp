@@ -0,0 +1,1024 @@
+#include "ftp_storage.h"
+#include "ftp_server.h"
+#include "esp_log.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <unistd.h>
+
+#ifdef USE_ESP_IDF
+#include "esp_heap_caps.h"
+#endif
+#ifdef USE_FTP_LITTLEFS
+#include "esp_littlefs.h"
+#endif
+
+namespace esphome {
+namespace ftp_server {
+
+static const char *TAG = "ftp_server";
+
+// RAM volume files grow by small blocks, config files are rarely larger.
+static const size_t RAM_BLOCK_SIZE = 4096;
+// Staged uploads are written back one upload_buffer_size sized block at a time.
+static const size_t STAGING_BLOCK_SIZE = 16384;
+// Bytes written back to the card per loop(), about one SD write.
+static const size_t STAGING_FLUSH_BUDGET = STAGING_BLOCK_SIZE;
+
+// PSRAM first: it is plentiful and no DMA ever touches these blocks.
+static FTPBuffer allocate_storage_block(size_t size) {
+#ifdef USE_ESP_IDF
+  uint8_t *block = static_cast<uint8_t *>(heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));
+  if (block != nullptr) {
+    return FTPBuffer(block);
+  }
+#endif
+  return allocate_transfer_buffer(size, false);
+}
+
+// File content as fixed-size blocks, so growing a file never copies it nor
+// needs one large free region.
+struct FTPBlockData {
+  explicit FTPBlockData(size_t block_size) : block_size(block_size) {}
+
+  size_t block_size;
+  std::vector<FTPBuffer> blocks;
+  size_t size{0};
+
+  size_t allocated() const { return blocks.size() * block_size; }
+
+  // Bytes of blocks to add before end fits
+  size_t growth(size_t end) const {
+    size_t needed = (end + block_size - 1) / block_size * block_size;
+    return needed > allocated() ? needed - allocated() : 0;
+  }
+
+  bool grow(size_t end) {
+    while (allocated() < end) {
+      FTPBuffer block = allocate_storage_block(block_size);
+      if (!block) {
+        return false;
+      }
+      blocks.push_back(std::move(block));
+    }
+    return true;
+  }
+
+  void zero(size_t from, size_t to) {
+    while (from < to) {
+      size_t offset = from % block_size;
+      size_t len = std::min(block_size - offset, to - from);
+      memset(blocks[from / block_size].get() + offset, 0, len);
+      from += len;
+    }
+  }
+
+  size_t read(size_t pos, uint8_t *out, size_t len) const {
+    size_t done = 0;
+    while (done < len && pos < size) {
+      size_t offset = pos % block_size;
+      size_t n = std::min({block_size - offset, len - done, size - pos});
+      memcpy(out + done, blocks[pos / block_size].get() + offset, n);
+      done += n;
+      pos += n;
+    }
+    return done;
+  }
+
+  // The blocks must already cover pos + len. A gap past the old end reads as zeros.
+  void write(size_t pos, const uint8_t *in, size_t len) {
+    if (pos > size) {
+      zero(size, pos);
+    }
+    size_t done = 0;
+    while (done < len) {
+      size_t offset = (pos + done) % block_size;
+      size_t n = std::min(block_size - offset, len - done);
+      memcpy(blocks[(pos + done) / block_size].get() + offset, in + done, n);
+      done += n;
+    }
+    size = std::max(size, pos + len);
+  }
+
+  // Returns the bytes of blocks given back.
+  size_t shrink(size_t new_size) {
+    size_t before = allocated();
+    blocks.resize((new_size + block_size - 1) / block_size);
+    size = std::min(size, new_size);
+    return before - allocated();
+  }
+};
+
+// Map key of a path: no repeated or trailing slashes.
+static std::string storage_key(const std::string &path) {
+  std::string key;
+  key.reserve(path.size());
+  for (char c : path) {
+    if (c == '/' && !key.empty() && key.back() == '/') {
+      continue;
+    }
+    key += c;
+  }
+  while (key.size() > 1 && key.back() == '/') {
+    key.pop_back();
+  }
+  return key.empty() ? "/" : key;
+}
+
+static std::string parent_key(const std::string &key) {
+  size_t slash = key.rfind('/');
+  return slash == std::string::npos || slash == 0 ? "/" : key.substr(0, slash);
+}
+
+static bool is_below(const std::string &key, const std::string &dir) {
+  return key.size() > dir.size() && key.compare(0, dir.size(), dir) == 0 && (dir == "/" || key[dir.size()] == '/');
+}
+
+int FTPStorage::replace(const std::string &from, const std::string &to) {
+  if (rename(from, to) == 0) {
+    return 0;
+  }
+  if (errno != EEXIST || unlink(to) != 0) {
+    return -1;
+  }
+  return rename(from, to);
+}
+
+// ---------------------------------------------------------------------------
+// VFS mounts
+
+class FTPPosixFile : public FTPFile {
+ public:
+  explicit FTPPosixFile(int fd) : fd_(fd) {}
+  ~FTPPosixFile() override { close(); }
+
+  ssize_t read(uint8_t *buffer, size_t len) override { return ::read(fd_, buffer, len); }
+  ssize_t write(const uint8_t *buffer, size_t len) override { return ::write(fd_, buffer, len); }
+  bool seek(size_t pos) override { return lseek(fd_, pos, SEEK_SET) >= 0; }
+  ssize_t size() override {
+    struct stat file_stat;
+    return fstat(fd_, &file_stat) == 0 ? file_stat.st_size : -1;
+  }
+  bool truncate(size_t size) override { return ftruncate(fd_, size) == 0; }
+  int close() override {
+    if (fd_ < 0) {
+      return 0;
+    }
+    int result = ::close(fd_);
+    fd_ = -1;
+    return result;
+  }
+
+ protected:
+  int fd_;
+};
+
+class FTPPosixStorage : public FTPStorage {
+ public:
+  FTPPosixStorage(const char *name, bool preallocation_helps)
+      : name_(name), preallocation_helps_(preallocation_helps) {}
+
+  const char *name() const override { return name_; }
+  bool preallocation_helps() const override { return preallocation_helps_; }
+
+  FTPFilePtr open(const std::string &path, int flags) override {
+    if (!available()) {
+      return nullptr;
+    }
+    int fd = ::open(path.c_str(), flags, 0666);
+    return fd < 0 ? nullptr : FTPFilePtr(new FTPPosixFile(fd));
+  }
+
+  int stat(const std::string &path, struct stat *entry_stat) override {
+    return available() ? ::stat(path.c_str(), entry_stat) : -1;
+  }
+
+  int list(const std::string &path, bool with_stat,
+           const std::function<void(const std::string &name, const struct stat &entry_stat)> &visit) override {
+    DIR *dir = available() ? opendir(path.c_str()) : nullptr;
+    if (dir == nullptr) {
+      return -1;
+    }
+    std::string prefix = path;
+    if (prefix.empty() || prefix.back() != '/') {
+      prefix += '/';
+    }
+    struct stat entry_stat {};
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      std::string entry_name = entry->d_name;
+      if (entry_name == "." || entry_name == "..") {
+        continue;
+      }
+      if (with_stat && ::stat((prefix + entry_name).c_str(), &entry_stat) != 0) {
+        continue;
+      }
+      visit(entry_name, entry_stat);
+    }
+    closedir(dir);
+    return 0;
+  }
+
+  int mkdir(const std::string &path) override { return available() ? ::mkdir(path.c_str(), 0755) : -1; }
+  int rmdir(const std::string &path) override { return available() ? ::rmdir(path.c_str()) : -1; }
+  int unlink(const std::string &path) override { return available() ? ::unlink(path.c_str()) : -1; }
+  int rename(const std::string &from, const std::string &to) override {
+    return available() ? ::rename(from.c_str(), to.c_str()) : -1;
+  }
+
+ protected:
+  virtual bool available() { return true; }
+
+  const char *name_;
+  bool preallocation_helps_;
+};
+
+#ifdef USE_FTP_SD_MMC_CARD
+class FTPSdCardStorage : public FTPPosixStorage {
+ public:
+  explicit FTPSdCardStorage(sd_mmc_card::SdMmc *card) : FTPPosixStorage("sd_card", true), card_(card) {}
+
+ protected:
+  // Without a mounted card, root_path is a bare VFS prefix; say so rather
+  // than letting FatFs report a missing file.
+  bool available() override {
+    if (card_ != nullptr && card_->is_failed()) {
+      errno = ENODEV;
+      return false;
+    }
+    return true;
+  }
+
+  sd_mmc_card::SdMmc *card_;
+};
+
+FTPStoragePtr make_sd_card_storage(sd_mmc_card::SdMmc *card) { return FTPStoragePtr(new FTPSdCardStorage(card)); }
+#else
+FTPStoragePtr make_sd_card_storage() { return FTPStoragePtr(new FTPPosixStorage("sd_card", true)); }
+#endif
+
+// LittleFS allocates blocks as they are written, a preallocated tail would
+// only have to be copied and trimmed again.
+FTPStoragePtr make_littlefs_storage() { return FTPStoragePtr(new FTPPosixStorage("littlefs", false)); }
+
+#ifdef USE_FTP_LITTLEFS
+bool mount_littlefs(const std::string &partition_label, const std::string &base_path) {
+  esp_vfs_littlefs_conf_t conf = {};
+  conf.base_path = base_path.c_str();
+  conf.partition_label = partition_label.c_str();
+  conf.format_if_mount_failed = true;
+  esp_err_t err = esp_vfs_littlefs_register(&conf);
+  if (err == ESP_ERR_INVALID_STATE) {
+    // Already mounted by someone else
+    return true;
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to mount LittleFS partition %s at %s (%s)", partition_label.c_str(), base_path.c_str(),
+             esp_err_to_name(err));
+    return false;
+  }
+  size_t total = 0, used = 0;
+  esp_littlefs_info(partition_label.c_str(), &total, &used);
+  ESP_LOGI(TAG, "Mounted LittleFS partition %s at %s, %u of %u bytes used", partition_label.c_str(),
+           base_path.c_str(), (unsigned) used, (unsigned) total);
+  return true;
+}
+#else
+bool mount_littlefs(const std::string &partition_label, const std::string &base_path) {
+  ESP_LOGE(TAG, "LittleFS partition %s requested but LittleFS support is not built in", partition_label.c_str());
+  return false;
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// RAM volume
+
+class FTPRamStorage : public FTPStorage {
+ public:
+  struct Node {
+    Node(bool directory, std::atomic<size_t> *used) : directory(directory), used(used) { mtime = time(nullptr); }
+    // An unlinked file lives on while open; its blocks count until then.
+    ~Node() { *used -= data.allocated(); }
+
+    bool directory;
+    FTPBlockData data{RAM_BLOCK_SIZE};
+    time_t mtime;
+    std::atomic<size_t> *used;
+  };
+  using NodePtr = std::shared_ptr<Node>;
+
+  class File : public FTPFile {
+   public:
+    File(FTPRamStorage *storage, NodePtr node, bool writable)
+        : storage_(storage), node_(std::move(node)), writable_(writable) {}
+
+    ssize_t read(uint8_t *buffer, size_t len) override {
+      std::lock_guard<std::mutex> lock(storage_->mutex_);
+      size_t done = node_->data.read(pos_, buffer, len);
+      pos_ += done;
+      return done;
+    }
+
+    ssize_t write(const uint8_t *buffer, size_t len) override {
+      std::lock_guard<std::mutex> lock(storage_->mutex_);
+      if (!writable_) {
+        errno = EBADF;
+        return -1;
+      }
+      if (!storage_->grow(*node_, pos_ + len)) {
+        return -1;
+      }
+      node_->data.write(pos_, buffer, len);
+      node_->mtime = time(nullptr);
+      pos_ += len;
+      return len;
+    }
+
+    bool seek(size_t pos) override {
+      pos_ = pos;
+      return true;
+    }
+
+    ssize_t size() override {
+      std::lock_guard<std::mutex> lock(storage_->mutex_);
+      return node_->data.size;
+    }
+
+    bool truncate(size_t size) override {
+      std::lock_guard<std::mutex> lock(storage_->mutex_);
+      if (!writable_) {
+        errno = EBADF;
+        return false;
+      }
+      FTPBlockData &data = node_->data;
+      if (size > data.size) {
+        if (!storage_->grow(*node_, size)) {
+          return false;
+        }
+        data.zero(data.size, size);
+        data.size = size;
+      } else {
+        storage_->used_ -= data.shrink(size);
+      }
+      node_->mtime = time(nullptr);
+      return true;
+    }
+
+    int close() override {
+      node_.reset();
+      return 0;
+    }
+
+   protected:
+    FTPRamStorage *storage_;
+    NodePtr node_;
+    bool writable_;
+    size_t pos_{0};
+  };
+
+  // The volume starts out with root_path and its parents.
+  FTPRamStorage(const std::string &root_path, size_t capacity) : capacity_(capacity) {
+    std::string key = storage_key(root_path);
+    for (size_t slash = 0; slash != std::string::npos; slash = key.find('/', slash + 1)) {
+      nodes_[slash == 0 ? "/" : key.substr(0, slash)] = std::make_shared<Node>(true, &used_);
+    }
+    nodes_[key] = std::make_shared<Node>(true, &used_);
+  }
+
+  const char *name() const override { return "ram"; }
+
+  FTPFilePtr open(const std::string &path, int flags) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string key = storage_key(path);
+    bool writable = (flags & O_ACCMODE) != O_RDONLY;
+    NodePtr node = find(key);
+    if (node) {
+      if (node->directory) {
+        errno = EISDIR;
+        return nullptr;
+      }
+      if (writable && (flags & O_TRUNC)) {
+        used_ -= node->data.shrink(0);
+        node->mtime = time(nullptr);
+      }
+    } else {
+      if (!(flags & O_CREAT)) {
+        errno = ENOENT;
+        return nullptr;
+      }
+      if (!parent_exists(key)) {
+        return nullptr;
+      }
+      node = std::make_shared<Node>(false, &used_);
+      nodes_[key] = node;
+    }
+    return FTPFilePtr(new File(this, node, writable));
+  }
+
+  int stat(const std::string &path, struct stat *entry_stat) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    NodePtr node = find(storage_key(path));
+    if (!node) {
+      errno = ENOENT;
+      return -1;
+    }
+    fill_stat(*node, entry_stat);
+    return 0;
+  }
+
+  int list(const std::string &path, bool with_stat,
+           const std::function<void(const std::string &name, const struct stat &entry_stat)> &visit) override {
+    std::vector<std::pair<std::string, struct stat>> entries;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::string key = storage_key(path);
+      NodePtr dir = find(key);
+      if (!dir || !dir->directory) {
+        errno = dir ? ENOTDIR : ENOENT;
+        return -1;
+      }
+      std::string prefix = key == "/" ? key : key + "/";
+      for (auto it = nodes_.lower_bound(prefix); it != nodes_.end() && is_below(it->first, key); ++it) {
+        std::string entry_name = it->first.substr(prefix.size());
+        if (entry_name.find('/') != std::string::npos) {
+          continue;
+        }
+        struct stat entry_stat {};
+        if (with_stat) {
+          fill_stat(*it->second, &entry_stat);
+        }
+        entries.emplace_back(entry_name, entry_stat);
+      }
+    }
+    // Outside the lock, so visit may call back into the storage.
+    for (const auto &entry : entries) {
+      visit(entry.first, entry.second);
+    }
+    return 0;
+  }
+
+  int mkdir(const std::string &path) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string key = storage_key(path);
+    if (find(key)) {
+      errno = EEXIST;
+      return -1;
+    }
+    if (!parent_exists(key)) {
+      return -1;
+    }
+    nodes_[key] = std::make_shared<Node>(true, &used_);
+    return 0;
+  }
+
+  int rmdir(const std::string &path) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string key = storage_key(path);
+    auto it = nodes_.find(key);
+    if (it == nodes_.end()) {
+      errno = ENOENT;
+      return -1;
+    }
+    if (!it->second->directory) {
+      errno = ENOTDIR;
+      return -1;
+    }
+    if (key == "/") {
+      errno = EBUSY;
+      return -1;
+    }
+    auto next = std::next(it);
+    if (next != nodes_.end() && is_below(next->first, key)) {
+      errno = ENOTEMPTY;
+      return -1;
+    }
+    nodes_.erase(it);
+    return 0;
+  }
+
+  int unlink(const std::string &path) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = nodes_.find(storage_key(path));
+    if (it == nodes_.end()) {
+      errno = ENOENT;
+      return -1;
+    }
+    if (it->second->directory) {
+      errno = EISDIR;
+      return -1;
+    }
+    nodes_.erase(it);
+    return 0;
+  }
+
+  int rename(const std::string &from, const std::string &to) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string from_key = storage_key(from);
+    std::string to_key = storage_key(to);
+    NodePtr node = find(from_key);
+    if (!node) {
+      errno = ENOENT;
+      return -1;
+    }
+    if (from_key == to_key) {
+      return 0;
+    }
+    if (from_key == "/" || is_below(to_key, from_key)) {
+      errno = EINVAL;
+      return -1;
+    }
+    if (!parent_exists(to_key)) {
+      return -1;
+    }
+    NodePtr target = find(to_key);
+    if (target && (target->directory || node->directory)) {
+      errno = target->directory ? EISDIR : ENOTDIR;
+      return -1;
+    }
+
+    // A directory takes everything below it along.
+    std::vector<std::pair<std::string, NodePtr>> moved;
+    moved.emplace_back(to_key, node);
+    nodes_.erase(from_key);
+    if (node->directory) {
+      auto it = nodes_.lower_bound(from_key + "/");
+      while (it != nodes_.end() && is_below(it->first, from_key)) {
+        moved.emplace_back(to_key + it->first.substr(from_key.size()), it->second);
+        it = nodes_.erase(it);
+      }
+    }
+    for (auto &entry : moved) {
+      nodes_[entry.first] = std::move(entry.second);
+    }
+    return 0;
+  }
+
+  void describe(std::vector<std::string> &lines) const override {
+    char line[96];
+    snprintf(line, sizeof(line), "RAM volume: %u of %u bytes used", (unsigned) used_, (unsigned) capacity_);
+    lines.push_back(line);
+  }
+
+ protected:
+  NodePtr find(const std::string &key) const {
+    auto it = nodes_.find(key);
+    return it == nodes_.end() ? nullptr : it->second;
+  }
+
+  bool parent_exists(const std::string &key) const {
+    NodePtr parent = find(parent_key(key));
+    if (!parent || !parent->directory) {
+      errno = parent ? ENOTDIR : ENOENT;
+      return false;
+    }
+    return true;
+  }
+
+  static void fill_stat(const Node &node, struct stat *entry_stat) {
+    memset(entry_stat, 0, sizeof(*entry_stat));
+    entry_stat->st_mode = node.directory ? S_IFDIR | 0777 : S_IFREG | 0666;
+    entry_stat->st_nlink = 1;
+    entry_stat->st_size = node.data.size;
+    entry_stat->st_mtime = node.mtime;
+  }
+
+  // Called with mutex_ held.
+  bool grow(Node &node, size_t end) {
+    size_t growth = node.data.growth(end);
+    if (growth == 0) {
+      return true;
+    }
+    if (used_ + growth > capacity_) {
+      errno = ENOSPC;
+      return false;
+    }
+    size_t before = node.data.allocated();
+    bool grown = node.data.grow(end);
+    used_ += node.data.allocated() - before;
+    if (!grown) {
+      errno = ENOSPC;
+    }
+    return grown;
+  }
+
+  std::map<std::string, NodePtr> nodes_;
+  size_t capacity_;
+  std::atomic<size_t> used_{0};
+  std::mutex mutex_;
+};
+
+FTPStoragePtr make_ram_storage(const std::string &root_path, size_t capacity) {
+  return FTPStoragePtr(new FTPRamStorage(root_path, capacity));
+}
+
+// ---------------------------------------------------------------------------
+// Write-back staging
+
+class FTPStagingStorage : public FTPStorage {
+ public:
+  // A staged upload that was closed and waits for the card.
+  struct Pending {
+    Pending(const std::string &path, FTPBlockData data) : path(path), key(storage_key(path)), data(std::move(data)) {}
+
+    std::string path;
+    std::string key;
+    FTPBlockData data;
+    size_t flushed{0};
+    FTPFilePtr out;
+  };
+
+  // An upload in progress. It spills to the card once the staging area is
+  // full, so a large file is never refused.
+  class File : public FTPFile {
+   public:
+    File(FTPStagingStorage *storage, std::string path) : storage_(storage), path_(std::move(path)) {}
+    ~File() override { close(); }
+
+    ssize_t read(uint8_t *buffer, size_t len) override {
+      errno = EBADF;
+      return -1;
+    }
+
+    ssize_t write(const uint8_t *buffer, size_t len) override {
+      if (!spilled_ && !reserve(pos_ + len) && !spill()) {
+        return -1;
+      }
+      if (spilled_) {
+        return spilled_->write(buffer, len);
+      }
+      data_.write(pos_, buffer, len);
+      pos_ += len;
+      return len;
+    }
+
+    bool seek(size_t pos) override {
+      pos_ = pos;
+      return spilled_ ? spilled_->seek(pos) : true;
+    }
+
+    ssize_t size() override { return spilled_ ? spilled_->size() : data_.size; }
+
+    bool truncate(size_t size) override {
+      if (spilled_) {
+        return spilled_->truncate(size);
+      }
+      if (size <= data_.size) {
+        storage_->release(data_.shrink(size));
+        return true;
+      }
+      if (!reserve(size)) {
+        return spill() && spilled_->truncate(size);
+      }
+      data_.zero(data_.size, size);
+      data_.size = size;
+      return true;
+    }
+
+    int close() override {
+      if (closed_) {
+        return 0;
+      }
+      closed_ = true;
+      if (spilled_) {
+        return spilled_->close();
+      }
+      storage_->enqueue(path_, std::move(data_));
+      return 0;
+    }
+
+   protected:
+    // Makes the blocks cover end, within the staging capacity.
+    bool reserve(size_t end) {
+      size_t growth = data_.growth(end);
+      if (growth == 0) {
+        return true;
+      }
+      if (!storage_->reserve(growth)) {
+        return false;
+      }
+      size_t before = data_.allocated();
+      bool grown = data_.grow(end);
+      storage_->release(growth - (data_.allocated() - before));
+      return grown;
+    }
+
+    // Moves what is staged so far to the card and continues there.
+    bool spill() {
+      ESP_LOGD(TAG, "Staging area full, writing %s straight to the card", path_.c_str());
+      spilled_ = storage_->backing_->open(path_, O_WRONLY | O_CREAT | O_TRUNC);
+      if (!spilled_) {
+        return false;
+      }
+      for (size_t pos = 0; pos < data_.size;) {
+        size_t len = std::min(data_.block_size, data_.size - pos);
+        if (spilled_->write(data_.blocks[pos / data_.block_size].get(), len) != static_cast<ssize_t>(len)) {
+          return false;
+        }
+        pos += len;
+      }
+      storage_->release(data_.shrink(0));
+      storage_->spilled_files_++;
+      return spilled_->seek(pos_);
+    }
+
+    FTPStagingStorage *storage_;
+    std::string path_;
+    FTPBlockData data_{STAGING_BLOCK_SIZE};
+    size_t pos_{0};
+    FTPFilePtr spilled_;
+    bool closed_{false};
+  };
+
+  // A staged upload read back before it reached the card. It keeps the
+  // blocks alive should the upload be written back meanwhile.
+  class Reader : public FTPFile {
+   public:
+    explicit Reader(std::shared_ptr<Pending> pending) : pending_(std::move(pending)) {}
+
+    ssize_t read(uint8_t *buffer, size_t len) override {
+      size_t done = pending_->data.read(pos_, buffer, len);
+      pos_ += done;
+      return done;
+    }
+
+    ssize_t write(const uint8_t *buffer, size_t len) override {
+      errno = EBADF;
+      return -1;
+    }
+
+    bool seek(size_t pos) override {
+      pos_ = pos;
+      return true;
+    }
+
+    ssize_t size() override { return pending_->data.size; }
+
+    bool truncate(size_t size) override {
+      errno = EBADF;
+      return false;
+    }
+
+    int close() override {
+      pending_.reset();
+      return 0;
+    }
+
+   protected:
+    std::shared_ptr<Pending> pending_;
+    size_t pos_{0};
+  };
+
+  FTPStagingStorage(FTPStoragePtr backing, size_t capacity) : backing_(std::move(backing)), capacity_(capacity) {}
+
+  const char *name() const override { return backing_->name(); }
+
+  // Only fresh uploads are staged, and one replaces any staged copy of the
+  // path. A staged copy is read from RAM; extending it has to wait until it
+  // is on the card.
+  FTPFilePtr open(const std::string &path, int flags) override {
+    std::string key = storage_key(path);
+    bool fresh = (flags & O_ACCMODE) != O_RDONLY && (flags & O_TRUNC);
+    if (!fresh) {
+      std::shared_ptr<Pending> pending = find_pending(key);
+      if (!pending) {
+        return backing_->open(path, flags);
+      }
+      if ((flags & O_ACCMODE) != O_RDONLY) {
+        errno = EBUSY;
+        return nullptr;
+      }
+      return FTPFilePtr(new Reader(std::move(pending)));
+    }
+    drop_pending(key);
+    // Creating the file now reports a bad path or a full directory before
+    // the 150, and shows the name in listings during the upload.
+    FTPFilePtr created = backing_->open(path, flags);
+    if (!created) {
+      return nullptr;
+    }
+    created->close();
+    return FTPFilePtr(new File(this, path));
+  }
+
+  // A staged file is already on the card with its final name, only its size
+  // is still short.
+  int stat(const std::string &path, struct stat *entry_stat) override {
+    if (backing_->stat(path, entry_stat) != 0) {
+      return -1;
+    }
+    std::shared_ptr<Pending> pending = find_pending(storage_key(path));
+    if (pending != nullptr && S_ISREG(entry_stat->st_mode)) {
+      entry_stat->st_size = pending->data.size;
+    }
+    return 0;
+  }
+
+  int list(const std::string &path, bool with_stat,
+           const std::function<void(const std::string &name, const struct stat &entry_stat)> &visit) override {
+    if (!with_stat || queue_.empty()) {
+      return backing_->list(path, with_stat, visit);
+    }
+    std::string prefix = storage_key(path);
+    if (prefix != "/") {
+      prefix += '/';
+    }
+    return backing_->list(path, with_stat, [&](const std::string &entry_name, const struct stat &entry_stat) {
+      std::shared_ptr<Pending> pending = find_pending(prefix + entry_name);
+      if (pending == nullptr || !S_ISREG(entry_stat.st_mode)) {
+        visit(entry_name, entry_stat);
+        return;
+      }
+      struct stat staged_stat = entry_stat;
+      staged_stat.st_size = pending->data.size;
+      visit(entry_name, staged_stat);
+    });
+  }
+
+  int mkdir(const std::string &path) override { return backing_->mkdir(path); }
+  int rmdir(const std::string &path) override { return backing_->rmdir(path); }
+
+  // Deleting a file that never reached the card saves writing it at all.
+  int unlink(const std::string &path) override {
+    drop_pending(storage_key(path));
+    return backing_->unlink(path);
+  }
+
+  // Staged uploads at or below from follow the rename. One already being
+  // written back starts over under its new name.
+  int rename(const std::string &from, const std::string &to) override {
+    std::string from_key = storage_key(from);
+    std::string to_key = storage_key(to);
+    for (auto &pending : queue_) {
+      if (pending->out && (pending->key == from_key || is_below(pending->key, from_key) || pending->key == to_key)) {
+        pending->out->close();
+        pending->out.reset();
+        pending->flushed = 0;
+      }
+    }
+    if (backing_->rename(from, to) != 0) {
+      return -1;
+    }
+    drop_pending(to_key);
+    for (auto &pending : queue_) {
+      if (pending->key == from_key || is_below(pending->key, from_key)) {
+        pending->key = to_key + pending->key.substr(from_key.size());
+        pending->path = pending->key;
+      }
+    }
+    return 0;
+  }
+
+  bool preallocation_helps() const override { return false; }
+
+  void loop() override {
+    size_t budget = STAGING_FLUSH_BUDGET;
+    while (budget > 0 && !queue_.empty()) {
+      budget -= std::min(budget, flush_front(budget));
+    }
+  }
+
+  bool busy() const override { return !queue_.empty(); }
+
+  void describe(std::vector<std::string> &lines) const override {
+    size_t waiting = 0;
+    for (const auto &pending : queue_) {
+      waiting += pending->data.size - pending->flushed;
+    }
+    size_t reserved;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      reserved = reserved_;
+    }
+    char line[160];
+    snprintf(line, sizeof(line), "Write-back staging: %u uploads (%u bytes) waiting, %u of %u bytes in use",
+             (unsigned) queue_.size(), (unsigned) waiting, (unsigned) reserved, (unsigned) capacity_);
+    lines.push_back(line);
+    snprintf(line, sizeof(line), "Staged uploads: %u written back, %u spilled to the card, %u failed",
+             (unsigned) flushed_files_, (unsigned) spilled_files_, (unsigned) failed_files_);
+    lines.push_back(line);
+    backing_->describe(lines);
+  }
+
+ protected:
+  // Transfer workers write staged files; reserve()/release() are all they
+  // share with loop(), which alone touches the queue.
+  bool reserve(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (reserved_ + bytes > capacity_) {
+      return false;
+    }
+    reserved_ += bytes;
+    return true;
+  }
+
+  void release(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reserved_ -= bytes;
+  }
+
+  void enqueue(const std::string &path, FTPBlockData data) {
+    if (data.size == 0) {
+      // The empty file was created by open().
+      release(data.allocated());
+      flushed_files_++;
+      return;
+    }
+    queue_.push_back(std::make_shared<Pending>(path, std::move(data)));
+  }
+
+  // Latest staged content of a path
+  std::shared_ptr<Pending> find_pending(const std::string &key) const {
+    for (auto it = queue_.rbegin(); it != queue_.rend(); ++it) {
+      if ((*it)->key == key) {
+        return *it;
+      }
+    }
+    return nullptr;
+  }
+
+  // Forgets the staged content of a path, even partly written back.
+  void drop_pending(const std::string &key) {
+    for (auto it = queue_.begin(); it != queue_.end();) {
+      if ((*it)->key != key) {
+        ++it;
+        continue;
+      }
+      if ((*it)->out) {
+        (*it)->out->close();
+      }
+      release((*it)->data.allocated());
+      it = queue_.erase(it);
+    }
+  }
+
+  // Writes up to budget bytes of the oldest pending upload, and drops it
+  // once it is complete or failed. Returns the bytes written.
+  size_t flush_front(size_t budget) {
+    Pending &pending = *queue_.front();
+    FTPBlockData &data = pending.data;
+    if (!pending.out) {
+      pending.out = backing_->open(pending.path, O_WRONLY | O_CREAT | O_TRUNC);
+      if (!pending.out) {
+        fail_front();
+        return 0;
+      }
+    }
+    size_t written = 0;
+    while (written < budget && pending.flushed < data.size) {
+      size_t offset = pending.flushed % data.block_size;
+      size_t len = std::min({data.block_size - offset, data.size - pending.flushed, budget - written});
+      ssize_t out = pending.out->write(data.blocks[pending.flushed / data.block_size].get() + offset, len);
+      if (out != static_cast<ssize_t>(len)) {
+        fail_front();
+        return 0;
+      }
+      pending.flushed += len;
+      written += len;
+    }
+    if (pending.flushed < data.size) {
+      return written;
+    }
+    if (pending.out->close() != 0) {
+      fail_front();
+      return 0;
+    }
+    ESP_LOGD(TAG, "Wrote staged upload %s (%u bytes) back", pending.path.c_str(), (unsigned) data.size);
+    flushed_files_++;
+    release(data.allocated());
+    queue_.pop_front();
+    return written;
+  }
+
+  void fail_front() {
+    Pending &pending = *queue_.front();
+    ESP_LOGE(TAG, "Could not write staged upload %s back (errno: %d), %u bytes lost", pending.path.c_str(), errno,
+             (unsigned) pending.data.size);
+    pending.out.reset();
+    failed_files_++;
+    release(pending.data.allocated());
+    queue_.pop_front();
+  }
+
+  FTPStoragePtr backing_;
+  size_t capacity_;
+  size_t reserved_{0};
+  mutable std::mutex mutex_;
+  std::deque<std::shared_ptr<Pending>> queue_;
+  uint32_t flushed_files_{0};
+  std::atomic<uint32_t> spilled_files_{0};
+  uint32_t failed_files_{0};
+};
+
+FTPStoragePtr make_staging_storage(FTPStoragePtr backing, size_t capacity) {
+  return FTPStoragePtr(new FTPStagingStorage(std::move(backing), capacity));
+}
+
+}  // namespace ftp_server
+}  // namespace esphome
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "esphome/core/defines.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef USE_FTP_SD_MMC_CARD
+#include "../sd_mmc_card/sd_mmc_card.h"
+#endif
+
+namespace esphome {
+namespace ftp_server {
+
+// Fichier ouvert sur un FTPStorage. Comme les appels POSIX qu'il remplace,
+// une erreur renvoie -1 (ou false) et laisse la cause dans errno.
+class FTPFile {
+ public:
+  virtual ~FTPFile() = default;
+  virtual ssize_t read(uint8_t *buffer, size_t len) = 0;
+  virtual ssize_t write(const uint8_t *buffer, size_t len) = 0;
+  virtual bool seek(size_t pos) = 0;
+  // Current size, for APPE and resumed uploads
+  virtual ssize_t size() = 0;
+  virtual bool truncate(size_t size) = 0;
+  // Releases the file; a staged upload is queued for the card here.
+  virtual int close() = 0;
+};
+using FTPFilePtr = std::unique_ptr<FTPFile>;
+
+// Where FTPServer keeps its files. Paths are the absolute ones built from
+// root_path, and each method mirrors the POSIX call it replaces. Transfer
+// workers may use files concurrently with loop().
+class FTPStorage {
+ public:
+  virtual ~FTPStorage() = default;
+  virtual const char *name() const = 0;
+  // flags: O_RDONLY, or O_WRONLY | O_CREAT, optionally with O_TRUNC
+  virtual FTPFilePtr open(const std::string &path, int flags) = 0;
+  virtual int stat(const std::string &path, struct stat *entry_stat) = 0;
+  // Visits every entry but "." and "..". entry_stat is only filled in when
+  // with_stat is set. Returns -1 if path is not a readable directory.
+  virtual int list(const std::string &path, bool with_stat,
+                   const std::function<void(const std::string &name, const struct stat &entry_stat)> &visit) = 0;
+  virtual int mkdir(const std::string &path) = 0;
+  virtual int rmdir(const std::string &path) = 0;
+  virtual int unlink(const std::string &path) = 0;
+  virtual int rename(const std::string &from, const std::string &to) = 0;
+  // rename() over an existing file. FAT refuses that with EEXIST, so the
+  // default unlinks it first: for a moment neither name exists.
+  virtual int replace(const std::string &from, const std::string &to);
+
+  // Growing a file once before an upload (ALLO) only pays off on FAT.
+  virtual bool preallocation_helps() const { return false; }
+  // Background work, run from FTPServer::loop() while busy() is true.
+  virtual void loop() {}
+  virtual bool busy() const { return false; }
+  // Extra STAT lines
+  virtual void describe(std::vector<std::string> & /*lines*/) const {}
+};
+using FTPStoragePtr = std::unique_ptr<FTPStorage>;
+
+enum FTPStorageType {
+  FTP_STORAGE_SD_CARD,
+  FTP_STORAGE_LITTLEFS,
+  FTP_STORAGE_RAM
+};
+
+// VFS mounts: FAT on the SD card (mounted by sd_mmc_card), LittleFS.
+#ifdef USE_FTP_SD_MMC_CARD
+// Refuses everything with ENODEV while the card (if given) failed to mount.
+FTPStoragePtr make_sd_card_storage(sd_mmc_card::SdMmc *card);
+#else
+FTPStoragePtr make_sd_card_storage();
+#endif
+FTPStoragePtr make_littlefs_storage();
+// Mounts a LittleFS partition at base_path when built with USE_FTP_LITTLEFS.
+bool mount_littlefs(const std::string &partition_label, const std::string &base_path);
+// Volume held in PSRAM (internal RAM without it), lost on reboot. It holds
+// nothing but root_path when created.
+FTPStoragePtr make_ram_storage(const std::string &root_path, size_t capacity);
+// Write-back staging: new uploads land in up to capacity bytes of PSRAM
+// and are written to backing from loop(). Anything touching a path still
+// staged writes it out first, so clients always read back what they sent.
+FTPStoragePtr make_staging_storage(FTPStoragePtr backing, size_t capacity);
+
+}  // namespace ftp_server
+}  // namespace esphome
@@ -0,0 +1,668 @@
+#include "ftp_server.h"
+#include "esp_log.h"
+#include "esphome/core/hal.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+
+namespace esphome {
+namespace ftp_server {
+
+static const char *TAG = "ftp_server";
+
+static const size_t TAR_BLOCK_SIZE = 512;
+// Directories listed per read() of an archive, as for SITE FIND.
+static const size_t TAR_DIRS_PER_READ = 4;
+// Longest GNU long name or pax header an extraction accepts
+static const size_t TAR_MAX_META_SIZE = 4096;
+// Members an extraction starts per write(), the rest of the archive waiting
+// for the next tick. Each is a few FAT directory updates: a stat, mkdirs,
+// a create and a rename.
+static const size_t TAR_MEMBERS_PER_WRITE = 8;
+
+// POSIX ustar header (IEEE 1003.1-1988)
+struct TarHeader {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+};
+static_assert(sizeof(TarHeader) == TAR_BLOCK_SIZE, "ustar headers are one block");
+
+static void put_octal(char *field, size_t size, uint64_t value) {
+  // size - 1 digits and a NUL, zero padded; values that do not fit keep
+  // their low digits (sizes and times stay far below 8 GiB / 2242 here).
+  char digits[24];
+  int n = snprintf(digits, sizeof(digits), "%0*llo", (int) size - 1, (unsigned long long) value);
+  memcpy(field, digits + n - (size - 1), size);
+}
+
+static uint32_t header_checksum(const TarHeader &header) {
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&header);
+  uint32_t sum = 0;
+  for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+    bool in_checksum = i >= offsetof(TarHeader, checksum) && i < offsetof(TarHeader, checksum) + 8;
+    sum += in_checksum ? ' ' : bytes[i];
+  }
+  return sum;
+}
+
+static bool is_archive_name(const std::string &path) {
+  static const char SUFFIX[] = ".tar";
+  const size_t suffix_len = sizeof(SUFFIX) - 1;
+  if (path.size() <= suffix_len || path[path.size() - suffix_len - 1] == '/') {
+    return false;
+  }
+  return std::equal(SUFFIX, SUFFIX + suffix_len, path.end() - suffix_len,
+                    [](char a, char b) { return a == std::tolower(static_cast<unsigned char>(b)); });
+}
+
+// ---------------------------------------------------------------------------
+// Archive of a directory, produced as it is read
+
+class FTPTarStream : public FTPFile {
+ public:
+  FTPTarStream(FTPStorage &storage, const std::string &dir) : storage_(storage), dir_(dir) {
+    struct stat dir_stat {};
+    dir_stat.st_mode = S_IFDIR;
+    pending_.push_back({std::string(), dir_stat});
+  }
+  ~FTPTarStream() override { close(); }
+
+  ssize_t read(uint8_t *buffer, size_t len) override {
+    size_t done = 0;
+    size_t listed = 0;
+    while (done < len) {
+      if (block_pos_ < block_len_) {
+        size_t n = std::min(len - done, block_len_ - block_pos_);
+        memcpy(buffer + done, block_ + block_pos_, n);
+        block_pos_ += n;
+        done += n;
+        continue;
+      }
+      if (remaining_ > 0) {
+        ssize_t n = read_content(buffer + done, len - done);
+        if (n < 0) {
+          return -1;
+        }
+        done += n;
+        continue;
+      }
+      if (padding_ > 0) {
+        size_t n = std::min(len - done, padding_);
+        memset(buffer + done, 0, n);
+        padding_ -= n;
+        done += n;
+        continue;
+      }
+      if (pending_.empty()) {
+        if (!trailer_sent_) {
+          // Two zero blocks end the archive.
+          trailer_sent_ = true;
+          padding_ = 2 * TAR_BLOCK_SIZE;
+          continue;
+        }
+        break;
+      }
+      if (S_ISDIR(pending_.back().entry_stat.st_mode) && listed == TAR_DIRS_PER_READ) {
+        break;
+      }
+      listed += S_ISDIR(pending_.back().entry_stat.st_mode) ? 1 : 0;
+      next_entry();
+    }
+    if (done == 0 && !pending_.empty()) {
+      errno = EAGAIN;
+      return -1;
+    }
+    return done;
+  }
+
+  ssize_t write(const uint8_t *buffer, size_t len) override {
+    errno = EBADF;
+    return -1;
+  }
+  bool seek(size_t pos) override {
+    errno = ESPIPE;
+    return pos == 0 && entries_ == 0;
+  }
+  ssize_t size() override {
+    errno = ESPIPE;
+    return -1;
+  }
+  bool truncate(size_t size) override {
+    errno = EBADF;
+    return false;
+  }
+  int close() override {
+    if (file_) {
+      file_->close();
+      file_.reset();
+    }
+    if (!closed_) {
+      closed_ = true;
+      ESP_LOGI(TAG, "Archived %u entries of %s, %u skipped", (unsigned) entries_, dir_.c_str(), (unsigned) skipped_);
+    }
+    return 0;
+  }
+
+ protected:
+  struct Entry {
+    // Relative to dir_, empty for dir_ itself
+    std::string name;
+    struct stat entry_stat;
+  };
+
+  // Emits the header of the next entry and, for a directory, queues what
+  // it holds so the walk stays depth first in storage order.
+  void next_entry() {
+    Entry entry = std::move(pending_.back());
+    pending_.pop_back();
+    std::string path = entry.name.empty() ? dir_ : dir_ + "/" + entry.name;
+    if (S_ISDIR(entry.entry_stat.st_mode)) {
+      size_t first_child = pending_.size();
+      std::string prefix = entry.name.empty() ? std::string() : entry.name + "/";
+      int result = storage_.list(path, true, [&](const std::string &entry_name, const struct stat &entry_stat) {
+        if ((S_ISDIR(entry_stat.st_mode) || S_ISREG(entry_stat.st_mode)) && entry_name != FTP_TEMP_DIR) {
+          pending_.push_back({prefix + entry_name, entry_stat});
+        }
+      });
+      if (result != 0) {
+        ESP_LOGW(TAG, "Could not list %s for archive (errno: %d)", path.c_str(), errno);
+        skipped_++;
+        return;
+      }
+      std::reverse(pending_.begin() + first_child, pending_.end());
+      if (!entry.name.empty()) {
+        put_header(entry.name + "/", entry.entry_stat, '5', 0);
+      }
+      return;
+    }
+
+    file_ = storage_.open(path, O_RDONLY);
+    if (!file_) {
+      ESP_LOGW(TAG, "Could not open %s for archive (errno: %d)", path.c_str(), errno);
+      skipped_++;
+      return;
+    }
+    size_t size = entry.entry_stat.st_size;
+    if (!put_header(entry.name, entry.entry_stat, '0', size)) {
+      file_.reset();
+      return;
+    }
+    remaining_ = size;
+    padding_ = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+  }
+
+  // The header promised st_size bytes: a file that shrank since is padded
+  // with zeros, one that grew is cut.
+  ssize_t read_content(uint8_t *out, size_t len) {
+    size_t want = std::min<uint64_t>(len, remaining_);
+    ssize_t n = file_ ? file_->read(out, want) : 0;
+    if (n < 0) {
+      ESP_LOGE(TAG, "Error reading file for archive (errno: %d)", errno);
+      return -1;
+    }
+    if (n == 0) {
+      memset(out, 0, want);
+      n = want;
+    }
+    remaining_ -= n;
+    if (remaining_ == 0 && file_) {
+      file_->close();
+      file_.reset();
+    }
+    return n;
+  }
+
+  // Long names go in the ustar prefix field, split at a slash.
+  bool put_header(const std::string &name, const struct stat &entry_stat, char typeflag, uint64_t size) {
+    TarHeader &header = *reinterpret_cast<TarHeader *>(block_);
+    memset(&header, 0, sizeof(header));
+    if (name.size() <= sizeof(header.name)) {
+      memcpy(header.name, name.data(), name.size());
+    } else {
+      size_t slash = name.find('/', name.size() - sizeof(header.name) - 1);
+      if (slash == std::string::npos || slash > sizeof(header.prefix)) {
+        ESP_LOGW(TAG, "Name too long for ustar, skipping: %s", name.c_str());
+        skipped_++;
+        return false;
+      }
+      memcpy(header.prefix, name.data(), slash);
+      memcpy(header.name, name.data() + slash + 1, name.size() - slash - 1);
+    }
+    put_octal(header.mode, sizeof(header.mode), typeflag == '5' ? 0755 : 0644);
+    put_octal(header.uid, sizeof(header.uid), 0);
+    put_octal(header.gid, sizeof(header.gid), 0);
+    put_octal(header.size, sizeof(header.size), size);
+    put_octal(header.mtime, sizeof(header.mtime), entry_stat.st_mtime > 0 ? entry_stat.st_mtime : 0);
+    header.typeflag = typeflag;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    strcpy(header.uname, "root");
+    strcpy(header.gname, "root");
+    snprintf(header.checksum, sizeof(header.checksum), "%06o", (unsigned) header_checksum(header));
+    header.checksum[7] = ' ';
+    block_pos_ = 0;
+    block_len_ = TAR_BLOCK_SIZE;
+    entries_++;
+    return true;
+  }
+
+  FTPStorage &storage_;
+  std::string dir_;
+  std::vector<Entry> pending_;
+  FTPFilePtr file_;
+  uint64_t remaining_{0};
+  size_t padding_{0};
+  uint8_t block_[TAR_BLOCK_SIZE];
+  size_t block_pos_{0};
+  size_t block_len_{0};
+  bool trailer_sent_{false};
+  size_t entries_{0};
+  size_t skipped_{0};
+  bool closed_{false};
+};
+
+// ---------------------------------------------------------------------------
+// Extraction of an archive as it is written
+
+class FTPTarExtractor : public FTPFile {
+ public:
+  FTPTarExtractor(FTPStorage &storage, const std::string &dir, const std::string &temp_path)
+      : storage_(storage), dir_(dir), temp_path_(temp_path) {}
+  ~FTPTarExtractor() override { close(); }
+
+  ssize_t read(uint8_t *buffer, size_t len) override {
+    errno = EBADF;
+    return -1;
+  }
+
+  // Returns short once it started TAR_MEMBERS_PER_WRITE members.
+  ssize_t write(const uint8_t *buffer, size_t len) override {
+    size_t done = 0;
+    size_t members = 0;
+    while (done < len && members < TAR_MEMBERS_PER_WRITE) {
+      if (ended_) {
+        // Whatever follows the end-of-archive blocks is ignored.
+        return len;
+      }
+      size_t n;
+      if (remaining_ > 0) {
+        n = std::min<uint64_t>(len - done, remaining_);
+        if (!consume_data(buffer + done, n)) {
+          return -1;
+        }
+        remaining_ -= n;
+        if (remaining_ == 0 && !finish_member()) {
+          return -1;
+        }
+      } else if (padding_ > 0) {
+        n = std::min(len - done, padding_);
+        padding_ -= n;
+      } else {
+        n = std::min(len - done, TAR_BLOCK_SIZE - header_len_);
+        memcpy(header_ + header_len_, buffer + done, n);
+        header_len_ += n;
+        if (header_len_ == TAR_BLOCK_SIZE) {
+          header_len_ = 0;
+          members++;
+          if (!start_member()) {
+            return -1;
+          }
+        }
+      }
+      done += n;
+    }
+    return done;
+  }
+
+  bool seek(size_t pos) override {
+    errno = ESPIPE;
+    return pos == 0;
+  }
+  ssize_t size() override { return 0; }
+  bool truncate(size_t size) override {
+    errno = EINVAL;
+    return false;
+  }
+
+  // Fails when the archive stopped in the middle of a member, which is
+  // dropped: its file keeps what it had.
+  int close() override {
+    if (file_) {
+      file_->close();
+      file_.reset();
+      storage_.unlink(temp_path_);
+    }
+    if (closed_) {
+      return complete_ ? 0 : -1;
+    }
+    closed_ = true;
+    complete_ = remaining_ == 0 && header_len_ == 0 && !failed_;
+    ESP_LOGI(TAG, "Extracted %u files and %u directories into %s%s", (unsigned) files_, (unsigned) directories_,
+             dir_.c_str(), complete_ ? "" : ", archive incomplete");
+    return complete_ ? 0 : -1;
+  }
+
+ protected:
+  enum MemberKind { MEMBER_SKIP, MEMBER_FILE, MEMBER_META };
+
+  static uint64_t parse_octal(const char *field, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size && field[i] != '\0' && field[i] != ' '; i++) {
+      if (field[i] < '0' || field[i] > '7') {
+        break;
+      }
+      value = value * 8 + (field[i] - '0');
+    }
+    return value;
+  }
+
+  bool fail(int error) {
+    failed_ = true;
+    errno = error;
+    return false;
+  }
+
+  bool start_member() {
+    const TarHeader &header = *reinterpret_cast<const TarHeader *>(header_);
+    if (std::all_of(header_, header_ + TAR_BLOCK_SIZE, [](uint8_t b) { return b == 0; })) {
+      ended_ = true;
+      return true;
+    }
+    uint32_t stored = parse_octal(header.checksum, sizeof(header.checksum));
+    if (stored != header_checksum(header)) {
+      ESP_LOGE(TAG, "Bad tar header checksum, giving up extraction");
+      return fail(EINVAL);
+    }
+    uint64_t size = parse_octal(header.size, sizeof(header.size));
+    remaining_ = size;
+    padding_ = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+    std::string name;
+    if (!long_name_.empty()) {
+      name.swap(long_name_);
+    } else {
+      if (header.prefix[0] != '\0' && memcmp(header.magic, "ustar", 5) == 0) {
+        name.assign(header.prefix, strnlen(header.prefix, sizeof(header.prefix))).append("/");
+      }
+      name.append(header.name, strnlen(header.name, sizeof(header.name)));
+    }
+
+    kind_ = MEMBER_SKIP;
+    switch (header.typeflag) {
+      case 'L':
+      case 'x':
+        // GNU long name, or pax extended header: both may name the next member.
+        if (size > TAR_MAX_META_SIZE) {
+          return true;
+        }
+        kind_ = MEMBER_META;
+        meta_type_ = header.typeflag;
+        meta_.clear();
+        break;
+      case '5':
+        make_directory(name);
+        break;
+      case '0':
+      case '\0':
+      case '7':
+        return open_member(name);
+      default:
+        // Links, devices, global pax headers: nothing to create.
+        break;
+    }
+    return remaining_ > 0 || finish_member();
+  }
+
+  bool consume_data(const uint8_t *data, size_t len) {
+    if (kind_ == MEMBER_META) {
+      meta_.append(reinterpret_cast<const char *>(data), len);
+      return true;
+    }
+    if (kind_ == MEMBER_FILE && file_->write(data, len) != static_cast<ssize_t>(len)) {
+      ESP_LOGE(TAG, "Error writing %s from archive (errno: %d)", path_.data, errno);
+      return fail(errno);
+    }
+    return true;
+  }
+
+  // A file member replaces its target only once complete.
+  bool finish_member() {
+    if (kind_ == MEMBER_FILE) {
+      int closed = file_->close();
+      file_.reset();
+      if (closed != 0) {
+        ESP_LOGE(TAG, "Error writing %s from archive (errno: %d)", path_.data, errno);
+        storage_.unlink(temp_path_);
+        return fail(errno);
+      }
+      int replaced = storage_.replace(temp_path_, path_.data);
+      if (replaced != 0 && errno == ENOENT) {
+        make_parents();
+        replaced = storage_.replace(temp_path_, path_.data);
+      }
+      if (replaced != 0) {
+        ESP_LOGE(TAG, "Could not create %s from archive (errno: %d)", path_.data, errno);
+        storage_.unlink(temp_path_);
+        return fail(errno);
+      }
+      files_++;
+    } else if (kind_ == MEMBER_META) {
+      take_long_name();
+    }
+    kind_ = MEMBER_SKIP;
+    return true;
+  }
+
+  void take_long_name() {
+    if (meta_type_ == 'L') {
+      long_name_.assign(meta_.c_str());
+      return;
+    }
+    // pax records: "<length> <key>=<value>\n"
+    for (size_t pos = 0; pos < meta_.size();) {
+      size_t space = meta_.find(' ', pos);
+      size_t length = strtoul(meta_.c_str() + pos, nullptr, 10);
+      if (space == std::string::npos || length == 0 || pos + length > meta_.size()) {
+        break;
+      }
+      std::string record = meta_.substr(space + 1, pos + length - space - 2);
+      if (record.compare(0, 5, "path=") == 0) {
+        long_name_ = record.substr(5);
+      }
+      pos += length;
+    }
+  }
+
+  // Member names are resolved below dir_ exactly like client paths, so
+  // "../x" or "/etc/x" cannot land outside of it.
+  bool resolve(const std::string &name) {
+    if (!resolve_path(dir_, dir_, name, path_)) {
+      ESP_LOGW(TAG, "Skipping archive member outside of %s or too long: %s", dir_.c_str(), name.c_str());
+      return false;
+    }
+    // "./" is dir_ itself, which exists already.
+    if (path_.len <= dir_.size()) {
+      return false;
+    }
+    // Nor may a member reach into FTP_TEMP_DIR, where uploads in progress live.
+    std::string_view rest = path_.view().substr(dir_.size() + 1);
+    while (!rest.empty()) {
+      size_t slash = rest.find('/');
+      if (rest.substr(0, slash) == FTP_TEMP_DIR) {
+        ESP_LOGW(TAG, "Skipping archive member in %s: %s", FTP_TEMP_DIR, name.c_str());
+        return false;
+      }
+      rest = slash == std::string_view::npos ? std::string_view() : rest.substr(slash + 1);
+    }
+    return true;
+  }
+
+  // Creates the directories above path_, as tar does for members listed
+  // without their parents.
+  void make_parents() {
+    for (size_t pos = dir_.size() + 1; pos < path_.len; pos++) {
+      if (path_.data[pos] != '/') {
+        continue;
+      }
+      path_.data[pos] = '\0';
+      storage_.mkdir(path_.data);
+      path_.data[pos] = '/';
+    }
+  }
+
+  void make_directory(const std::string &name) {
+    if (!resolve(name)) {
+      return;
+    }
+    struct stat dir_stat;
+    if (storage_.stat(path_.data, &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode)) {
+      return;
+    }
+    make_parents();
+    if (storage_.mkdir(path_.data) == 0) {
+      directories_++;
+    } else {
+      ESP_LOGW(TAG, "Could not create %s from archive (errno: %d)", path_.data, errno);
+    }
+  }
+
+  bool open_member(const std::string &name) {
+    if (!resolve(name)) {
+      return remaining_ > 0 || finish_member();
+    }
+    // Written under temp_path_ and renamed by finish_member(), like an
+    // atomic STOR.
+    file_ = storage_.open(temp_path_, O_WRONLY | O_CREAT | O_TRUNC);
+    if (!file_) {
+      ESP_LOGE(TAG, "Could not create %s for %s from archive (errno: %d)", temp_path_.c_str(), path_.data, errno);
+      return fail(errno);
+    }
+    kind_ = MEMBER_FILE;
+    return remaining_ > 0 || finish_member();
+  }
+
+  FTPStorage &storage_;
+  std::string dir_;
+  std::string temp_path_;
+  uint8_t header_[TAR_BLOCK_SIZE];
+  size_t header_len_{0};
+  uint64_t remaining_{0};
+  size_t padding_{0};
+  MemberKind kind_{MEMBER_SKIP};
+  char meta_type_{0};
+  std::string meta_;
+  std::string long_name_;
+  FTPPathBuffer path_;
+  FTPFilePtr file_;
+  size_t files_{0};
+  size_t directories_{0};
+  bool ended_{false};
+  bool failed_{false};
+  bool closed_{false};
+  bool complete_{false};
+};
+
+FTPFilePtr make_tar_stream(FTPStorage &storage, const std::string &dir) {
+  return FTPFilePtr(new FTPTarStream(storage, dir));
+}
+
+FTPFilePtr make_tar_extractor(FTPStorage &storage, const std::string &dir, const std::string &temp_path) {
+  return FTPFilePtr(new FTPTarExtractor(storage, dir, temp_path));
+}
+
+// "<dir>.tar" names the archive of an existing directory <dir>, unless a
+// real file has that name.
+bool FTPServer::archive_directory(FTPSession &session, const std::string& path, std::string *dir) {
+  if (!is_archive_name(path)) {
+    return false;
+  }
+  struct stat file_stat;
+  if (storage_->stat(path, &file_stat) == 0) {
+    return false;
+  }
+  dir->assign(path, 0, path.size() - 4);
+  return is_directory(session, *dir);
+}
+
+// RETR <dir>.tar: the archive holds the content of <dir>, as made by
+// "tar -C <dir> -cf - .", so SITE UNTAR of it into <dir> gives the same tree.
+bool FTPServer::start_archive_download(FTPSession &session, const std::string& path) {
+  std::string dir;
+  if (!archive_directory(session, path, &dir)) {
+    return false;
+  }
+  if (session.restart_offset > 0) {
+    session.restart_offset = 0;
+    close_data_connection(session);
+    send_response(session.control_socket, 554, "REST is not supported for directory archives");
+    return true;
+  }
+  ESP_LOGI(TAG, "Streaming %s as a tar archive", dir.c_str());
+  send_response(session.control_socket, 150, "Opening connection for tar archive of " + client_path(dir));
+  start_generated_transfer(session, FTP_TRANSFER_SEND, dir, make_tar_stream(*storage_, dir));
+  return true;
+}
+
+// "SITE UNTAR <dir>" receives a tar archive like a STOR and extracts it
+// into the existing <dir> as it arrives, creating directories as needed and
+// replacing files once each has arrived in full. A plain STOR never
+// extracts anything.
+void FTPServer::site_untar(FTPSession &session, std::string_view arg) {
+  int client_socket = session.control_socket;
+  std::vector<std::string> arguments = split_arguments(arg);
+  if (arguments.size() != 1) {
+    send_response(client_socket, 501, "Syntax: SITE UNTAR <dir>");
+    return;
+  }
+  session.allocation_hint = 0;
+  if (!admit_transfer(session)) {
+    return;
+  }
+  std::string dir;
+  if (!resolve_client_path(session, arguments[0], &dir)) {
+    close_data_connection(session);
+    return;
+  }
+  if (session.restart_offset > 0) {
+    session.restart_offset = 0;
+    close_data_connection(session);
+    send_response(client_socket, 554, "REST is not supported for directory archives");
+    return;
+  }
+  if (!is_directory(session, dir)) {
+    close_data_connection(session);
+    send_response(client_socket, 550, "Not a directory");
+    return;
+  }
+  if (!prepare_temp_dir()) {
+    close_data_connection(session);
+    send_response(client_socket, 451, "Requested action aborted: cannot create temporary file");
+    return;
+  }
+  ESP_LOGI(TAG, "Extracting upload into %s", dir.c_str());
+  send_response(client_socket, 150, "Opening connection for tar extraction into " + client_path(dir));
+  start_generated_transfer(session, FTP_TRANSFER_RECEIVE, dir,
+                           make_tar_extractor(*storage_, dir, temp_path_for(session)));
+}
+
+}  // namespace ftp_server
+}  // namespace esphome
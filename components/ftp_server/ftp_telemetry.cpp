@@ -0,0 +1,241 @@
+#include "ftp_server.h"
+#include "esphome/core/hal.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace esphome {
+namespace ftp_server {
+
+void FTPHistogram::add(uint32_t value) {
+  size_t bucket = 0;
+  while (bucket + 1 < BUCKETS && (value >> bucket) != 0) {
+    bucket++;
+  }
+  buckets[bucket]++;
+  count++;
+  sum += value;
+  max = std::max(max, value);
+}
+
+uint32_t FTPHistogram::percentile(uint8_t percent) const {
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t wanted = (uint64_t(count) * percent + 99) / 100;
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+    seen += buckets[bucket];
+    if (seen >= wanted) {
+      // The last bucket is open-ended, only max bounds it.
+      return bucket + 1 == BUCKETS ? max : std::min((1u << bucket) - 1, max);
+    }
+  }
+  return max;
+}
+
+static std::string describe(const char *label, const FTPHistogram &histogram, const char *unit) {
+  char line[160];
+  snprintf(line, sizeof(line), "%s: n=%u mean=%u p50=%u p99=%u max=%u %s", label, (unsigned) histogram.count,
+           (unsigned) histogram.mean(), (unsigned) histogram.percentile(50), (unsigned) histogram.percentile(99),
+           (unsigned) histogram.max, unit);
+  return line;
+}
+
+size_t FTPServer::count_active_sessions() const {
+  size_t active = 0;
+  for (const auto &session : sessions_) {
+    if (session.in_use && !session.closing) {
+      active++;
+    }
+  }
+  return active;
+}
+
+// Heap a session holds beyond its slot: strings, transfer buffers, the
+// listing it sends (possibly shared with the cache) and its hash job. zlib
+// state is estimated from the sizes documented in zconf.h.
+size_t FTPServer::session_memory(const FTPSession &session) const {
+  size_t bytes = session.command_buffer.capacity() + session.username.capacity() +
+                 session.current_path.capacity() + session.rename_from.capacity();
+  for (const auto &entry : session.dir_cache) {
+    bytes += entry.path.capacity();
+  }
+  const FTPTransfer &transfer = session.transfer;
+  if (transfer.state != FTP_TRANSFER_DONE) {
+    bytes += transfer.path.capacity() + transfer.chunks.capacity() * sizeof(FTPChunk);
+    for (const auto &chunk : transfer.chunks) {
+      bytes += chunk.data ? transfer.chunk_size : 0;
+    }
+    if (transfer.listing) {
+      bytes += transfer.listing->size();
+    }
+    if (transfer.zinput.data) {
+      bytes += transfer.chunk_size;
+    }
+    if (transfer.zstream) {
+      bytes += transfer.direction == FTP_TRANSFER_SEND
+                   ? (1u << (compression_window_bits_ + 2)) + (1u << (compression_mem_level() + 9))
+                   : (1u << 15) + 7168;
+    }
+  }
+  if (session.hash_job) {
+    bytes += sizeof(FTPHashJob) + session.hash_job->buffer_size + session.hash_job->name.capacity();
+  }
+  if (session.site_job) {
+    bytes += sizeof(FTPSiteJob) + session.site_job->buffer_size +
+             session.site_job->directories.capacity() * sizeof(FTPSiteJob::Directory);
+  }
+  return bytes;
+}
+
+// Slots of the session slab are allocated once at setup() and counted here
+// whether in use or not.
+size_t FTPServer::total_session_memory() const {
+  size_t bytes = sessions_.capacity() * sizeof(FTPSession) + session_by_fd_.capacity();
+  for (const auto &session : sessions_) {
+    if (session.in_use) {
+      bytes += session_memory(session);
+    }
+  }
+  return bytes;
+}
+
+// Called by finish_transfer() before the transfer is torn down.
+void FTPServer::record_transfer(FTPSession &session, int code) {
+  FTPTransfer &transfer = session.transfer;
+  uint32_t now = millis();
+  if (transfer.direction == FTP_TRANSFER_SEND) {
+    telemetry_.bytes_sent += transfer.offset;
+  } else {
+    telemetry_.bytes_received += transfer.offset;
+  }
+  if (code != 226) {
+    telemetry_.transfers_failed++;
+    return;
+  }
+  telemetry_.transfers_ok++;
+  if (transfer.is_listing || transfer.attached_ms == 0) {
+    return;
+  }
+
+  if (transfer.direction == FTP_TRANSFER_SEND && transfer.first_byte_ms != 0) {
+    telemetry_.retr_ttfb.add(transfer.first_byte_ms - transfer.started_ms);
+  }
+  uint32_t elapsed = std::max<uint32_t>(now - transfer.attached_ms, 1);
+  uint32_t throughput = uint64_t(transfer.offset) * 1000 / elapsed;
+  telemetry_.last_throughput = throughput;
+  telemetry_.throughput.add(throughput);
+
+#ifdef USE_TEXT_SENSOR
+  if (this->last_transfer_text_sensor_ != nullptr) {
+    char summary[192];
+    snprintf(summary, sizeof(summary), "%s %s: %u B in %u ms (%u B/s)",
+             transfer.direction == FTP_TRANSFER_SEND ? "RETR" : "STOR", transfer.path.c_str(),
+             (unsigned) transfer.offset, (unsigned) elapsed, (unsigned) throughput);
+    this->last_transfer_text_sensor_->publish_state(summary);
+  }
+#endif
+}
+
+#ifdef USE_SENSOR
+// Mean of what was added since the last publish, NAN when nothing was.
+static float interval_mean(const FTPHistogram &now, FTPHistogram &published, float scale) {
+  uint32_t count = now.count - published.count;
+  float mean = count == 0 ? NAN : float(now.sum - published.sum) / count * scale;
+  published = now;
+  return mean;
+}
+#endif
+
+void FTPServer::publish_telemetry() {
+#ifdef USE_SENSOR
+  if (this->bytes_sent_sensor_ != nullptr)
+    this->bytes_sent_sensor_->publish_state(telemetry_.bytes_sent);
+  if (this->bytes_received_sensor_ != nullptr)
+    this->bytes_received_sensor_->publish_state(telemetry_.bytes_received);
+  if (this->active_sessions_sensor_ != nullptr)
+    this->active_sessions_sensor_->publish_state(count_active_sessions());
+  if (this->active_transfers_sensor_ != nullptr)
+    this->active_transfers_sensor_->publish_state(active_transfers_);
+  if (this->transfer_throughput_sensor_ != nullptr)
+    this->transfer_throughput_sensor_->publish_state(telemetry_.last_throughput);
+  if (this->retr_ttfb_sensor_ != nullptr)
+    this->retr_ttfb_sensor_->publish_state(interval_mean(telemetry_.retr_ttfb, published_ttfb_, 1.0f));
+  if (this->command_latency_sensor_ != nullptr)
+    this->command_latency_sensor_->publish_state(
+        interval_mean(telemetry_.command_latency, published_command_latency_, 0.001f));
+  if (this->accept_latency_sensor_ != nullptr)
+    this->accept_latency_sensor_->publish_state(
+        interval_mean(telemetry_.accept_latency, published_accept_latency_, 1.0f));
+  if (this->session_memory_sensor_ != nullptr)
+    this->session_memory_sensor_->publish_state(total_session_memory());
+#endif
+}
+
+// STAT without argument reports server and session state; with a path it
+// sends the LIST output over the control connection (RFC 959).
+void FTPServer::cmd_stat(FTPSession &session, std::string_view arg) {
+  if (!arg.empty()) {
+    std::string path;
+    if (!resolve_client_path(session, arg, &path)) {
+      return;
+    }
+    FTPListing listing = render_listing(path, FTP_LIST_LONG, std::string(), std::string());
+    if (!listing) {
+      send_response(session.control_socket, 550, "Failed to open directory");
+      return;
+    }
+    std::vector<std::string> lines = {"Status of " + std::string(arg) + ":"};
+    size_t start = 0;
+    while (start < listing->size()) {
+      size_t eol = listing->find("\r\n", start);
+      if (eol == std::string::npos) {
+        eol = listing->size();
+      }
+      lines.push_back(listing->substr(start, eol - start));
+      start = eol + 2;
+    }
+    lines.push_back("End of status");
+    send_multiline_response(session.control_socket, 213, lines);
+    return;
+  }
+
+  const FTPTelemetry &t = telemetry_;
+  std::vector<std::string> lines;
+  lines.push_back("FTP server status:");
+  lines.push_back("Sessions: " + std::to_string(count_active_sessions()) + " of " + std::to_string(max_sessions_) +
+                  " active, " + std::to_string(t.sessions_total) + " since boot, " +
+                  std::to_string(t.sessions_timed_out) + " timed out, " + std::to_string(t.sessions_evicted) +
+                  " evicted");
+  lines.push_back("Session memory: " + std::to_string(total_session_memory()) + " bytes, " +
+                  std::to_string(session_memory(session)) + " for this session");
+  lines.push_back("Transfers: " + std::to_string(active_transfers_) + " active, " + std::to_string(t.transfers_ok) +
+                  " completed, " + std::to_string(t.transfers_failed) + " failed");
+  lines.push_back("Bytes sent: " + std::to_string(t.bytes_sent) + ", received: " + std::to_string(t.bytes_received));
+  lines.push_back("Last throughput: " + std::to_string(t.last_throughput) + " B/s");
+  lines.push_back(describe("Throughput", t.throughput, "B/s"));
+  lines.push_back(describe("RETR time to first byte", t.retr_ttfb, "ms"));
+  lines.push_back(describe("Command latency", t.command_latency, "us"));
+  lines.push_back(describe("Data connection accept latency", t.accept_latency, "ms"));
+  lines.push_back(std::string("Storage: ") + storage_->name());
+  storage_->describe(lines);
+  lines.push_back("Logged in as " + session.username + ", cwd " + client_path(session.current_path) + ", " +
+                  std::to_string(session.commands) + " commands");
+  const FTPTransfer &transfer = session.transfer;
+  if (transfer.state != FTP_TRANSFER_DONE) {
+    lines.push_back(std::string(transfer.direction == FTP_TRANSFER_SEND ? "Sending " : "Receiving ") +
+                    (transfer.is_listing ? std::string("listing") : transfer.path) + ": " +
+                    std::to_string(transfer.offset) + " bytes so far");
+  }
+  if (session.site_job) {
+    lines.push_back("Running SITE " + describe_site_job(session));
+  } else if (!session.site_job_result.empty()) {
+    lines.push_back("Last SITE job: " + session.site_job_result);
+  }
+  lines.push_back("End of status");
+  send_multiline_response(session.control_socket, 211, lines);
+}
+
+}  // namespace ftp_server
+}  // namespace esphome
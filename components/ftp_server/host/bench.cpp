@@ -0,0 +1,617 @@
+// Loopback benchmark for the host build of FTPServer.
+//
+// Runs the server on its own thread, the way ESPHome calls loop(), and opens
+// N concurrent sessions on 127.0.0.1 that run a scripted LIST/RETR/STOR
+// workload against a temporary root. Reports aggregate throughput, control
+// command latency and time to first byte of LIST/RETR, and exits non-zero if
+// any reply or transfer was wrong, so it doubles as a regression check.
+#include "ftp_server.h"
+#include "esphome/core/helpers.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using esphome::HighFrequencyLoopRequester;
+using esphome::ftp_server::FTPServer;
+using Clock = std::chrono::steady_clock;
+namespace fs = std::filesystem;
+
+namespace {
+
+enum Workload { WORKLOAD_LIST, WORKLOAD_RETR, WORKLOAD_STOR, WORKLOAD_MIXED };
+
+struct Options {
+  int sessions{4};
+  int iterations{20};
+  Workload workload{WORKLOAD_MIXED};
+  size_t file_size{1 << 20};
+  int files{8};
+  int listing_entries{200};
+  uint16_t port{2121};
+  int loop_interval_ms{16};
+  std::string root;
+  bool keep_root{false};
+  bool verbose{false};
+  bool server_stat{false};
+  // Server settings, 0 keeps the component default
+  uint32_t download_buffer_size{0};
+  uint32_t upload_buffer_size{0};
+  uint32_t max_bandwidth{0};
+  uint32_t session_bandwidth{0};
+  int listing_cache_size{-1};
+  int max_sessions{0};
+  int max_transfers{0};
+  bool ram_storage{false};
+  uint32_t ram_volume_size{0};
+  uint32_t staging_size{0};
+  uint16_t passive_start{0};
+  uint16_t passive_end{0};
+};
+
+struct Samples {
+  std::vector<uint32_t> command_us;
+  std::vector<uint32_t> ttfb_us;
+  std::vector<double> transfer_rate;  // bytes per second, one per transfer
+  uint64_t bytes{0};
+  uint32_t transfers{0};
+  uint32_t failures{0};
+
+  void merge(const Samples &other) {
+    command_us.insert(command_us.end(), other.command_us.begin(), other.command_us.end());
+    ttfb_us.insert(ttfb_us.end(), other.ttfb_us.begin(), other.ttfb_us.end());
+    transfer_rate.insert(transfer_rate.end(), other.transfer_rate.begin(), other.transfer_rate.end());
+    bytes += other.bytes;
+    transfers += other.transfers;
+    failures += other.failures;
+  }
+};
+
+uint32_t elapsed_us(Clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - since).count();
+}
+
+template<typename T> T percentile(std::vector<T> values, int percent) {
+  if (values.empty()) {
+    return T();
+  }
+  std::sort(values.begin(), values.end());
+  size_t rank = (values.size() * percent + 99) / 100;
+  return values[std::max<size_t>(rank, 1) - 1];
+}
+
+// Minimal FTP client: one control connection, passive data connections.
+class Client {
+ public:
+  ~Client() {
+    if (control_ >= 0) {
+      close(control_);
+    }
+  }
+
+  bool connect_to(uint16_t port) {
+    control_ = connect_loopback(port);
+    return control_ >= 0 && read_reply(nullptr) == 220;
+  }
+
+  // Final reply code of a multi-line reply, -1 once the connection is gone.
+  int read_reply(std::string *text) {
+    std::string line;
+    if (!read_line(&line) || line.size() < 3) {
+      return -1;
+    }
+    if (line.size() > 3 && line[3] == '-') {
+      std::string last = line.substr(0, 3) + " ";
+      std::string next;
+      do {
+        if (!read_line(&next)) {
+          return -1;
+        }
+        line += "\n" + next;
+      } while (next.compare(0, 4, last) != 0);
+    }
+    if (text != nullptr) {
+      *text = line;
+    }
+    return atoi(line.c_str());
+  }
+
+  bool send_line(const std::string &line) {
+    std::string wire = line + "\r\n";
+    return send(control_, wire.data(), wire.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(wire.size());
+  }
+
+  // Request/reply command, timed into samples.
+  int command(const std::string &line, Samples &samples, std::string *text = nullptr) {
+    Clock::time_point start = Clock::now();
+    if (!send_line(line)) {
+      return -1;
+    }
+    int code = read_reply(text);
+    samples.command_us.push_back(elapsed_us(start));
+    return code;
+  }
+
+  // PASV then connect, as clients do before sending the transfer command.
+  int open_passive(Samples &samples) {
+    std::string reply;
+    if (command("PASV", samples, &reply) != 227) {
+      return -1;
+    }
+    unsigned h1, h2, h3, h4, p1, p2;
+    size_t open = reply.find('(');
+    if (open == std::string::npos ||
+        sscanf(reply.c_str() + open, "(%u,%u,%u,%u,%u,%u)", &h1, &h2, &h3, &h4, &p1, &p2) != 6) {
+      return -1;
+    }
+    return connect_loopback(p1 << 8 | p2);
+  }
+
+ private:
+  static int connect_loopback(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+  }
+
+  bool read_line(std::string *line) {
+    for (;;) {
+      size_t eol = pending_.find("\r\n");
+      if (eol != std::string::npos) {
+        *line = pending_.substr(0, eol);
+        pending_.erase(0, eol + 2);
+        return true;
+      }
+      char buffer[512];
+      ssize_t len = recv(control_, buffer, sizeof(buffer), 0);
+      if (len <= 0) {
+        return false;
+      }
+      pending_.append(buffer, len);
+    }
+  }
+
+  int control_{-1};
+  std::string pending_;
+};
+
+// LIST or RETR: reads the data connection to EOF. Returns the byte count,
+// or -1 when a reply was not the expected one.
+long long receive(Client &client, const std::string &line, Samples &samples) {
+  int data = client.open_passive(samples);
+  if (data < 0) {
+    return -1;
+  }
+  Clock::time_point start = Clock::now();
+  if (!client.send_line(line) || client.read_reply(nullptr) != 150) {
+    close(data);
+    return -1;
+  }
+  static thread_local std::vector<char> buffer(64 * 1024);
+  long long total = 0;
+  ssize_t len;
+  while ((len = recv(data, buffer.data(), buffer.size(), 0)) > 0) {
+    if (total == 0) {
+      samples.ttfb_us.push_back(elapsed_us(start));
+    }
+    total += len;
+  }
+  close(data);
+  uint32_t duration = std::max<uint32_t>(elapsed_us(start), 1);
+  if (len < 0 || client.read_reply(nullptr) != 226) {
+    return -1;
+  }
+  samples.transfer_rate.push_back(total * 1e6 / duration);
+  return total;
+}
+
+bool store(Client &client, const std::string &name, const std::vector<char> &content, Samples &samples) {
+  int data = client.open_passive(samples);
+  if (data < 0) {
+    return false;
+  }
+  Clock::time_point start = Clock::now();
+  if (!client.send_line("STOR " + name) || client.read_reply(nullptr) != 150) {
+    close(data);
+    return false;
+  }
+  size_t sent = 0;
+  while (sent < content.size()) {
+    ssize_t len = send(data, content.data() + sent, std::min<size_t>(content.size() - sent, 64 * 1024), MSG_NOSIGNAL);
+    if (len <= 0) {
+      break;
+    }
+    sent += len;
+  }
+  close(data);
+  uint32_t duration = std::max<uint32_t>(elapsed_us(start), 1);
+  if (sent != content.size() || client.read_reply(nullptr) != 226) {
+    return false;
+  }
+  samples.transfer_rate.push_back(sent * 1e6 / duration);
+  return true;
+}
+
+void run_session(const Options &options, int id, const std::vector<char> &upload, Samples &samples) {
+  Client client;
+  if (!client.connect_to(options.port) || client.command("USER bench", samples) != 331 ||
+      client.command("PASS bench", samples) != 230 || client.command("TYPE I", samples) != 200 ||
+      client.command("CWD bench", samples) != 250) {
+    fprintf(stderr, "session %d: login failed\n", id);
+    samples.failures++;
+    return;
+  }
+
+  for (int i = 0; i < options.iterations; i++) {
+    Workload step = options.workload == WORKLOAD_MIXED ? static_cast<Workload>(i % 3) : options.workload;
+    std::string file = "file" + std::to_string((id + i) % options.files) + ".bin";
+    bool ok = false;
+    long long moved = 0;
+    switch (step) {
+      case WORKLOAD_LIST:
+        moved = receive(client, "LIST list", samples);
+        ok = moved > 0;
+        break;
+      case WORKLOAD_RETR:
+        ok = client.command("SIZE " + file, samples) == 213;
+        moved = ok ? receive(client, "RETR " + file, samples) : -1;
+        ok = moved == static_cast<long long>(options.file_size);
+        break;
+      case WORKLOAD_STOR: {
+        std::string name = "upload-" + std::to_string(id) + "-" + std::to_string(i) + ".bin";
+        ok = store(client, name, upload, samples);
+        moved = upload.size();
+        // Through the server, so staged or RAM volume uploads are checked too
+        Samples unused;
+        std::string size;
+        ok = ok && client.command("SIZE " + name, unused, &size) == 213 &&
+             strtoull(size.c_str() + 4, nullptr, 10) == upload.size();
+        break;
+      }
+      default:
+        break;
+    }
+    samples.transfers++;
+    if (ok) {
+      samples.bytes += moved;
+    } else {
+      samples.failures++;
+      fprintf(stderr, "session %d: iteration %d failed\n", id, i);
+    }
+    if (client.command("NOOP", samples) != 200) {
+      samples.failures++;
+      return;
+    }
+  }
+
+  if (options.server_stat && id == 0) {
+    std::string status;
+    client.command("STAT", samples, &status);
+    printf("%s\n\n", status.c_str());
+  }
+  client.command("QUIT", samples);
+}
+
+std::vector<char> random_file(std::mt19937 &random, size_t size) {
+  std::vector<char> content(size);
+  for (auto &byte : content) {
+    byte = static_cast<char>(random());
+  }
+  return content;
+}
+
+void populate_root(const Options &options) {
+  fs::path bench = fs::path(options.root) / "bench";
+  fs::create_directories(bench / "list");
+  std::mt19937 random(42);
+  for (int i = 0; i < options.files; i++) {
+    std::vector<char> content = random_file(random, options.file_size);
+    std::ofstream(bench / ("file" + std::to_string(i) + ".bin"), std::ios::binary)
+        .write(content.data(), content.size());
+  }
+  for (int i = 0; i < options.listing_entries; i++) {
+    std::ofstream(bench / "list" / ("entry-" + std::to_string(i) + ".txt")) << i;
+  }
+}
+
+// A RAM volume starts empty: upload the same tree through the server.
+bool populate_over_ftp(const Options &options) {
+  Samples unused;
+  Client client;
+  if (!client.connect_to(options.port) || client.command("USER bench", unused) != 331 ||
+      client.command("PASS bench", unused) != 230 || client.command("TYPE I", unused) != 200 ||
+      client.command("MKD bench", unused) != 257 || client.command("MKD bench/list", unused) != 257) {
+    return false;
+  }
+  std::mt19937 random(42);
+  for (int i = 0; i < options.files; i++) {
+    if (!store(client, "bench/file" + std::to_string(i) + ".bin", random_file(random, options.file_size), unused)) {
+      return false;
+    }
+  }
+  for (int i = 0; i < options.listing_entries; i++) {
+    std::string text = std::to_string(i);
+    if (!store(client, "bench/list/entry-" + text + ".txt", std::vector<char>(text.begin(), text.end()), unused)) {
+      return false;
+    }
+  }
+  client.command("QUIT", unused);
+  return true;
+}
+
+const char *workload_name(Workload workload) {
+  static const char *const NAMES[] = {"list", "retr", "stor", "mixed"};
+  return NAMES[workload];
+}
+
+void print_distribution(const char *label, const std::vector<uint32_t> &values) {
+  if (values.empty()) {
+    printf("%-18s n=0\n", label);
+    return;
+  }
+  printf("%-18s n=%zu p50=%.3f ms p99=%.3f ms max=%.3f ms\n", label, values.size(), percentile(values, 50) / 1000.0,
+         percentile(values, 99) / 1000.0, *std::max_element(values.begin(), values.end()) / 1000.0);
+}
+
+void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --sessions N             concurrent sessions (4)\n"
+          "  --iterations N           transfers per session (20)\n"
+          "  --workload W             list, retr, stor or mixed (mixed)\n"
+          "  --file-size BYTES        size of RETR and STOR files (1048576)\n"
+          "  --files N                distinct files served by RETR (8)\n"
+          "  --listing-entries N      entries in the LIST directory (200)\n"
+          "  --port N                 control port (2121)\n"
+          "  --loop-interval-ms N     idle loop() period, as ESPHome's loop_interval (16)\n"
+          "  --root DIR               server root, a fresh temporary directory by default\n"
+          "  --keep-root              do not remove the temporary root\n"
+          "  --stat                   print the server's STAT reply at the end\n"
+          "  --verbose                keep the server's INFO log\n"
+          "  --download-buffer-size N, --upload-buffer-size N, --max-bandwidth N,\n"
+          "  --session-bandwidth N, --listing-cache-size N, --passive-ports A-B,\n"
+          "  --max-sessions N, --max-transfers N, --staging-size N,\n"
+          "  --storage sd_card|ram, --ram-volume-size N\n"
+          "                           server settings, as in the YAML\n",
+          program);
+}
+
+bool parse_options(int argc, char **argv, Options &options) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    auto value = [&]() -> const char * { return i + 1 < argc ? argv[++i] : nullptr; };
+    auto number = [&](auto &out) {
+      const char *text = value();
+      if (text == nullptr) {
+        return false;
+      }
+      out = strtoull(text, nullptr, 10);
+      return true;
+    };
+    bool ok = true;
+    if (arg == "--sessions") {
+      ok = number(options.sessions) && options.sessions > 0;
+    } else if (arg == "--iterations") {
+      ok = number(options.iterations);
+    } else if (arg == "--file-size") {
+      ok = number(options.file_size);
+    } else if (arg == "--files") {
+      ok = number(options.files) && options.files > 0;
+    } else if (arg == "--listing-entries") {
+      ok = number(options.listing_entries) && options.listing_entries > 0;
+    } else if (arg == "--port") {
+      ok = number(options.port);
+    } else if (arg == "--loop-interval-ms") {
+      ok = number(options.loop_interval_ms);
+    } else if (arg == "--download-buffer-size") {
+      ok = number(options.download_buffer_size);
+    } else if (arg == "--upload-buffer-size") {
+      ok = number(options.upload_buffer_size);
+    } else if (arg == "--max-bandwidth") {
+      ok = number(options.max_bandwidth);
+    } else if (arg == "--session-bandwidth") {
+      ok = number(options.session_bandwidth);
+    } else if (arg == "--listing-cache-size") {
+      ok = number(options.listing_cache_size);
+    } else if (arg == "--max-sessions") {
+      ok = number(options.max_sessions) && options.max_sessions > 0 && options.max_sessions <= 16;
+    } else if (arg == "--max-transfers") {
+      ok = number(options.max_transfers);
+    } else if (arg == "--staging-size") {
+      ok = number(options.staging_size);
+    } else if (arg == "--ram-volume-size") {
+      ok = number(options.ram_volume_size);
+    } else if (arg == "--storage") {
+      const char *text = value();
+      std::string name = text != nullptr ? text : "";
+      ok = name == "sd_card" || name == "ram";
+      options.ram_storage = name == "ram";
+    } else if (arg == "--passive-ports") {
+      const char *text = value();
+      unsigned start, end;
+      ok = text != nullptr && sscanf(text, "%u-%u", &start, &end) == 2 && start <= end && end < 65536;
+      options.passive_start = ok ? start : 0;
+      options.passive_end = ok ? end : 0;
+    } else if (arg == "--workload") {
+      const char *text = value();
+      std::string name = text != nullptr ? text : "";
+      ok = false;
+      for (int w = WORKLOAD_LIST; w <= WORKLOAD_MIXED; w++) {
+        if (name == workload_name(static_cast<Workload>(w))) {
+          options.workload = static_cast<Workload>(w);
+          ok = true;
+        }
+      }
+    } else if (arg == "--root") {
+      const char *text = value();
+      ok = text != nullptr;
+      options.root = ok ? text : "";
+      options.keep_root = true;
+    } else if (arg == "--keep-root") {
+      options.keep_root = true;
+    } else if (arg == "--stat") {
+      options.server_stat = true;
+    } else if (arg == "--verbose") {
+      options.verbose = true;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr, "invalid option: %s\n", arg.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    usage(argv[0]);
+    return 2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  if (!options.verbose) {
+    setenv("FTP_HOST_QUIET", "1", 0);
+  }
+  if (options.root.empty()) {
+    char pattern[] = "/tmp/ftp_bench.XXXXXX";
+    if (mkdtemp(pattern) == nullptr) {
+      perror("mkdtemp");
+      return 1;
+    }
+    options.root = pattern;
+  }
+  if (!options.ram_storage) {
+    populate_root(options);
+  }
+
+  FTPServer server;
+  server.set_port(options.port);
+  server.set_username("bench");
+  server.set_password("bench");
+  server.set_root_path(options.root);
+  if (options.download_buffer_size > 0)
+    server.set_download_buffer_size(options.download_buffer_size);
+  if (options.upload_buffer_size > 0)
+    server.set_upload_buffer_size(options.upload_buffer_size);
+  if (options.listing_cache_size >= 0)
+    server.set_listing_cache_size(options.listing_cache_size);
+  if (options.max_sessions > 0)
+    server.set_max_sessions(options.max_sessions);
+  if (options.max_transfers > 0)
+    server.set_max_transfers(options.max_transfers);
+  if (options.passive_start > 0)
+    server.set_passive_port_range(options.passive_start, options.passive_end);
+  if (options.ram_storage) {
+    server.set_storage_type(esphome::ftp_server::FTP_STORAGE_RAM);
+    // Room for the served files, the listing and every upload
+    uint64_t needed = uint64_t(options.files + options.sessions * options.iterations) * (options.file_size + 4096) +
+                      options.listing_entries * 4096 + (1 << 20);
+    server.set_ram_volume_size(options.ram_volume_size > 0 ? options.ram_volume_size
+                                                           : std::min<uint64_t>(needed, UINT32_MAX));
+  }
+  server.set_staging_size(options.staging_size);
+  server.set_max_bandwidth(options.max_bandwidth);
+  server.set_session_bandwidth(options.session_bandwidth);
+  server.setup();
+  if (!server.is_running()) {
+    fprintf(stderr, "server failed to start on port %u\n", options.port);
+    return 1;
+  }
+
+  // Same cadence as the ESPHome main loop: back to back while a component
+  // asks for high frequency, otherwise once per loop interval.
+  std::atomic<bool> stop{false};
+  // Back to back while filling a RAM volume too, it is not measured.
+  std::atomic<bool> populating{options.ram_storage};
+  std::thread loop_thread([&]() {
+    while (!stop) {
+      server.loop();
+      if (populating || HighFrequencyLoopRequester::is_high_frequency()) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(options.loop_interval_ms));
+      }
+    }
+  });
+
+  if (options.ram_storage && !populate_over_ftp(options)) {
+    fprintf(stderr, "could not fill the RAM volume\n");
+    stop = true;
+    loop_thread.join();
+    return 1;
+  }
+  populating = false;
+
+  std::vector<char> upload(options.file_size);
+  std::mt19937 random(7);
+  for (auto &byte : upload) {
+    byte = static_cast<char>(random());
+  }
+
+  std::vector<Samples> per_session(options.sessions);
+  std::vector<std::thread> clients;
+  Clock::time_point start = Clock::now();
+  for (int id = 0; id < options.sessions; id++) {
+    clients.emplace_back(run_session, std::cref(options), id, std::cref(upload), std::ref(per_session[id]));
+  }
+  for (auto &client : clients) {
+    client.join();
+  }
+  double wall = elapsed_us(start) / 1e6;
+  stop = true;
+  loop_thread.join();
+
+  Samples total;
+  for (const auto &samples : per_session) {
+    total.merge(samples);
+  }
+  printf("workload %s: %d sessions x %d iterations, %zu byte files, %d listing entries\n",
+         workload_name(options.workload), options.sessions, options.iterations, options.file_size,
+         options.listing_entries);
+  printf("%-18s %.3f s\n", "wall time", wall);
+  printf("%-18s %u (%u failed), %.1f MB moved, %.2f MB/s aggregate\n", "transfers", total.transfers,
+         total.failures, total.bytes / 1e6, total.bytes / 1e6 / wall);
+  if (!total.transfer_rate.empty()) {
+    printf("%-18s p50=%.2f MB/s p1=%.2f MB/s\n", "per transfer", percentile(total.transfer_rate, 50) / 1e6,
+           percentile(total.transfer_rate, 1) / 1e6);
+  }
+  print_distribution("command latency", total.command_us);
+  print_distribution("transfer TTFB", total.ttfb_us);
+
+  if (!options.keep_root) {
+    std::error_code error;
+    fs::remove_all(options.root, error);
+  }
+  return total.failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+// Host tests for the SITE DELTA applier (ftp_delta.cpp), on a RAM volume.
+#include "ftp_server.h"
+#include "test_check.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <string>
+
+using namespace esphome::ftp_server;
+
+static const char *const PATH = "/r/f";
+static const char *const TEMP_PATH = "/r/.ftp_tmp/0-1";
+static const size_t BLOCK_SIZE = 512;
+
+static bool write_file(FTPStorage &storage, const std::string &path, const std::string &data) {
+  FTPFilePtr file = storage.open(path, O_WRONLY | O_CREAT | O_TRUNC);
+  return file && file->write(reinterpret_cast<const uint8_t *>(data.data()), data.size()) ==
+                     static_cast<ssize_t>(data.size()) &&
+         file->close() == 0;
+}
+
+// Content of path, or "<missing>"
+static std::string read_file(FTPStorage &storage, const std::string &path) {
+  FTPFilePtr file = storage.open(path, O_RDONLY);
+  if (!file) {
+    return "<missing>";
+  }
+  std::string data;
+  uint8_t buffer[4096];
+  ssize_t n;
+  while ((n = file->read(buffer, sizeof(buffer))) > 0) {
+    data.append(reinterpret_cast<char *>(buffer), n);
+  }
+  return data;
+}
+
+static std::string be32(uint32_t value) {
+  return {static_cast<char>(value >> 24), static_cast<char>(value >> 16), static_cast<char>(value >> 8),
+          static_cast<char>(value)};
+}
+static std::string copy(uint32_t first_block, uint32_t count) { return "C" + be32(first_block) + be32(count); }
+static std::string literal(const std::string &data) { return "L" + be32(data.size()) + data; }
+static const char END[] = "E";
+
+// A volume holding PATH with old as its content, and the temporary directory
+static FTPStoragePtr make_volume(const std::string &old) {
+  FTPStoragePtr storage = make_ram_storage("/r", 1 << 21);
+  storage->mkdir("/r/.ftp_tmp");
+  CHECK(write_file(*storage, PATH, old));
+  return storage;
+}
+
+static FTPFilePtr make_applier(FTPStorage &storage, bool with_basis = true) {
+  FTPFilePtr basis;
+  size_t basis_size = 0;
+  if (with_basis) {
+    basis = storage.open(PATH, O_RDONLY);
+    basis_size = basis->size();
+  }
+  FTPFilePtr temp = storage.open(TEMP_PATH, O_WRONLY | O_CREAT | O_TRUNC);
+  return make_delta_applier(storage, std::move(basis), basis_size, std::move(temp), TEMP_PATH, PATH, BLOCK_SIZE,
+                            allocate_transfer_buffer(16384, true));
+}
+
+// Writes delta chunk bytes at a time, giving back what a short write left as
+// step_receive() does. Returns false once a write() fails.
+static bool feed(FTPFile &applier, const std::string &delta, size_t chunk, bool *short_write = nullptr) {
+  for (size_t pos = 0; pos < delta.size();) {
+    size_t len = std::min(chunk, delta.size() - pos);
+    ssize_t n = applier.write(reinterpret_cast<const uint8_t *>(delta.data()) + pos, len);
+    if (n < 0) {
+      return false;
+    }
+    if (short_write != nullptr && static_cast<size_t>(n) < len) {
+      *short_write = true;
+    }
+    pos += n;
+  }
+  return true;
+}
+
+static std::string pattern(size_t size, int seed) {
+  std::string data;
+  for (size_t i = 0; i < size; i++) {
+    data += static_cast<char>(i * 31 + seed);
+  }
+  return data;
+}
+
+static bool temp_removed(FTPStorage &storage) {
+  struct stat entry_stat;
+  return storage.stat(TEMP_PATH, &entry_stat) != 0;
+}
+
+static void test_apply() {
+  std::string old = pattern(4 * BLOCK_SIZE + 100, 1);
+  FTPStoragePtr storage = make_volume(old);
+  // Blocks 2 and 3, new bytes, then block 0 and the short last block
+  std::string delta = copy(2, 2) + literal("new bytes") + copy(0, 1) + copy(4, 1) + END;
+  std::string expected = old.substr(2 * BLOCK_SIZE, 2 * BLOCK_SIZE) + "new bytes" + old.substr(0, BLOCK_SIZE) +
+                         old.substr(4 * BLOCK_SIZE);
+  for (size_t chunk : {size_t(1), size_t(7), delta.size()}) {
+    CHECK(write_file(*storage, PATH, old));
+    FTPFilePtr applier = make_applier(*storage);
+    CHECK(feed(*applier, delta, chunk));
+    CHECK(applier->close() == 0);
+    CHECK(read_file(*storage, PATH) == expected);
+    CHECK(temp_removed(*storage));
+  }
+}
+
+// A copy running past the end stops there; one starting past it is an error.
+static void test_copy_range() {
+  std::string old = pattern(2 * BLOCK_SIZE + 10, 2);
+  FTPStoragePtr storage = make_volume(old);
+  FTPFilePtr applier = make_applier(*storage);
+  CHECK(feed(*applier, copy(1, 100) + END, 64));
+  CHECK(applier->close() == 0);
+  CHECK(read_file(*storage, PATH) == old.substr(BLOCK_SIZE));
+
+  CHECK(write_file(*storage, PATH, old));
+  applier = make_applier(*storage);
+  CHECK(!feed(*applier, literal("x") + copy(3, 1) + END, 64));
+  CHECK(applier->write(reinterpret_cast<const uint8_t *>(END), 1) < 0);
+  CHECK(applier->close() != 0);
+  CHECK(read_file(*storage, PATH) == old);
+  CHECK(temp_removed(*storage));
+
+  // Nothing to copy from for a new file
+  applier = make_applier(*storage, false);
+  CHECK(!feed(*applier, copy(0, 1) + END, 64));
+  CHECK(applier->close() != 0);
+  CHECK(read_file(*storage, PATH) == old);
+}
+
+static void test_truncated() {
+  std::string old = pattern(3 * BLOCK_SIZE, 3);
+  FTPStoragePtr storage = make_volume(old);
+  std::string delta = copy(0, 2) + literal("tail") + END;
+  // Cut in a copy, in a literal, and just before the end
+  for (size_t len : {size_t(5), size_t(12), delta.size() - 3, delta.size() - 1}) {
+    FTPFilePtr applier = make_applier(*storage);
+    CHECK(feed(*applier, delta.substr(0, len), 4));
+    CHECK(applier->close() != 0);
+    CHECK(read_file(*storage, PATH) == old);
+    CHECK(temp_removed(*storage));
+  }
+}
+
+static void test_bad_data() {
+  std::string old = pattern(BLOCK_SIZE, 4);
+  FTPStoragePtr storage = make_volume(old);
+  FTPFilePtr applier = make_applier(*storage);
+  CHECK(!feed(*applier, literal("x") + END + "L", 64));
+  CHECK(applier->close() != 0);
+  CHECK(read_file(*storage, PATH) == old);
+  CHECK(temp_removed(*storage));
+
+  applier = make_applier(*storage);
+  CHECK(!feed(*applier, std::string("X") + END, 64));
+  CHECK(applier->close() != 0);
+  CHECK(read_file(*storage, PATH) == old);
+}
+
+// Copies are bounded per write(): a delta of many small instructions that
+// copy large ranges is taken a piece at a time.
+static void test_copy_budget() {
+  std::string old = pattern(128 * BLOCK_SIZE, 5);
+  FTPStoragePtr storage = make_volume(old);
+  std::string delta;
+  std::string expected;
+  for (int i = 0; i < 16; i++) {
+    delta += copy(0, 128);
+    expected += old;
+  }
+  delta += END;
+  FTPFilePtr applier = make_applier(*storage);
+  ssize_t first = applier->write(reinterpret_cast<const uint8_t *>(delta.data()), delta.size());
+  CHECK(first >= 0 && static_cast<size_t>(first) < delta.size());
+  bool short_write = false;
+  CHECK(feed(*applier, delta.substr(first), delta.size(), &short_write));
+  CHECK(short_write);
+  CHECK(applier->close() == 0);
+  CHECK(read_file(*storage, PATH) == expected);
+}
+
+int main() {
+  test_apply();
+  test_copy_range();
+  test_truncated();
+  test_bad_data();
+  test_copy_budget();
+  return ftp_test::result();
+}
@@ -0,0 +1,69 @@
+// Host tests for the SITE FIND and glob helpers (ftp_find.cpp).
+#include "ftp_server.h"
+#include "test_check.h"
+
+using esphome::ftp_server::glob_match;
+using esphome::ftp_server::has_glob;
+using esphome::ftp_server::parse_mdtm_time;
+
+static void test_glob_match() {
+  CHECK(glob_match("*", ""));
+  CHECK(glob_match("*", "name.txt"));
+  CHECK(glob_match("*.txt", "name.txt"));
+  CHECK(!glob_match("*.txt", "name.txt.bak"));
+  CHECK(glob_match("name.???", "name.log"));
+  CHECK(!glob_match("name.???", "name.lo"));
+  CHECK(!glob_match("?", ""));
+
+  // FAT compares ASCII letters without case.
+  CHECK(glob_match("*.JPG", "photo.jpg"));
+  CHECK(glob_match("Photo*", "PHOTO_1"));
+
+  // Backtracking to the last '*' only
+  CHECK(glob_match("a*b*c", "axxbyybzzc"));
+  CHECK(!glob_match("a*b*c", "axxbyybzz"));
+  CHECK(glob_match("*a*a*a", "aaaa"));
+  CHECK(glob_match("**x", "x"));
+
+  CHECK(glob_match("log[0-9].txt", "log7.txt"));
+  CHECK(!glob_match("log[0-9].txt", "logx.txt"));
+  CHECK(glob_match("log[!0-9].txt", "logx.txt"));
+  CHECK(glob_match("log[^0-9].txt", "logx.txt"));
+  CHECK(!glob_match("log[!0-9].txt", "log7.txt"));
+  CHECK(glob_match("[a-c]*", "Beta"));
+  CHECK(glob_match("[abc]x", "cx"));
+  // A ']' right after '[' belongs to the set; an unclosed '[' is literal.
+  CHECK(glob_match("[]]", "]"));
+  CHECK(glob_match("a[b", "a[b"));
+  CHECK(!glob_match("a[b", "ab"));
+
+  CHECK(has_glob("*.txt"));
+  CHECK(has_glob("file?"));
+  CHECK(has_glob("[ab]"));
+  CHECK(!has_glob("plain.txt"));
+}
+
+static void test_parse_mdtm_time() {
+  time_t time = -1;
+  CHECK(parse_mdtm_time("19700101000000", &time) && time == 0);
+  CHECK(parse_mdtm_time("20240229123456", &time) && time == 1709210096);
+  CHECK(parse_mdtm_time("20001231235959", &time) && time == 978307199);
+
+  time = 42;
+  CHECK(!parse_mdtm_time("", &time));
+  CHECK(!parse_mdtm_time("2024022912345", &time));
+  CHECK(!parse_mdtm_time("202402291234560", &time));
+  CHECK(!parse_mdtm_time("2024022912345x", &time));
+  CHECK(!parse_mdtm_time("-2024022912345", &time));
+  CHECK(!parse_mdtm_time("20241329123456", &time));
+  CHECK(!parse_mdtm_time("20240200123456", &time));
+  CHECK(!parse_mdtm_time("20240229243456", &time));
+  CHECK(!parse_mdtm_time("20240229126056", &time));
+  CHECK(time == 42);
+}
+
+int main() {
+  test_glob_match();
+  test_parse_mdtm_time();
+  return ftp_test::result();
+}
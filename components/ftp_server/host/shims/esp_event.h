@@ -0,0 +1,14 @@
+#pragma once
+// Pas de boucle d'événements sur l'hôte : l'enregistrement réussit et rien n'est jamais publié.
+#include <cstdint>
+#include "esp_err.h"
+
+typedef const char *esp_event_base_t;
+typedef void (*esp_event_handler_t)(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
+
+static esp_event_base_t const IP_EVENT = "IP_EVENT";
+#define ESP_EVENT_ANY_ID -1
+
+inline esp_err_t esp_event_handler_register(esp_event_base_t, int32_t, esp_event_handler_t, void *) {
+  return ESP_OK;
+}
@@ -0,0 +1,25 @@
+#pragma once
+// Journal ESP-IDF sur stderr. ESP_LOGD/ESP_LOGV ne sortent qu'avec FTP_HOST_VERBOSE=1.
+#include <cstdio>
+#include <cstdlib>
+
+#define ESP_HOST_LOG(letter, tag, format, ...) fprintf(stderr, "[" letter "][%s] " format "\n", tag, ##__VA_ARGS__)
+#define ESP_HOST_VERBOSE() (getenv("FTP_HOST_VERBOSE") != nullptr)
+
+#define ESP_LOGE(tag, format, ...) ESP_HOST_LOG("E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_HOST_LOG("W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) \
+  do { \
+    if (!getenv("FTP_HOST_QUIET")) \
+      ESP_HOST_LOG("I", tag, format, ##__VA_ARGS__); \
+  } while (0)
+#define ESP_LOGD(tag, format, ...) \
+  do { \
+    if (ESP_HOST_VERBOSE()) \
+      ESP_HOST_LOG("D", tag, format, ##__VA_ARGS__); \
+  } while (0)
+#define ESP_LOGV(tag, format, ...) \
+  do { \
+    if (ESP_HOST_VERBOSE()) \
+      ESP_HOST_LOG("V", tag, format, ##__VA_ARGS__); \
+  } while (0)
@@ -0,0 +1,29 @@
+#pragma once
+// Une seule interface, sur 127.0.0.1 : c'est l'adresse annoncée par PASV.
+#include <cstdint>
+#include <arpa/inet.h>
+#include "esp_err.h"
+
+typedef struct {
+  uint32_t addr;
+} esp_ip4_addr_t;
+
+typedef struct {
+  esp_ip4_addr_t ip;
+  esp_ip4_addr_t netmask;
+  esp_ip4_addr_t gw;
+} esp_netif_ip_info_t;
+
+typedef struct esp_netif_obj esp_netif_t;
+
+inline esp_netif_t *esp_netif_get_default_netif() {
+  static char loopback;
+  return reinterpret_cast<esp_netif_t *>(&loopback);
+}
+
+inline esp_err_t esp_netif_get_ip_info(esp_netif_t *, esp_netif_ip_info_t *ip_info) {
+  ip_info->ip.addr = htonl(INADDR_LOOPBACK);
+  ip_info->netmask.addr = htonl(0xFF000000);
+  ip_info->gw.addr = 0;
+  return ESP_OK;
+}
@@ -0,0 +1,27 @@
+#pragma once
+// Juste ce dont FTPServer a besoin de esphome::Component.
+#include <cstdint>
+
+namespace esphome {
+
+namespace setup_priority {
+const float AFTER_WIFI = 250.0f;
+const float LATE = -100.0f;
+}  // namespace setup_priority
+
+class Component {
+ public:
+  virtual ~Component() = default;
+  virtual void setup() {}
+  virtual void loop() {}
+  virtual void dump_config() {}
+  virtual float get_setup_priority() const { return 0.0f; }
+
+  void mark_failed() { failed_ = true; }
+  bool is_failed() const { return failed_; }
+
+ protected:
+  bool failed_{false};
+};
+
+}  // namespace esphome
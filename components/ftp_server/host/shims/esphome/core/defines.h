@@ -0,0 +1,2 @@
+#pragma once
+// Les USE_* viennent des options de CMake (FTP_HOST_MODE_Z...), pas du YAML.
@@ -0,0 +1,17 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+namespace esphome {
+
+inline uint32_t millis() {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint32_t micros() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace esphome
@@ -0,0 +1,30 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+namespace esphome {
+
+// Same contract as ESPHome: while any requester is started, the application
+// calls loop() back to back instead of once per loop interval.
+class HighFrequencyLoopRequester {
+ public:
+  void start() {
+    if (!started_) {
+      started_ = true;
+      num_requests_++;
+    }
+  }
+  void stop() {
+    if (started_) {
+      started_ = false;
+      num_requests_--;
+    }
+  }
+  static bool is_high_frequency() { return num_requests_ > 0; }
+
+ protected:
+  bool started_{false};
+  static inline std::atomic<uint32_t> num_requests_{0};
+};
+
+}  // namespace esphome
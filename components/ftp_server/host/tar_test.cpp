@@ -0,0 +1,191 @@
+// Host tests for RETR <dir>.tar and SITE UNTAR (ftp_tar.cpp), on a RAM volume.
+#include "ftp_server.h"
+#include "test_check.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+
+using namespace esphome::ftp_server;
+
+static const char *const ROOT = "/r";
+static const char *const TEMP_PATH = "/r/.ftp_tmp/0-1";
+
+static bool write_file(FTPStorage &storage, const std::string &path, const std::string &data) {
+  FTPFilePtr file = storage.open(path, O_WRONLY | O_CREAT | O_TRUNC);
+  return file && file->write(reinterpret_cast<const uint8_t *>(data.data()), data.size()) ==
+                     static_cast<ssize_t>(data.size()) &&
+         file->close() == 0;
+}
+
+// Content of path, or "<missing>"
+static std::string read_file(FTPStorage &storage, const std::string &path) {
+  FTPFilePtr file = storage.open(path, O_RDONLY);
+  if (!file) {
+    return "<missing>";
+  }
+  std::string data;
+  uint8_t buffer[700];
+  ssize_t n;
+  while ((n = file->read(buffer, sizeof(buffer))) > 0) {
+    data.append(reinterpret_cast<char *>(buffer), n);
+  }
+  return data;
+}
+
+static bool exists(FTPStorage &storage, const std::string &path) {
+  struct stat entry_stat;
+  return storage.stat(path, &entry_stat) == 0;
+}
+
+// Reads a generated stream to its end, in odd-sized steps
+static std::string read_stream(FTPFile &stream) {
+  std::string data;
+  uint8_t buffer[1000];
+  for (;;) {
+    ssize_t n = stream.read(buffer, sizeof(buffer));
+    if (n < 0 && errno == EAGAIN) {
+      continue;
+    }
+    if (n <= 0) {
+      CHECK(n == 0);
+      return data;
+    }
+    data.append(reinterpret_cast<char *>(buffer), n);
+  }
+}
+
+// Feeds archive to a new extractor chunk bytes at a time, giving back what a
+// short write left, as step_receive() does. Returns the result of close().
+static int extract(FTPStorage &storage, const std::string &dir, const std::string &archive, size_t chunk,
+                   bool *short_write = nullptr) {
+  FTPFilePtr extractor = make_tar_extractor(storage, dir, TEMP_PATH);
+  for (size_t pos = 0; pos < archive.size();) {
+    size_t len = std::min(chunk, archive.size() - pos);
+    ssize_t n = extractor->write(reinterpret_cast<const uint8_t *>(archive.data()) + pos, len);
+    if (n <= 0) {
+      return -2;
+    }
+    if (short_write != nullptr && static_cast<size_t>(n) < len) {
+      *short_write = true;
+    }
+    pos += n;
+  }
+  return extractor->close();
+}
+
+// One ustar member, as tar writes it
+static std::string member(const std::string &name, const std::string &data, char type = '0') {
+  char header[512] = {};
+  snprintf(header, 100, "%s", name.c_str());
+  snprintf(header + 100, 8, "%07o", 0644);
+  snprintf(header + 124, 12, "%011o", static_cast<unsigned>(data.size()));
+  snprintf(header + 136, 12, "%011o", 0u);
+  header[156] = type;
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+  memset(header + 148, ' ', 8);
+  unsigned sum = 0;
+  for (unsigned char c : header) {
+    sum += c;
+  }
+  snprintf(header + 148, 8, "%06o", sum);
+  std::string block(header, sizeof(header));
+  block += data;
+  block.append((512 - data.size() % 512) % 512, '\0');
+  return block;
+}
+
+static std::string end_of_archive() { return std::string(1024, '\0'); }
+
+static void test_round_trip() {
+  FTPStoragePtr storage = make_ram_storage(ROOT, 1 << 20);
+  std::string big;
+  for (int i = 0; i < 3000; i++) {
+    big += static_cast<char>(i * 7);
+  }
+  storage->mkdir("/r/.ftp_tmp");
+  storage->mkdir("/r/src");
+  storage->mkdir("/r/src/sub");
+  storage->mkdir("/r/src/empty");
+  storage->mkdir("/r/src/.ftp_tmp");
+  CHECK(write_file(*storage, "/r/src/a.txt", "hello\n"));
+  CHECK(write_file(*storage, "/r/src/sub/big.bin", big));
+  CHECK(write_file(*storage, "/r/src/zero", ""));
+  CHECK(write_file(*storage, "/r/src/.ftp_tmp/upload", "in progress"));
+  storage->mkdir("/r/dst");
+  CHECK(write_file(*storage, "/r/dst/a.txt", "old content"));
+
+  FTPFilePtr stream = make_tar_stream(*storage, "/r/src");
+  std::string archive = read_stream(*stream);
+  CHECK(stream->close() == 0);
+  CHECK(archive.size() % 512 == 0);
+  CHECK(archive.find("upload") == std::string::npos);
+
+  CHECK(extract(*storage, "/r/dst", archive, 333) == 0);
+  CHECK(read_file(*storage, "/r/dst/a.txt") == "hello\n");
+  CHECK(read_file(*storage, "/r/dst/sub/big.bin") == big);
+  CHECK(read_file(*storage, "/r/dst/zero").empty());
+  struct stat entry_stat;
+  CHECK(storage->stat("/r/dst/empty", &entry_stat) == 0 && S_ISDIR(entry_stat.st_mode));
+  CHECK(!exists(*storage, "/r/dst/.ftp_tmp"));
+  CHECK(!exists(*storage, TEMP_PATH));
+}
+
+static void test_members_outside() {
+  FTPStoragePtr storage = make_ram_storage(ROOT, 1 << 20);
+  storage->mkdir("/r/.ftp_tmp");
+  storage->mkdir("/r/dst");
+  std::string archive = member("../evil", "x") + member("/abs", "x") + member("sub/../../evil2", "x") +
+                        member(".ftp_tmp/0-1", "x") + member("sub/.ftp_tmp/x", "x") +
+                        member("./inside/../ok", "fine") + end_of_archive();
+  CHECK(extract(*storage, "/r/dst", archive, archive.size()) == 0);
+  CHECK(!exists(*storage, "/r/evil"));
+  CHECK(!exists(*storage, "/r/evil2"));
+  CHECK(!exists(*storage, "/abs"));
+  CHECK(read_file(*storage, "/r/dst/abs") == "x");
+  CHECK(!exists(*storage, "/r/dst/.ftp_tmp"));
+  CHECK(!exists(*storage, "/r/dst/sub/.ftp_tmp"));
+  CHECK(read_file(*storage, "/r/dst/ok") == "fine");
+  CHECK(!exists(*storage, TEMP_PATH));
+}
+
+// A member cut short leaves the file it would have replaced alone.
+static void test_truncated() {
+  FTPStoragePtr storage = make_ram_storage(ROOT, 1 << 20);
+  storage->mkdir("/r/.ftp_tmp");
+  storage->mkdir("/r/dst");
+  CHECK(write_file(*storage, "/r/dst/f", "old content"));
+  std::string archive = member("g", "complete") + member("f", std::string(5000, 'n')) + end_of_archive();
+  CHECK(extract(*storage, "/r/dst", archive.substr(0, 512 + 512 + 512 + 2000), 512) == -1);
+  CHECK(read_file(*storage, "/r/dst/g") == "complete");
+  CHECK(read_file(*storage, "/r/dst/f") == "old content");
+  CHECK(!exists(*storage, TEMP_PATH));
+}
+
+// Members are created a few per write(), the caller giving back the rest.
+static void test_members_per_write() {
+  FTPStoragePtr storage = make_ram_storage(ROOT, 1 << 20);
+  storage->mkdir("/r/.ftp_tmp");
+  storage->mkdir("/r/dst");
+  std::string archive;
+  for (int i = 0; i < 100; i++) {
+    archive += member("d" + std::to_string(i), "", '5') + member("f" + std::to_string(i), "");
+  }
+  archive += end_of_archive();
+  bool short_write = false;
+  CHECK(extract(*storage, "/r/dst", archive, archive.size(), &short_write) == 0);
+  CHECK(short_write);
+  CHECK(exists(*storage, "/r/dst/d99"));
+  CHECK(exists(*storage, "/r/dst/f99"));
+}
+
+int main() {
+  test_round_trip();
+  test_members_outside();
+  test_truncated();
+  test_members_per_write();
+  return ftp_test::result();
+}
@@ -0,0 +1,29 @@
+// CHECK() for the host tests: a failed check is reported and counted, and
+// the test goes on so one run shows every failure.
+#pragma once
+
+#include <cstdio>
+
+namespace ftp_test {
+
+inline int failures = 0;
+
+inline void check(bool ok, const char *expression, const char *file, int line) {
+  if (!ok) {
+    fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, expression);
+    failures++;
+  }
+}
+
+// Exit status for main()
+inline int result() {
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace ftp_test
+
+#define CHECK(expression) ftp_test::check(static_cast<bool>(expression), #expression, __FILE__, __LINE__)
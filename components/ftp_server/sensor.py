@@ -0,0 +1,90 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.components import sensor
+from esphome.const import (
+    ENTITY_CATEGORY_DIAGNOSTIC,
+    STATE_CLASS_MEASUREMENT,
+    STATE_CLASS_TOTAL_INCREASING,
+    UNIT_BYTES,
+    UNIT_MILLISECOND,
+    ICON_TIMER,
+)
+from . import FTPServer, CONF_FTP_SERVER_ID
+
+DEPENDENCIES = ["ftp_server"]
+
+CONF_BYTES_SENT = "bytes_sent"
+CONF_BYTES_RECEIVED = "bytes_received"
+CONF_ACTIVE_SESSIONS = "active_sessions"
+CONF_ACTIVE_TRANSFERS = "active_transfers"
+CONF_TRANSFER_THROUGHPUT = "transfer_throughput"
+CONF_RETR_TTFB = "retr_ttfb"
+CONF_COMMAND_LATENCY = "command_latency"
+CONF_ACCEPT_LATENCY = "accept_latency"
+CONF_SESSION_MEMORY = "session_memory"
+
+UNIT_BYTES_PER_SECOND = "B/s"
+
+BYTES_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_BYTES,
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_TOTAL_INCREASING,
+)
+COUNT_SCHEMA = sensor.sensor_schema(
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_MEASUREMENT,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+)
+# Moyenne sur l'intervalle de publication (10 s)
+LATENCY_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_MILLISECOND,
+    icon=ICON_TIMER,
+    accuracy_decimals=1,
+    state_class=STATE_CLASS_MEASUREMENT,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+)
+
+CONFIG_SCHEMA = cv.Schema(
+    {
+        cv.GenerateID(CONF_FTP_SERVER_ID): cv.use_id(FTPServer),
+        cv.Optional(CONF_BYTES_SENT): BYTES_SCHEMA,
+        cv.Optional(CONF_BYTES_RECEIVED): BYTES_SCHEMA,
+        cv.Optional(CONF_ACTIVE_SESSIONS): COUNT_SCHEMA,
+        cv.Optional(CONF_ACTIVE_TRANSFERS): COUNT_SCHEMA,
+        cv.Optional(CONF_TRANSFER_THROUGHPUT): sensor.sensor_schema(
+            unit_of_measurement=UNIT_BYTES_PER_SECOND,
+            accuracy_decimals=0,
+            state_class=STATE_CLASS_MEASUREMENT,
+        ),
+        cv.Optional(CONF_RETR_TTFB): LATENCY_SCHEMA,
+        cv.Optional(CONF_COMMAND_LATENCY): LATENCY_SCHEMA,
+        cv.Optional(CONF_ACCEPT_LATENCY): LATENCY_SCHEMA,
+        # Mémoire tenue par les sessions : slots, tampons de transfert, zlib
+        cv.Optional(CONF_SESSION_MEMORY): sensor.sensor_schema(
+            unit_of_measurement=UNIT_BYTES,
+            accuracy_decimals=0,
+            state_class=STATE_CLASS_MEASUREMENT,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+    }
+)
+
+TYPES = [
+    CONF_BYTES_SENT,
+    CONF_BYTES_RECEIVED,
+    CONF_ACTIVE_SESSIONS,
+    CONF_ACTIVE_TRANSFERS,
+    CONF_TRANSFER_THROUGHPUT,
+    CONF_RETR_TTFB,
+    CONF_COMMAND_LATENCY,
+    CONF_ACCEPT_LATENCY,
+    CONF_SESSION_MEMORY,
+]
+
+
+async def to_code(config):
+    ftp_server = await cg.get_variable(config[CONF_FTP_SERVER_ID])
+    for key in TYPES:
+        if key in config:
+            sens = await sensor.new_sensor(config[key])
+            cg.add(getattr(ftp_server, f"set_{key}_sensor")(sens))